@@ -3,369 +3,713 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <string>
+#include <cstring>
 #include <cstdlib> // Pentru rand()
 #include <ctime>   // Pentru srand()
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fstream>
 #include <iostream>
+#include <memory>
+
+#include "protocol.h"
+#include "segment_store.h"
+#include "payload.h"
+#include "tracker.h"
+#include "trace.h"
+
 using namespace std;
 
-#define TRACKER_RANK 0
-#define MAX_FILES 10
-#define MAX_FILENAME 15
-#define HASH_SIZE 32
-#define MAX_CHUNKS 100
+#define DEFAULT_REQUEST_WINDOW 8
+#define DEFAULT_UPLOAD_THREADS 4
+
+/* Segment selection policies (--selection) */
+#define SELECTION_RAREST 0
+#define SELECTION_SEQUENTIAL 1
+
+/* What a peer asks the tracker for when it updates its seeders (--seeder-updates) */
+#define SEEDER_UPDATES_DELTA 0
+#define SEEDER_UPDATES_FULL 1
+
+/* Which of the files being downloaded gets the next request first (--file-priority) */
+#define FILE_PRIORITY_SHORTEST 0    /* the file with the fewest missing segments, so files complete early */
+#define FILE_PRIORITY_ORDER 1       /* the order of the input */
 
-#define INIT_MSG_FROM_PEER 0
-#define FILE_REQUEST_MSG 1
-#define RESEND_SEEDERS_MSG 2
-#define REQUEST_SEGMENT 3
-#define RECEIVED_ALL_FILES 4
-#define CLIENT_CLOSE_UPLOAD 5
+/* Weight of the last response in the moving average of the response time of a seeder */
+#define LATENCY_WEIGHT 0.2
+/* Response time assumed for a seeder that did not answer yet, so it gets tried */
+#define MIN_LATENCY 1e-5
 
+/* The files of the input of a peer, moved to segment_store once the tracker gives the file IDs */
 map<string, vector<string>> owned_files_by_peer;
-map<string, vector<string>> owned_files_by_tracker;
-map<string, set<int>> seeders_map;
+/* The segments the upload workers serve, by file ID */
+segment_store owned_segments;
+/* The ID of every file, given by the tracker: the tracker numbers them, the peers get them with the ACK */
+map<string, int> file_ids;
 vector<string> wanted_files;
+/*
+ * Payload mode: the mapped files of the peer by their name on disk, seeded (seed<rank>_<file>)
+ * or downloaded (client<rank>_<file>), kept until it exits: the upload workers may still read
+ * the seed of a file the peer downloads
+ */
+map<string, unique_ptr<mapped_file>> payload_files;
+
+/* Segment requests a peer keeps in flight at the same time (--window) */
+int request_window = DEFAULT_REQUEST_WINDOW;
+/* Upload worker threads of a peer (--upload-threads) */
+int upload_threads = DEFAULT_UPLOAD_THREADS;
+int selection = SELECTION_RAREST;
+int seeder_updates = SEEDER_UPDATES_DELTA;
+int file_priority = FILE_PRIORITY_SHORTEST;
+/* Files a peer downloads at the same time (--max-files), 0 for all of them */
+int max_files = 0;
+
+/* A segment request in flight; the buffers must stay alive until the send and the receive complete */
+struct segment_request {
+    message request = message(REQUEST_SEGMENT);
+    struct file_download *download;
+    int segment_idx;
+    int seeder;
+    double sent_at;
+    vector<char> response = vector<char>(SEGMENT_MSG_SIZE);
+    MPI_Request send;
+};
+
+/* Load of a seeder, over all the files the peer downloads from it */
+struct seeder_load {
+    int in_flight = 0;
+    double latency = 0;     /* moving average of the response time, 0 before the first response */
+};
+
+/* A file being downloaded */
+struct file_download {
+    string file;
+    int file_id;
+    int position;           /* position of the file in wanted_files */
+    char *payload = NULL;   /* the mapped output file, in payload mode */
+    vector<string> hashes;
+    vector<string> received;
+    int recv_segments = 0;
+    double seeders_updated_at = 0;  /* time of the last seeder update, the oldest file is updated next */
+    vector<bool> in_flight;
+    vector<int> holders;    /* number of seeders (other than this peer) known to have each segment */
+    vector<int> order;      /* the order segments are considered in: shuffled per peer for rarest first */
+    map<int, segment_bitmap> seeders;   /* the segments of every seeder of the file */
+    vector<int> seeder_list;
+    int next_seeder = 0;    /* round-robin position in seeder_list for the sequential policy */
+    int seeders_version = -1;   /* version of the seeders of the file at the tracker, -1 before the first list */
+};
+
+void send_init_msg_w_owned_files() {
+    /* Init message: number of owned files, then the name and all the segments of each file */
+    message init(INIT_MSG_FROM_PEER);
+    init.put_int(owned_files_by_peer.size());
 
-void send_init_msg_w_owned_files(int client_rank) {
-    /* Announce tracker that i am going to send Init message */
-    int msg_type = INIT_MSG_FROM_PEER;
-    MPI_Send(&msg_type, 1, MPI_INT, TRACKER_RANK, 0, MPI_COMM_WORLD);
+    for (const auto &[file_name, segments] : owned_files_by_peer) {
+        init.put_string(file_name);
+        init.put_int(segments.size());
+        for (const auto& segment : segments) {
+            init.put_hash(segment);
+        }
+    }
+    init.send(TRACKER_RANK, TRACKER_TAG);
+}
 
-    /* Send number of owned files */
-    int num_files = owned_files_by_peer.size();
-    MPI_Send(&num_files, 1, MPI_INT, TRACKER_RANK, 0, MPI_COMM_WORLD);
+/*
+ * Receive the seeders and their segments at the current position of a tracker response, if
+ * they changed; returns the number of seeders received
+ */
+int get_seeders(message_reader &response, file_download &download, int rank) {
+    if (response.type() == SEEDERS_NOT_MODIFIED) {
+        return 0;
+    }
 
-    for (const auto &[file_name, segments] : owned_files_by_peer) {
-        /* Send filename */
-        MPI_Send(file_name.c_str(), MAX_FILENAME, MPI_CHAR, TRACKER_RANK, 0, MPI_COMM_WORLD);
+    /* Only the seeders that changed since the version the peer had */
+    download.seeders_version = response.get_int();
+    int num_seeds = response.get_int();
+    for (int i = 0; i < num_seeds; i++) {
+        int seeder = response.get_int();
+        download.seeders[seeder] = response.get_bitmap();
+    }
+    download.seeder_list.clear();
+    for (const auto &[seeder, segments] : download.seeders) {
+        download.seeder_list.push_back(seeder);
+    }
+    if (!download.seeder_list.empty()) {
+        download.next_seeder %= download.seeder_list.size();
+    }
 
-        /* Send all the segments for the file */
-        int num_segments = segments.size();
-        MPI_Send(&num_segments, 1, MPI_INT, TRACKER_RANK, 0, MPI_COMM_WORLD);
+    fill(download.holders.begin(), download.holders.end(), 0);
+    for (const auto &[seeder, segments] : download.seeders) {
+        if (seeder == rank) {
+            continue;
+        }
+        for (size_t i = 0; i < download.holders.size(); i++) {
+            download.holders[i] += segments.test(i);
+        }
+    }
+    return num_seeds;
+}
 
-        for (const auto& segment : segments) {
-            MPI_Send(segment.c_str(), HASH_SIZE, MPI_CHAR, TRACKER_RANK, 0, MPI_COMM_WORLD);
+/* Send the tracker the segments received so far and get the seeders of the file that changed */
+void update_seeders(file_download &download, int rank) {
+    double started = tracing ? trace_now() : 0;
+    segment_bitmap own_segments(download.hashes.size());
+    for (size_t i = 0; i < download.received.size(); i++) {
+        if (!download.received[i].empty()) {
+            own_segments.set(i);
         }
     }
+
+    message update(RESEND_SEEDERS_MSG);
+    update.put_string(download.file);
+    update.put_int(seeder_updates == SEEDER_UPDATES_DELTA ? download.seeders_version : -1);
+    update.put_bitmap(own_segments);
+    update.send(TRACKER_RANK, TRACKER_TAG);
+
+    message_reader seeders = recv_message(TRACKER_RANK, TRACKER_RESPONSE_TAG);
+    int changed = get_seeders(seeders, download, rank);
+    if (tracing) {
+        trace_record(TRACE_SEEDER_REFRESH, started, trace_now(), TRACKER_RANK, download.file_id, -1, changed);
+    }
 }
 
-void *download_thread_func(void *arg)
-{
-    int rank = *(int*) arg;
+/*
+ * The next segment to request, or -1 if none can be requested now. Rarest first: the
+ * missing segment held by the fewest seeders, ties broken by the order of the peer, so
+ * peers that start together ask for different segments. Sequential: the first missing one.
+ */
+int pick_segment(const file_download &download) {
+    int chosen = -1;
+    for (int segment_idx : download.order) {
+        if (!download.received[segment_idx].empty() || download.in_flight[segment_idx]) {
+            continue;
+        }
+        if (selection == SELECTION_SEQUENTIAL) {
+            return segment_idx;
+        }
+        if (download.holders[segment_idx] > 0 &&
+            (chosen < 0 || download.holders[segment_idx] < download.holders[chosen])) {
+            chosen = segment_idx;
+        }
+    }
+    return chosen;
+}
 
-    for (const auto& file : wanted_files) {
-        /* Send file request signal to tracker */
-        int msg_type = FILE_REQUEST_MSG;
-        MPI_Send(&msg_type, 1, MPI_INT, TRACKER_RANK, 0, MPI_COMM_WORLD);
-
-        /* Send the name of the file to tracker and wait for seeders list + corresponding hashes */
-        MPI_Send(file.c_str(), MAX_FILENAME, MPI_CHAR, TRACKER_RANK, 1, MPI_COMM_WORLD);
-
-        /* Receive the hashes */
-        int num_hashes;
-        MPI_Recv(&num_hashes, 1, MPI_INT, TRACKER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        vector<string> hashes(num_hashes);
-        for (int i = 0; i < num_hashes; i++) {
-            char recv_hash[HASH_SIZE];
-            MPI_Recv(recv_hash, HASH_SIZE, MPI_CHAR, TRACKER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            hashes[i] = recv_hash;
-        }
-
-        /* Receive the seeders */
-        int num_seeds;
-        MPI_Recv(&num_seeds, 1, MPI_INT, TRACKER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        vector<int> seeds(num_seeds);
-        for (int i = 0; i < num_seeds; i++) {
-            MPI_Recv(&seeds[i], 1, MPI_INT, TRACKER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        }
-        
-        /* Now that the client has the neccessary information it can start requesting segments */
-
-        int recv_segments = 0;
-        int num_request_seeds = 0;
-        int seeder_index = 0;
-        while (recv_segments < num_hashes) {
-            /* Request one segment at a time, up to 10 */
-            for (int step = 0; step < 10 && recv_segments < num_hashes; step++) {
-                bool segment_ok = false;
-                int segment_idx = recv_segments;
-
-                while (!segment_ok) {
-                    int chosen_seeder = seeds[seeder_index];
-                    seeder_index = (seeder_index + 1) % num_seeds;
-
-                    /* check if I am not the chosen seeder */
-                    if (chosen_seeder == rank) {
-                        continue;
-                    }
-
-                    /* Request segment */
-                    int msg_type = REQUEST_SEGMENT;
-                    MPI_Send(&msg_type, 1, MPI_INT, chosen_seeder, 2, MPI_COMM_WORLD);
-                    MPI_Send(file.c_str(), MAX_FILENAME, MPI_CHAR, chosen_seeder, 2, MPI_COMM_WORLD);
-                    MPI_Send(&segment_idx, 1, MPI_INT, chosen_seeder, 2, MPI_COMM_WORLD);
-
-                    /* Wait for response from chosen seeder */
-                    char recv_segment[HASH_SIZE];
-                    int response_tag = 100 + segment_idx;
-                    MPI_Recv(recv_segment, HASH_SIZE, MPI_CHAR, chosen_seeder, response_tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-                    /* Check if I received what I was expecting */
-                    if (strcmp(recv_segment, hashes[segment_idx].c_str()) == 0) {
-                        recv_segments++;
-                        segment_ok = true;
-                        owned_files_by_peer[file].push_back(recv_segment);
-                    }
-                }
-            }
-            
-            /* Request actualized list of seeder for this file */
-            if (recv_segments < num_hashes) {
-                num_request_seeds++;
-                int update_msg_type = RESEND_SEEDERS_MSG;
-                MPI_Send(&update_msg_type, 1, MPI_INT, TRACKER_RANK, 0, MPI_COMM_WORLD);
-
-                /* Send filename */
-                MPI_Send(file.c_str(), MAX_FILENAME, MPI_CHAR, TRACKER_RANK, 1, MPI_COMM_WORLD);
-
-                /* Receive actualized list of seeders */
-                MPI_Recv(&num_seeds, 1, MPI_INT, TRACKER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                seeds.resize(num_seeds);
-                for (int i = 0; i < num_seeds; i++) {
-                    MPI_Recv(&seeds[i], 1, MPI_INT, TRACKER_RANK, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                }
+/* Expected wait for a response of a seeder: its requests in flight times its response time */
+double expected_wait(const map<int, seeder_load> &loads, int seeder) {
+    auto load = loads.find(seeder);
+    if (load == loads.end()) {
+        return MIN_LATENCY;
+    }
+    return (load->second.in_flight + 1) * max(load->second.latency, MIN_LATENCY);
+}
+
+/*
+ * The seeder to ask for a segment, or -1 if there is none. Rarest first only asks seeders
+ * that have the segment, and the one with the least expected wait (in wait). Sequential
+ * goes round-robin over all the seeders.
+ */
+int pick_seeder(file_download &download, int segment_idx, int rank, const map<int, seeder_load> &loads, double *wait) {
+    if (selection == SELECTION_SEQUENTIAL) {
+        for (size_t tries = 0; tries < download.seeder_list.size(); tries++) {
+            int seeder = download.seeder_list[download.next_seeder];
+            download.next_seeder = (download.next_seeder + 1) % download.seeder_list.size();
+            if (seeder != rank) {
+                *wait = expected_wait(loads, seeder);
+                return seeder;
             }
         }
+        return -1;
+    }
 
-        /* Now that I have received the entire file, I have to write all the hashes in an output file */
-        string output_filename = "client" + std::to_string(rank) + "_" + file;
-
-        ofstream outfile(output_filename);
-        if (!outfile.is_open()) {
-            cout << "Client " << rank << " failed to open file for writing: " << output_filename << std::endl;
-            break;
+    int chosen = -1;
+    for (const auto &[seeder, segments] : download.seeders) {
+        if (seeder == rank || !segments.test(segment_idx)) {
+            continue;
+        }
+        double cost = expected_wait(loads, seeder);
+        if (chosen < 0 || cost < *wait) {
+            chosen = seeder;
+            *wait = cost;
         }
+    }
+    return chosen;
+}
 
-        for (size_t i = 0; i < owned_files_by_peer[file].size(); ++i) {
-            outfile << owned_files_by_peer[file][i];
-            if (i < owned_files_by_peer[file].size() - 1) {
-                outfile << "\n";
+/* The files being downloaded, from the one to serve first */
+vector<file_download *> by_priority(vector<file_download *> files) {
+    stable_sort(files.begin(), files.end(), [](const file_download *a, const file_download *b) {
+        if (file_priority == FILE_PRIORITY_SHORTEST) {
+            int missing_a = a->hashes.size() - a->recv_segments, missing_b = b->hashes.size() - b->recv_segments;
+            if (missing_a != missing_b) {
+                return missing_a < missing_b;
             }
         }
+        return a->position < b->position;
+    });
+    return files;
+}
 
-        outfile.close();
+/*
+ * The next request of the shared window: every file (by priority) proposes its best segment
+ * and seeder, and a file only goes before the ones with a higher priority if its seeder is
+ * expected to answer sooner, so files with idle seeders do not wait for a busy one. The
+ * sequential policy does not know the seeders, and takes the first file that can request.
+ */
+bool pick_request(const vector<file_download *> &files, int rank, const map<int, seeder_load> &loads,
+                  file_download *&download, int &segment_idx, int &seeder) {
+    double best_wait = 0;
+    download = NULL;
+    for (file_download *candidate : by_priority(files)) {
+        int candidate_segment = pick_segment(*candidate);
+        double wait = 0;
+        int candidate_seeder = candidate_segment < 0 ? -1 : pick_seeder(*candidate, candidate_segment, rank, loads, &wait);
+        if (candidate_seeder < 0) {
+            continue;
+        }
+        if (!download || wait < best_wait) {
+            download = candidate;
+            segment_idx = candidate_segment;
+            seeder = candidate_seeder;
+            best_wait = wait;
+        }
+        if (selection == SELECTION_SEQUENTIAL) {
+            break;
+        }
     }
+    return download != NULL;
+}
 
-    /* Announce tracker that all wanted files were received */
-    int msg_type = RECEIVED_ALL_FILES;
-    MPI_Send(&msg_type, 1, MPI_INT, TRACKER_RANK, 0, MPI_COMM_WORLD);
+/* Ask the tracker for a wanted file and get ready to download it */
+file_download *start_download(const string &file, int position, int rank) {
+    /* Send the name of the file to tracker and wait for seeders list + corresponding hashes */
+    message file_request(FILE_REQUEST_MSG);
+    file_request.put_string(file);
+    file_request.send(TRACKER_RANK, TRACKER_TAG);
+
+    message_reader response = recv_message(TRACKER_RANK, TRACKER_RESPONSE_TAG);
+
+    /* Receive the hashes */
+    file_download *download = new file_download;
+    download->file = file;
+    download->position = position;
+    int num_hashes = response.get_int();
+    download->hashes.resize(num_hashes);
+    for (int i = 0; i < num_hashes; i++) {
+        download->hashes[i] = response.get_hash();
+    }
+    download->received.resize(num_hashes);
+    download->in_flight.resize(num_hashes, false);
+    download->holders.resize(num_hashes, 0);
+    for (int i = 0; i < num_hashes; i++) {
+        download->order.push_back(i);
+    }
+    if (selection == SELECTION_RAREST) {
+        for (int i = num_hashes - 1; i > 0; i--) {
+            swap(download->order[i], download->order[rand() % (i + 1)]);
+        }
+    }
 
-    return NULL;
+    /* Receive the seeders and the segments they have */
+    get_seeders(response, *download, rank);
+
+    auto id = file_ids.find(file);
+    download->file_id = id == file_ids.end() ? -1 : id->second;
+
+    /* In payload mode the segments are received straight into the mapped output file */
+    if (segment_size > 0) {
+        string output_filename = "client" + std::to_string(rank) + "_" + file;
+        payload_files[output_filename].reset(new mapped_file(output_filename, (size_t)num_hashes * segment_size));
+        download->payload = payload_files[output_filename]->data;
+    }
+
+    /* The segments the peer owns from its input (the first ones of the file) are not downloaded again */
+    char owned[HASH_SIZE];
+    for (int i = 0; i < num_hashes; i++) {
+        if (!owned_segments.get(download->file_id, i, owned) ||
+            string(owned, strnlen(owned, HASH_SIZE)) != download->hashes[i]) {
+            continue;
+        }
+        if (download->payload) {
+            memcpy(download->payload + (size_t)i * segment_size, owned_segments.payload(download->file_id, i), segment_size);
+        }
+        download->received[i] = download->hashes[i];
+        download->recv_segments++;
+    }
+    owned_segments.add_file(download->file_id, num_hashes, download->payload, segment_size);
+    return download;
 }
 
-void *upload_thread_func(void *arg)
-{
-    int rank = *(int*) arg;
+/* A file is complete: write it out, while the other files go on */
+void finish_download(file_download &download, int rank) {
+    /* In payload mode the output file is already written */
+    string output_filename = "client" + std::to_string(rank) + "_" + download.file;
+    if (download.payload) {
+        payload_files[output_filename]->flush();
+        return;
+    }
 
-    while (true) {
-        MPI_Status status;
-        int msg_type;
+    /* Now that I have received the entire file, I have to write all the hashes in an output file */
 
-        MPI_Recv(&msg_type, 1, MPI_INT, MPI_ANY_SOURCE, 2, MPI_COMM_WORLD, &status);
+    ofstream outfile(output_filename);
+    if (!outfile.is_open()) {
+        cout << "Client " << rank << " failed to open file for writing: " << output_filename << std::endl;
+        return;
+    }
 
-        if (msg_type == REQUEST_SEGMENT) {
-            int requesting_peer = status.MPI_SOURCE;
+    int num_hashes = download.hashes.size();
+    for (int i = 0; i < num_hashes; ++i) {
+        outfile << download.received[i];
+        if (i < num_hashes - 1) {
+            outfile << "\n";
+        }
+    }
 
-            /* Receive the requested file and the index of the requested segment */
-            char requested_file[MAX_FILENAME];
-            int segment_idx;
+    outfile.close();
+}
 
-            MPI_Recv(requested_file, MAX_FILENAME, MPI_CHAR, requesting_peer, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            MPI_Recv(&segment_idx, 1, MPI_INT, requesting_peer, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+void *download_thread_func(void *arg)
+{
+    int rank = *(int*) arg;
+    download_stats stats;
+    double start = MPI_Wtime();
+    srand(rank);
+    trace_thread("download");
+
+    /*
+     * All the wanted files (up to max_files at a time) share a window of request_window
+     * requests in flight; pick_request chooses the file, the segment and the seeder of each
+     * one. Responses complete in any order: a segment is kept at its index and put in the
+     * segment store, which serves it to other peers right away, and a file is written out
+     * as soon as it is complete. A NACK means the seeder lost the segment from its known
+     * ones, and the segment can be requested again.
+     */
+    vector<unique_ptr<file_download>> downloads;
+    vector<file_download *> active;
+    map<int, seeder_load> loads;
+    size_t next_file = 0;
+    int next_seeders_update = 10;
+
+    vector<segment_request> requests(request_window);
+    vector<MPI_Request> responses(request_window, MPI_REQUEST_NULL);
+    vector<int> free_slots;
+    for (int i = request_window - 1; i >= 0; i--) {
+        free_slots.push_back(i);
+    }
+    vector<int> completed(request_window);
 
-            /* Check if I have the requested segment */
-            const auto &segments = owned_files_by_peer[requested_file];
-            if (segment_idx < (int)segments.size()) {
-                const auto &req_segment = segments[segment_idx];
-                int response_tag = 100 + segment_idx;
-                MPI_Send(req_segment.c_str(), HASH_SIZE, MPI_CHAR, requesting_peer, response_tag, MPI_COMM_WORLD);
+    while (true) {
+        /* Start the next wanted files; a file with no segment left to download is complete at once */
+        while ((max_files == 0 || (int)active.size() < max_files) && next_file < wanted_files.size()) {
+            downloads.emplace_back(start_download(wanted_files[next_file], next_file, rank));
+            next_file++;
+            file_download *download = downloads.back().get();
+            if (download->recv_segments == (int)download->hashes.size()) {
+                finish_download(*download, rank);
             } else {
-                const char *nack_msg = "NACK";
-                int response_tag = 100 + segment_idx;
-                MPI_Send(nack_msg, HASH_SIZE, MPI_CHAR, requesting_peer, response_tag, MPI_COMM_WORLD);
+                active.push_back(download);
             }
-        } else if (msg_type == CLIENT_CLOSE_UPLOAD) {
+        }
+        if (active.empty()) {
             break;
         }
-    }
 
-    return NULL;
-}
+        /* Fill the window */
+        file_download *download;
+        int segment_idx, chosen_seeder;
+        while (!free_slots.empty() && pick_request(active, rank, loads, download, segment_idx, chosen_seeder)) {
+            int slot = free_slots.back();
+            free_slots.pop_back();
+            segment_request &request = requests[slot];
+            request.download = download;
+            request.segment_idx = segment_idx;
+            request.seeder = chosen_seeder;
+            request.sent_at = MPI_Wtime();
+            download->in_flight[segment_idx] = true;
+            loads[chosen_seeder].in_flight++;
+            stats.requests++;
+            if (tracing) {
+                trace_record(TRACE_REQUEST_SENT, request.sent_at - trace_origin, request.sent_at - trace_origin,
+                             chosen_seeder, download->file_id, segment_idx);
+            }
 
-void tracker(int numtasks, int rank) {
-    int clients_got_wanted_files = 0;
-    int init_messages_received = 0;
+            /* Request segment; the response comes with the tag of the slot */
+            int response_tag = SEGMENT_TAG_BASE + slot;
+            request.request = message(REQUEST_SEGMENT);
+            request.request.put_int(download->file_id);
+            request.request.put_int(segment_idx);
+            request.request.put_int(response_tag);
+            request.request.isend(chosen_seeder, UPLOAD_TAG, &request.send);
+            if (download->payload) {
+                /* The header in the request, the bytes at their place in the output file */
+                MPI_Datatype type = two_buffers_type(request.response.data(), PAYLOAD_HEADER_SIZE,
+                                                     download->payload + (size_t)segment_idx * segment_size, segment_size);
+                MPI_Irecv(MPI_BOTTOM, 1, type, chosen_seeder, response_tag, MPI_COMM_WORLD, &responses[slot]);
+                MPI_Type_free(&type);
+            } else {
+                MPI_Irecv(request.response.data(), SEGMENT_MSG_SIZE, MPI_BYTE, chosen_seeder, response_tag,
+                          MPI_COMM_WORLD, &responses[slot]);
+            }
+        }
 
-    while (clients_got_wanted_files != numtasks - 1) {
-        /* All clients finished initialization process */
-        if (init_messages_received == numtasks - 1) {
-            for (int client_rank = 1; client_rank < numtasks; client_rank++) {
-                const char *ack_msg = "ACK";
-                MPI_Send(ack_msg, strlen(ack_msg) + 1, MPI_CHAR, client_rank, 0, MPI_COMM_WORLD);
+        /* No known seeder has a missing segment: ask the tracker again, and wait if it did not help */
+        if ((int)free_slots.size() == request_window) {
+            for (file_download *waiting : active) {
+                update_seeders(*waiting, rank);
+            }
+            if (!pick_request(active, rank, loads, download, segment_idx, chosen_seeder)) {
+                usleep(1000);
             }
-            init_messages_received = -1;
+            continue;
         }
 
-        /* All clients received all wanted files */
-        if (clients_got_wanted_files == numtasks - 1) {
-            break;
+        /* Wait for any response, then take every other one that already arrived */
+        int completed_count;
+        MPI_Waitany(request_window, responses.data(), &completed[0], MPI_STATUS_IGNORE);
+        MPI_Testsome(request_window, responses.data(), &completed_count, &completed[1], MPI_STATUSES_IGNORE);
+        if (completed_count == MPI_UNDEFINED) {
+            completed_count = 0;
         }
 
-        MPI_Status status;
-        int request_msg;
-        MPI_Recv(&request_msg, 1, MPI_INT, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
-
-        /* Tracker responds according to the request message */
-        if (request_msg == INIT_MSG_FROM_PEER) {
-            init_messages_received++;
-            int client_rank = status.MPI_SOURCE;
-
-            /* Receive number of files from client */
-            int num_files;
-            MPI_Recv(&num_files, 1, MPI_INT, client_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-            /* Receive all files one by one */
-            for (int i = 0; i < num_files; i++) {
-                char file_name[MAX_FILENAME];
-                MPI_Recv(file_name, MAX_FILENAME, MPI_CHAR, client_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-                /* Receive nr of segments + segments */
-                int num_segments;
-                MPI_Recv(&num_segments, 1, MPI_INT, client_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-                vector<string> segments;
-                for (int j = 0; j < num_segments; j++) {
-                    char curr_segment[HASH_SIZE];
-                    MPI_Recv(curr_segment, HASH_SIZE, MPI_CHAR, client_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                    
-                    segments.emplace_back(curr_segment);
+        for (int i = 0; i <= completed_count; i++) {
+            segment_request &request = requests[completed[i]];
+            file_download &file = *request.download;
+            MPI_Wait(&request.send, MPI_STATUS_IGNORE);
+            free_slots.push_back(completed[i]);
+
+            seeder_load &seeder = loads[request.seeder];
+            double elapsed = MPI_Wtime() - request.sent_at;
+            seeder.latency = seeder.latency == 0 ? elapsed
+                                                 : LATENCY_WEIGHT * elapsed + (1 - LATENCY_WEIGHT) * seeder.latency;
+            seeder.in_flight--;
+            file.in_flight[request.segment_idx] = false;
+
+            /* Check if I received what I was expecting: the hash, or bytes with the right hash */
+            message_reader response(request.response);
+            bool owned = response.get_int();
+            string segment = file.payload ? content_hash(file.payload + (size_t)request.segment_idx * segment_size, segment_size)
+                                          : response.get_hash();
+            if (owned && segment == file.hashes[request.segment_idx]) {
+                file.received[request.segment_idx] = segment;
+                file.recv_segments++;
+                stats.segments++;
+                if (tracing) {
+                    trace_record(TRACE_SEGMENT_RECEIVED, request.sent_at - trace_origin,
+                                 request.sent_at - trace_origin + elapsed, request.seeder, file.file_id, request.segment_idx);
                 }
 
-                owned_files_by_tracker[file_name] = segments;
-                seeders_map[file_name].insert(client_rank);
+                owned_segments.put(file.file_id, request.segment_idx, segment);
+            } else {
+                stats.nacks++;
+                if (tracing) {
+                    trace_record(TRACE_NACK, request.sent_at - trace_origin, request.sent_at - trace_origin + elapsed,
+                                 request.seeder, file.file_id, request.segment_idx);
+                }
+                if (file.seeders[request.seeder].test(request.segment_idx)) {
+                    file.seeders[request.seeder].clear(request.segment_idx);
+                    file.holders[request.segment_idx]--;
+                }
             }
-        } else if (request_msg == FILE_REQUEST_MSG) {
-            /* Get the source of the message */
-            int requesting_peer = status.MPI_SOURCE;
+        }
 
-            /* Receive requested file */
-            char requested_file[MAX_FILENAME];
-            MPI_Recv(requested_file, MAX_FILENAME, MPI_CHAR, requesting_peer, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        /* A complete file has no request left in flight: write it and make room for the next one */
+        for (size_t i = 0; i < active.size();) {
+            if (active[i]->recv_segments == (int)active[i]->hashes.size()) {
+                finish_download(*active[i], rank);
+                active.erase(active.begin() + i);
+            } else {
+                i++;
+            }
+        }
 
-            /* Mark the client as seed for the file */
-            seeders_map[requested_file].insert(requesting_peer);
+        /*
+         * Request actualized list of seeders every 10 segments, for the file updated the
+         * longest time ago, so the updates to the tracker do not grow with the number of files
+         */
+        if (stats.segments >= next_seeders_update && !active.empty()) {
+            next_seeders_update = stats.segments + 10;
+            file_download *oldest = *min_element(active.begin(), active.end(),
+                [](const file_download *a, const file_download *b) {
+                    return a->seeders_updated_at < b->seeders_updated_at;
+                });
+            oldest->seeders_updated_at = MPI_Wtime();
+            update_seeders(*oldest, rank);
+        }
+    }
 
-            /* Send nr of hashes + list of hashes */
-            const auto &hashes = owned_files_by_tracker[requested_file];
-            int num_hashes = hashes.size();
-            MPI_Send(&num_hashes, 1, MPI_INT, requesting_peer, 1, MPI_COMM_WORLD);
-            for (const auto &hash : hashes) {
-                MPI_Send(hash.c_str(), HASH_SIZE, MPI_CHAR, requesting_peer, 1, MPI_COMM_WORLD);
-            }
+    /* Announce tracker that all wanted files were received, with the counters of the download */
+    message done(RECEIVED_ALL_FILES);
+    done.put_int(stats.requests);
+    done.put_int(stats.nacks);
+    done.put_int(stats.segments);
+    done.put_double(MPI_Wtime() - start);
+    done.send(TRACKER_RANK, TRACKER_TAG);
 
-            /* Send nr of seeders + list of seeders */
-            const auto &seeders = seeders_map[requested_file];
-            int num_seeders = seeders.size();
-            MPI_Send(&num_seeders, 1, MPI_INT, requesting_peer, 1, MPI_COMM_WORLD);
-            for (const auto &seeder : seeders) {
-                MPI_Send(&seeder, 1, MPI_INT, requesting_peer, 1, MPI_COMM_WORLD);
-            }
-        } else if (request_msg == RESEND_SEEDERS_MSG) {
-            char requested_file[MAX_FILENAME];
-            int requesting_peer = status.MPI_SOURCE;
+    return NULL;
+}
 
-            MPI_Recv(requested_file, MAX_FILENAME, MPI_CHAR, requesting_peer, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+/*
+ * An upload worker: the workers of a peer all wait for requests on UPLOAD_TAG, a matched
+ * probe gives every request to a single one, and they read the segment store without a lock.
+ */
+void *upload_thread_func(void *arg)
+{
+    int rank = *(int*) arg;
+    trace_thread("upload");
 
-            /* Resend nr of seeders + list of seeders */
-            const auto &seeders = seeders_map[requested_file];
-            int num_seeders = seeders.size();
-            MPI_Send(&num_seeders, 1, MPI_INT, requesting_peer, 1, MPI_COMM_WORLD);
-            for (const auto &seeder : seeders) {
-                MPI_Send(&seeder, 1, MPI_INT, requesting_peer, 1, MPI_COMM_WORLD);
+    while (true) {
+        MPI_Status status;
+        message_reader request = recv_message(MPI_ANY_SOURCE, UPLOAD_TAG, &status);
+
+        if (request.type() == REQUEST_SEGMENT) {
+            int requesting_peer = status.MPI_SOURCE;
+            double started = tracing ? trace_now() : 0;
+
+            /* The ID of the requested file, the index of the requested segment and the tag of the response */
+            int file_id = request.get_int();
+            int segment_idx = request.get_int();
+            int response_tag = request.get_int();
+
+            /* Check if I have the requested segment, otherwise it is a NACK */
+            message response(SEGMENT_MSG);
+            char segment[HASH_SIZE];
+            const char *payload = NULL;
+            bool owned;
+            if (segment_size > 0) {
+                /* Payload mode: the bytes go from the mapped file, without a copy */
+                payload = owned_segments.payload(file_id, segment_idx);
+                owned = payload != NULL;
+                response.put_int(owned);
+            } else {
+                owned = owned_segments.get(file_id, segment_idx, segment);
+                response.put_int(owned);
+                if (owned) {
+                    response.put_hash_slot(segment);
+                } else {
+                    response.put_hash("NACK");
+                }
+            }
+            if (payload) {
+                response.send_with_payload(payload, segment_size, requesting_peer, response_tag);
+            } else {
+                response.send(requesting_peer, response_tag);
+            }
+            if (tracing) {
+                trace_record(TRACE_SEGMENT_SERVED, started, trace_now(), requesting_peer, file_id, segment_idx, owned);
+            }
+        } else if (request.type() == CLIENT_CLOSE_UPLOAD) {
+            /* The tracker closes one worker per peer, which closes the other ones */
+            if (status.MPI_SOURCE == TRACKER_RANK) {
+                for (int i = 1; i < upload_threads; i++) {
+                    message(CLIENT_CLOSE_UPLOAD).send(rank, UPLOAD_TAG);
+                }
             }
-        } else if (request_msg == RECEIVED_ALL_FILES) {
-            clients_got_wanted_files++;
+            break;
         }
     }
 
-    /* Send all clients a message to close upload loop */
-    for (int client_rank = 1; client_rank < numtasks; client_rank++) {
-        int msg_type = CLIENT_CLOSE_UPLOAD;
-        MPI_Send(&msg_type, 1, MPI_INT, client_rank, 2, MPI_COMM_WORLD);
+    return NULL;
+}
+
+/* The next word of the input, whatever its length */
+string read_word(FILE *file) {
+    char *word = NULL;
+    if (fscanf(file, "%ms", &word) != 1) {
+        return "";
     }
+    string result(word);
+    free(word);
+    return result;
 }
 
 void parse_input_file(FILE* file) {
     /* Parse owned files */
-    int nr_owned_files;
+    int nr_owned_files = 0;
     fscanf(file, "%d", &nr_owned_files);
 
     for (int i = 0; i < nr_owned_files; i++) {
-        char file_name[MAX_FILENAME];
-        int num_segments;
-
-        fscanf(file, "%s %d", file_name, &num_segments);
+        string file_name = read_word(file);
+        int num_segments = 0;
+        fscanf(file, "%d", &num_segments);
 
-        vector<string> segments;
+        /* A segment is identified by its first HASH_SIZE characters, the size of a hash on the wire */
+        vector<string> &segments = owned_files_by_peer[file_name];
         for (int j = 0; j < num_segments; j++) {
-            char curr_segment[HASH_SIZE];
-            fscanf(file, "%s", curr_segment);
-            owned_files_by_peer[file_name].push_back(curr_segment);
+            segments.push_back(read_word(file).substr(0, HASH_SIZE));
         }
     }
 
     /* Parse wanted files */
-    int nr_wanted_files;
+    int nr_wanted_files = 0;
     fscanf(file, "%d", &nr_wanted_files);
 
     for (int i = 0; i < nr_wanted_files; i++) {
-        char wanted_file[MAX_FILENAME];
+        wanted_files.push_back(read_word(file));
+    }
+}
 
-        fscanf(file, "%s", wanted_file);
-        wanted_files.emplace_back(wanted_file);
+/* Payload mode: make the bytes of every owned file, and announce their content hashes instead of the ids */
+void make_owned_payloads(int rank) {
+    for (auto &[file_name, segments] : owned_files_by_peer) {
+        string seed_filename = "seed" + to_string(rank) + "_" + file_name;
+        mapped_file *seed = new mapped_file(seed_filename, segments.size() * segment_size);
+        payload_files[seed_filename].reset(seed);
+        for (size_t i = 0; i < segments.size(); i++) {
+            char *bytes = seed->data + i * segment_size;
+            fill_segment(bytes, segment_size, segments[i]);
+            segments[i] = content_hash(bytes, segment_size);
+        }
     }
 }
 
-void peer(int numtasks, int rank) {
+void peer(int rank) {
     pthread_t download_thread;
-    pthread_t upload_thread;
+    vector<pthread_t> upload_workers(upload_threads);
     void *status;
     int r;
 
     /* Get the input file */
-    char inputFile[MAX_FILENAME];
-    snprintf(inputFile, sizeof(inputFile), "in%d.txt", rank);
+    string inputFile = "in" + to_string(rank) + ".txt";
 
-    FILE *file = fopen(inputFile, "r");
+    FILE *file = fopen(inputFile.c_str(), "r");
     if (file == NULL) {
-        printf("Error opening input file: %s\n", inputFile);
+        printf("Error opening input file: %s\n", inputFile.c_str());
         exit(-1);
     }
 
     /* Parse the input file */
     parse_input_file(file);
     fclose(file);
+    if (segment_size > 0) {
+        make_owned_payloads(rank);
+    }
 
     /* Send owned files to tracker */
-    send_init_msg_w_owned_files(rank);
+    send_init_msg_w_owned_files();
+
+    /* Wait for ACK from tracker to start communication, with the IDs of the files */
+    message_reader ack = recv_message(TRACKER_RANK, TRACKER_TAG);
+    int num_files = ack.get_int();
+    for (int i = 0; i < num_files; i++) {
+        string file_name = ack.get_string();
+        file_ids[file_name] = ack.get_int();
+    }
 
-    /* Wait for ACK from tracker to start communication */
-    char ack_msg[10];
-    MPI_Recv(ack_msg, sizeof(ack_msg), MPI_CHAR, TRACKER_RANK, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    /* The owned files go to the segment store, before the threads start */
+    owned_segments.reset(num_files);
+    for (const auto &[file_name, segments] : owned_files_by_peer) {
+        int file_id = file_ids[file_name];
+        const char *payload = segment_size > 0 ? payload_files["seed" + to_string(rank) + "_" + file_name]->data : NULL;
+        owned_segments.add_file(file_id, segments.size(), payload, segment_size);
+        for (size_t i = 0; i < segments.size(); i++) {
+            owned_segments.put(file_id, i, segments[i]);
+        }
+    }
+    owned_files_by_peer.clear();
 
     r = pthread_create(&download_thread, NULL, download_thread_func, (void *) &rank);
     if (r) {
@@ -373,10 +717,12 @@ void peer(int numtasks, int rank) {
         exit(-1);
     }
 
-    r = pthread_create(&upload_thread, NULL, upload_thread_func, (void *) &rank);
-    if (r) {
-        printf("Eroare la crearea thread-ului de upload\n");
-        exit(-1);
+    for (auto &upload_thread : upload_workers) {
+        r = pthread_create(&upload_thread, NULL, upload_thread_func, (void *) &rank);
+        if (r) {
+            printf("Eroare la crearea thread-ului de upload\n");
+            exit(-1);
+        }
     }
 
     r = pthread_join(download_thread, &status);
@@ -385,10 +731,12 @@ void peer(int numtasks, int rank) {
         exit(-1);
     }
 
-    r = pthread_join(upload_thread, &status);
-    if (r) {
-        printf("Eroare la asteptarea thread-ului de upload\n");
-        exit(-1);
+    for (auto &upload_thread : upload_workers) {
+        r = pthread_join(upload_thread, &status);
+        if (r) {
+            printf("Eroare la asteptarea thread-ului de upload\n");
+            exit(-1);
+        }
     }
 }
  
@@ -404,10 +752,63 @@ int main (int argc, char *argv[]) {
     MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+    /* Optional arguments, the same for every rank */
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            request_window = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--selection") == 0 && i + 1 < argc && strcmp(argv[i + 1], "rarest") == 0) {
+            selection = SELECTION_RAREST;
+            i++;
+        } else if (strcmp(argv[i], "--selection") == 0 && i + 1 < argc && strcmp(argv[i + 1], "sequential") == 0) {
+            selection = SELECTION_SEQUENTIAL;
+            i++;
+        } else if (strcmp(argv[i], "--seeder-updates") == 0 && i + 1 < argc && strcmp(argv[i + 1], "delta") == 0) {
+            seeder_updates = SEEDER_UPDATES_DELTA;
+            i++;
+        } else if (strcmp(argv[i], "--seeder-updates") == 0 && i + 1 < argc && strcmp(argv[i + 1], "full") == 0) {
+            seeder_updates = SEEDER_UPDATES_FULL;
+            i++;
+        } else if (strcmp(argv[i], "--file-priority") == 0 && i + 1 < argc && strcmp(argv[i + 1], "shortest") == 0) {
+            file_priority = FILE_PRIORITY_SHORTEST;
+            i++;
+        } else if (strcmp(argv[i], "--file-priority") == 0 && i + 1 < argc && strcmp(argv[i + 1], "order") == 0) {
+            file_priority = FILE_PRIORITY_ORDER;
+            i++;
+        } else if (strcmp(argv[i], "--max-files") == 0 && i + 1 < argc) {
+            max_files = max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--upload-threads") == 0 && i + 1 < argc) {
+            upload_threads = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--tracker-threads") == 0 && i + 1 < argc) {
+            tracker_threads = max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--segment-size") == 0 && i + 1 < argc) {
+            segment_size = max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracing = true;
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--report") == 0) {
+            report = true;
+        } else {
+            if (rank == TRACKER_RANK) {
+                fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            }
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    /* All ranks start the trace together, and the tracker collects it at the end */
+    if (tracing) {
+        trace_start();
+    }
+
     if (rank == TRACKER_RANK) {
-        tracker(numtasks, rank);
+        tracker(numtasks);
     } else {
-        peer(numtasks, rank);
+        peer(rank);
+    }
+
+    if (tracing) {
+        trace_finish(numtasks, rank);
     }
 
     MPI_Finalize();
@@ -0,0 +1,239 @@
+#include <mpi.h>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+
+using namespace std;
+
+/*
+ * Compares the packed wire format with the per-field protocol it replaced (one MPI_Send
+ * per integer, file name and hash), on the exchanges of the simulation. Rank 1 plays the
+ * peer and sends the request, rank 0 plays the tracker or the seeder and answers; every
+ * exchange is timed as a full round trip, so the init message (which has no response in
+ * the protocol) gets a one message acknowledgement in both versions.
+ *
+ * Usage: mpirun -np 2 ./bench_protocol [iterations] [num_hashes] [num_seeders]
+ */
+
+#define OLD_FILENAME_SIZE 15
+#define BENCH_FILES 4
+#define BENCH_HASHES 100
+
+enum exchange {
+    INIT, FILE_REQUEST, RESEND_SEEDERS, SEGMENT_REQUEST, NUM_EXCHANGES
+};
+
+const char *exchange_names[NUM_EXCHANGES] = {"init", "file_request", "resend_seeders", "request_segment"};
+
+int num_hashes = BENCH_HASHES;
+int num_seeders = 8;
+vector<string> hashes;
+long messages_sent;
+
+void send_int(int value, int destination) {
+    MPI_Send(&value, 1, MPI_INT, destination, 0, MPI_COMM_WORLD);
+    messages_sent++;
+}
+
+int recv_int(int source) {
+    int value;
+    MPI_Recv(&value, 1, MPI_INT, source, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return value;
+}
+
+void send_chars(const char *chars, int size, int destination) {
+    MPI_Send(chars, size, MPI_CHAR, destination, 0, MPI_COMM_WORLD);
+    messages_sent++;
+}
+
+void recv_chars(char *chars, int size, int source) {
+    MPI_Recv(chars, size, MPI_CHAR, source, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+/* The per-field protocol: every field is a message of its own */
+void old_exchange(int kind, int rank) {
+    char file_name[OLD_FILENAME_SIZE] = "file1";
+    char hash[HASH_SIZE];
+
+    if (rank == 1) {
+        send_int(kind, 0);
+        if (kind == INIT) {
+            send_int(BENCH_FILES, 0);
+            for (int f = 0; f < BENCH_FILES; f++) {
+                send_chars(file_name, OLD_FILENAME_SIZE, 0);
+                send_int(num_hashes, 0);
+                for (const auto &h : hashes) {
+                    send_chars(h.c_str(), HASH_SIZE, 0);
+                }
+            }
+            recv_int(0);
+        } else if (kind == FILE_REQUEST || kind == RESEND_SEEDERS) {
+            send_chars(file_name, OLD_FILENAME_SIZE, 0);
+            if (kind == FILE_REQUEST) {
+                int n = recv_int(0);
+                for (int i = 0; i < n; i++) {
+                    recv_chars(hash, HASH_SIZE, 0);
+                }
+            }
+            int n = recv_int(0);
+            for (int i = 0; i < n; i++) {
+                recv_int(0);
+            }
+        } else {
+            send_chars(file_name, OLD_FILENAME_SIZE, 0);
+            send_int(7, 0);
+            recv_chars(hash, HASH_SIZE, 0);
+        }
+        return;
+    }
+
+    recv_int(1);
+    if (kind == INIT) {
+        int files = recv_int(1);
+        for (int f = 0; f < files; f++) {
+            recv_chars(file_name, OLD_FILENAME_SIZE, 1);
+            int n = recv_int(1);
+            for (int i = 0; i < n; i++) {
+                recv_chars(hash, HASH_SIZE, 1);
+            }
+        }
+        send_int(0, 1);
+    } else if (kind == FILE_REQUEST || kind == RESEND_SEEDERS) {
+        recv_chars(file_name, OLD_FILENAME_SIZE, 1);
+        if (kind == FILE_REQUEST) {
+            send_int(num_hashes, 1);
+            for (const auto &h : hashes) {
+                send_chars(h.c_str(), HASH_SIZE, 1);
+            }
+        }
+        send_int(num_seeders, 1);
+        for (int i = 0; i < num_seeders; i++) {
+            send_int(i + 1, 1);
+        }
+    } else {
+        recv_chars(file_name, OLD_FILENAME_SIZE, 1);
+        int segment_idx = recv_int(1);
+        send_chars(hashes[segment_idx].c_str(), HASH_SIZE, 1);
+    }
+}
+
+/* The packed protocol: one message per request and per response */
+void new_exchange(int kind, int rank) {
+    if (rank == 1) {
+        message request(kind);
+        if (kind == INIT) {
+            request.put_int(BENCH_FILES);
+            for (int f = 0; f < BENCH_FILES; f++) {
+                request.put_string("file1");
+                request.put_int(num_hashes);
+                for (const auto &h : hashes) {
+                    request.put_hash(h);
+                }
+            }
+        } else {
+            request.put_string("file1");
+            if (kind == SEGMENT_REQUEST) {
+                request.put_int(7);
+            }
+        }
+        request.send(0, 0);
+        messages_sent++;
+
+        /* like the peer, the segment response is received in a buffer of known size, without a probe */
+        if (kind == SEGMENT_REQUEST) {
+            vector<char> response(SEGMENT_MSG_SIZE);
+            MPI_Recv(response.data(), SEGMENT_MSG_SIZE, MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        } else {
+            recv_message(0, 0);
+        }
+        return;
+    }
+
+    message_reader request = recv_message(1, 0);
+    message response(kind);
+    if (kind == INIT) {
+        int files = request.get_int();
+        for (int f = 0; f < files; f++) {
+            request.get_string();
+            int n = request.get_int();
+            for (int i = 0; i < n; i++) {
+                request.get_hash();
+            }
+        }
+    } else if (kind == FILE_REQUEST || kind == RESEND_SEEDERS) {
+        request.get_string();
+        if (kind == FILE_REQUEST) {
+            response.put_int(num_hashes);
+            for (const auto &h : hashes) {
+                response.put_hash(h);
+            }
+        }
+        response.put_int(num_seeders);
+        for (int i = 0; i < num_seeders; i++) {
+            response.put_int(i + 1);
+        }
+    } else {
+        request.get_string();
+        int segment_idx = request.get_int();
+        response.put_int(1);
+        response.put_hash(hashes[segment_idx]);
+    }
+    response.send(1, 0);
+    messages_sent++;
+}
+
+int main(int argc, char *argv[]) {
+    MPI_Init(&argc, &argv);
+    int rank, numtasks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+    if (numtasks != 2) {
+        if (rank == 0) {
+            fprintf(stderr, "Usage: mpirun -np 2 %s [iterations] [num_hashes] [num_seeders]\n", argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    num_hashes = argc > 2 ? max(8, atoi(argv[2])) : BENCH_HASHES;
+    num_seeders = argc > 3 ? atoi(argv[3]) : 8;
+    for (int i = 0; i < num_hashes; i++) {
+        char hash[HASH_SIZE + 1];
+        snprintf(hash, sizeof(hash), "%032x", i * 2654435761u);
+        hashes.push_back(hash);
+    }
+
+    if (rank == 0) {
+        printf("exchange,protocol,messages_per_exchange,round_trip_us\n");
+    }
+    for (int kind = 0; kind < NUM_EXCHANGES; kind++) {
+        for (int packed = 0; packed < 2; packed++) {
+            /* warm up, then measure; both ranks count the messages they send */
+            for (int i = 0; i < iterations / 10; i++) {
+                packed ? new_exchange(kind, rank) : old_exchange(kind, rank);
+            }
+            MPI_Barrier(MPI_COMM_WORLD);
+            messages_sent = 0;
+            double start = MPI_Wtime();
+            for (int i = 0; i < iterations; i++) {
+                packed ? new_exchange(kind, rank) : old_exchange(kind, rank);
+            }
+            double elapsed = MPI_Wtime() - start;
+
+            long total_messages;
+            MPI_Reduce(&messages_sent, &total_messages, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+            if (rank == 0) {
+                printf("%s,%s,%.0f,%.2f\n", exchange_names[kind], packed ? "packed" : "per-field",
+                       (double)total_messages / iterations, elapsed / iterations * 1e6);
+            }
+        }
+    }
+
+    MPI_Finalize();
+    return 0;
+}
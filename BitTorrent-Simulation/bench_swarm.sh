@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Swarm benchmark: a flash crowd where one peer has FILES files of SEGMENTS segments and
+# every other peer wants all of them, run with both segment selection policies and every
+# window size. Prints CSV: selection, window, run, then the swarm report of the tracker.
+# With SPREAD=1, file f is seeded by rank f instead, and ranks FILES+1.. want them all.
+#
+# Usage: ./bench_swarm.sh [ranks] [files] [segments] [runs]
+# MPIRUN can add options, e.g. MPIRUN="mpirun --oversubscribe" ./bench_swarm.sh 16,
+# and ARGS options of the simulation, e.g. ARGS="--upload-threads 1"; with
+# ARGS="--segment-size <bytes>" the last columns are the MB/s of the payload mode
+
+RANKS=${1:-12}
+FILES=${2:-2}
+SEGMENTS=${3:-100}
+RUNS=${4:-3}
+WINDOWS=${WINDOWS:-"1 8"}
+MPIRUN=${MPIRUN:-mpirun}
+ARGS=${ARGS:-}
+SPREAD=${SPREAD:-0}
+
+BINARY=$(cd "$(dirname "$0")" && pwd)/BitTorrent
+if [ ! -x "$BINARY" ]; then
+    echo "Build the simulation first (make build)" >&2
+    exit 1
+fi
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+cd "$WORKDIR" || exit 1
+
+# rank 1 seeds every file (or rank f seeds file f), the next ranks want them all
+awk -v ranks="$RANKS" -v files="$FILES" -v segments="$SEGMENTS" -v spread="$SPREAD" 'BEGIN {
+    srand(1)
+    for (f = 1; f <= files; f++) {
+        out = "in" (spread ? f : 1) ".txt"
+        if (f == 1 || spread) {
+            print (spread ? 1 : files) > out
+        }
+        print "file" f, segments > out
+        for (s = 0; s < segments; s++) {
+            printf "%08x%08x%08x%08x\n", rand() * 2^32, rand() * 2^32, rand() * 2^32, rand() * 2^32 > out
+        }
+        if (f == files || spread) {
+            print 0 > out
+        }
+    }
+    for (r = (spread ? files + 1 : 2); r < ranks; r++) {
+        out = "in" r ".txt"
+        print 0 > out
+        print files > out
+        for (f = 1; f <= files; f++) {
+            print "file" f > out
+        }
+    }
+}'
+
+echo "selection,window,run,peers,segments,requests,nacks,completion_s,per_peer_s,tracker_requests,update_bytes,swarm_mb_s,peer_mb_s"
+for selection in sequential rarest; do
+    for window in $WINDOWS; do
+        for run in $(seq 1 "$RUNS"); do
+            $MPIRUN -np "$RANKS" "$BINARY" --selection "$selection" --window "$window" --report $ARGS |
+                awk -v prefix="$selection,$window,$run" '
+                    { gsub(/,/, "") }
+                    /^Swarm:/ { row = prefix "," $2 "," $4 "," $6 "," $8 "," $12 "," $14 "," $18 "," $21 }
+                    /^Payload:/ { rates = $4 "," $9 }
+                    END { print row "," rates }'
+            rm -f client*_* seed*_*
+        done
+    done
+done
@@ -0,0 +1,104 @@
+#include <mpi.h>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+#include "tracker.h"
+
+using namespace std;
+
+/*
+ * Load on the tracker of the simulation (tracker.h): every rank but 0 plays a peer that
+ * seeds one file, then asks the tracker for random files, alternating file requests and
+ * seeder updates, one request at a time like a downloader. Rank 0 runs the tracker with
+ * 0 workers (the polling thread answers everything) and then with more and more workers,
+ * and prints the requests per second of each.
+ *
+ * Usage: mpirun -np <ranks> ./bench_tracker [requests_per_peer] [files] [segments]
+ */
+
+int requests_per_peer = 2000;
+int num_files = 8;
+int num_segments = 100;
+
+void bench_peer(int rank) {
+    /* Seed one file, with every segment */
+    message init(INIT_MSG_FROM_PEER);
+    init.put_int(1);
+    init.put_string("file" + to_string(rank % num_files));
+    init.put_int(num_segments);
+    for (int i = 0; i < num_segments; i++) {
+        char hash[HASH_SIZE + 1];
+        snprintf(hash, sizeof(hash), "%032x", i);
+        init.put_hash(hash);
+    }
+    init.send(TRACKER_RANK, TRACKER_TAG);
+    recv_message(TRACKER_RANK, TRACKER_TAG);
+
+    double start = MPI_Wtime();
+    segment_bitmap half(num_segments);
+    half.set_prefix(num_segments / 2);
+    for (int i = 0; i < requests_per_peer; i++) {
+        message request(i % 2 ? RESEND_SEEDERS_MSG : FILE_REQUEST_MSG);
+        request.put_string("file" + to_string(rand() % num_files));
+        if (i % 2) {
+            request.put_bitmap(half);
+        }
+        request.send(TRACKER_RANK, TRACKER_TAG);
+        recv_message(TRACKER_RANK, TRACKER_RESPONSE_TAG);
+    }
+
+    message done(RECEIVED_ALL_FILES);
+    done.put_int(0);
+    done.put_int(0);
+    done.put_int(0);
+    done.put_double(MPI_Wtime() - start);
+    done.send(TRACKER_RANK, TRACKER_TAG);
+    recv_message(TRACKER_RANK, UPLOAD_TAG);
+}
+
+int main(int argc, char *argv[]) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    int rank, numtasks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+    if (provided < MPI_THREAD_MULTIPLE || numtasks < 2) {
+        if (rank == 0) {
+            fprintf(stderr, "Usage: mpirun -np <ranks> %s [requests_per_peer] [files] [segments]\n", argv[0]);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    requests_per_peer = argc > 1 ? atoi(argv[1]) : requests_per_peer;
+    num_files = argc > 2 ? max(1, atoi(argv[2])) : num_files;
+    num_segments = argc > 3 ? atoi(argv[3]) : num_segments;
+    srand(rank);
+
+    if (rank == 0) {
+        printf("tracker_threads,peers,requests,seconds,requests_per_s\n");
+    }
+    int thread_counts[] = {0, 1, 2, 4, 8};
+    for (int threads : thread_counts) {
+        double start = MPI_Wtime();
+        if (rank == TRACKER_RANK) {
+            tracker_threads = threads;
+            tracker(numtasks);
+        } else {
+            bench_peer(rank);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+        double elapsed = MPI_Wtime() - start;
+
+        if (rank == 0) {
+            long requests = (long)requests_per_peer * (numtasks - 1);
+            printf("%d,%d,%ld,%.3f,%.0f\n", threads, numtasks - 1, requests, elapsed, requests / elapsed);
+        }
+    }
+
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+
+using namespace std;
+
+/*
+ * Payload mode (--segment-size): a file is num_segments * segment_size real bytes, mapped in
+ * memory. A seeder makes the bytes of a segment from its id in the input (so every seeder of
+ * a file has the same bytes) and announces the content hash of every segment instead of the
+ * id; a downloader checks every received segment against that hash.
+ */
+
+inline uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t mix64(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+/*
+ * 128 bit hash of a segment as 32 hex characters (a HASH_SIZE hash). Four independent 64 bit
+ * lanes take 32 bytes per round, so it runs at memory speed; it detects corrupted or wrong
+ * segments, it is not meant to resist a malicious peer.
+ */
+inline string content_hash(const char *data, size_t size) {
+    const uint64_t prime1 = 0x9e3779b185ebca87ull, prime2 = 0xc2b2ae3d27d4eb4full;
+    uint64_t lanes[4] = {prime1, prime2, ~prime1, ~prime2};
+
+    size_t offset = 0;
+    for (; offset + 32 <= size; offset += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, data + offset + 8 * lane, 8);
+            lanes[lane] = rotate_left(lanes[lane] + word * prime2, 31) * prime1;
+        }
+    }
+    for (; offset < size; offset++) {
+        lanes[offset % 4] = rotate_left(lanes[offset % 4] ^ (uint8_t)data[offset], 11) * prime1;
+    }
+
+    uint64_t low = mix64(lanes[0] ^ rotate_left(lanes[2], 17) ^ size);
+    uint64_t high = mix64(lanes[1] ^ rotate_left(lanes[3], 29) ^ low);
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)high, (unsigned long long)low);
+    return hex;
+}
+
+/* The bytes of the segment with this id: a pseudo-random sequence seeded by the id */
+inline void fill_segment(char *out, size_t size, const string &id) {
+    uint64_t state = 0xcbf29ce484222325ull;
+    for (char c : id) {
+        state = (state ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+
+    size_t offset = 0;
+    for (; offset + 8 <= size; offset += 8) {
+        state += 0x9e3779b97f4a7c15ull;
+        uint64_t word = mix64(state);
+        memcpy(out + offset, &word, 8);
+    }
+    if (offset < size) {
+        state += 0x9e3779b97f4a7c15ull;
+        uint64_t word = mix64(state);
+        memcpy(out + offset, &word, size - offset);
+    }
+}
+
+/* A file of a given size, created (or truncated) and mapped for reading and writing */
+class mapped_file {
+public:
+    mapped_file(const string &path, size_t file_size) : size(file_size) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            perror(path.c_str());
+            exit(-1);
+        }
+        if (size > 0) {
+            void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+                perror(path.c_str());
+                exit(-1);
+            }
+            data = (char *) mapping;
+        }
+        close(fd);
+    }
+
+    ~mapped_file() {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    /* Start writing the file back, once all of it is there */
+    void flush() {
+        if (data) {
+            msync(data, size, MS_ASYNC);
+        }
+    }
+
+    char *data = NULL;
+    size_t size;
+};
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+using namespace std;
+
+#define TRACKER_RANK 0
+/* Hashes are 128 bit, in hex: the ids of the input, or the content hashes of the payload mode */
+#define HASH_SIZE 32
+
+/* Bytes of a segment in payload mode (--segment-size, the same on every rank), 0 when a segment is only its hash */
+int segment_size = 0;
+
+/* Message types */
+#define INIT_MSG_FROM_PEER 0    /* peer -> tracker: owned files and their hashes */
+#define FILE_REQUEST_MSG 1      /* peer -> tracker: file name; response: hashes, seeders and their segments */
+#define RESEND_SEEDERS_MSG 2    /* peer -> tracker: file name, last version seen and own segments;
+                                   response: the seeders that changed since, or SEEDERS_NOT_MODIFIED */
+#define REQUEST_SEGMENT 3       /* peer -> peer: file ID, segment index and response tag; response: SEGMENT_MSG */
+#define RECEIVED_ALL_FILES 4    /* peer -> tracker: download counters of the peer */
+#define CLIENT_CLOSE_UPLOAD 5   /* tracker -> upload thread of every peer */
+#define ACK_MSG 6               /* tracker -> peer, once every peer is initialized: the ID of every file */
+#define SEGMENT_MSG 7           /* peer -> peer: whether the segment is owned, and its hash (or its bytes in payload mode) */
+#define SEEDERS_NOT_MODIFIED 8  /* tracker -> peer: no other seeder changed since the version the peer has */
+#define TRACE_EVENTS 9          /* peer -> tracker, after the run with --trace: the events of the peer */
+
+/* Tags: requests to the tracker, responses of the tracker, requests to the upload thread,
+   the events of a peer, and the responses to segment requests, from SEGMENT_TAG_BASE on (the requester picks the tag) */
+#define TRACKER_TAG 0
+#define TRACKER_RESPONSE_TAG 1
+#define UPLOAD_TAG 2
+#define TRACE_TAG 3
+#define SEGMENT_TAG_BASE 100
+
+/* Download counters of a peer, sent to the tracker with RECEIVED_ALL_FILES */
+struct download_stats {
+    int requests = 0;
+    int nacks = 0;
+    int segments = 0;
+};
+
+/* Segments of a file held by a peer, one bit per segment */
+struct segment_bitmap {
+    vector<uint64_t> words;
+
+    explicit segment_bitmap(int num_segments = 0) : words((num_segments + 63) / 64, 0) {}
+
+    bool test(int segment) const {
+        return segment >= 0 && segment / 64 < (int)words.size() && (words[segment / 64] >> (segment % 64) & 1);
+    }
+
+    void set(int segment) {
+        if (segment >= 0 && segment / 64 < (int)words.size()) {
+            words[segment / 64] |= 1ull << (segment % 64);
+        }
+    }
+
+    void clear(int segment) {
+        if (segment >= 0 && segment / 64 < (int)words.size()) {
+            words[segment / 64] &= ~(1ull << (segment % 64));
+        }
+    }
+
+    /* the first count segments */
+    void set_prefix(int count) {
+        for (int i = 0; i < count; i++) {
+            set(i);
+        }
+    }
+};
+
+/*
+ * Wire format: every message is a header followed by its payload, in one buffer sent with
+ * a single MPI_Send, so a request or a response is always one message whatever the
+ * number of hashes or seeders in it. Integers are 32 bit, strings are a length followed
+ * by their bytes, hashes take HASH_SIZE bytes, padded with zeros, and a bitmap is its
+ * number of 64 bit words followed by the words. The receiver gets
+ * the size with a matched probe (MPI_Mprobe + MPI_Get_count), so no size is agreed on in
+ * advance and threads waiting on the same tag never steal each other's messages.
+ */
+struct message_header {
+    int32_t type;
+    int32_t payload_size;
+};
+
+/* Size of a SEGMENT_MSG, known in advance so the response can be received with MPI_Irecv */
+#define SEGMENT_MSG_SIZE (sizeof(message_header) + sizeof(int32_t) + HASH_SIZE)
+/* In payload mode: the part of a SEGMENT_MSG before the bytes of the segment */
+#define PAYLOAD_HEADER_SIZE (sizeof(message_header) + sizeof(int32_t))
+
+/* A datatype for two separate buffers (used from MPI_BOTTOM), so they make one message without being copied together */
+inline MPI_Datatype two_buffers_type(const void *first, int first_size, const void *second, int second_size) {
+    MPI_Aint displacements[2];
+    MPI_Get_address(first, &displacements[0]);
+    MPI_Get_address(second, &displacements[1]);
+    int lengths[2] = {first_size, second_size};
+
+    MPI_Datatype type;
+    MPI_Type_create_hindexed(2, lengths, displacements, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+class message {
+public:
+    explicit message(int type) : buffer(sizeof(message_header)) {
+        header()->type = type;
+        header()->payload_size = 0;
+    }
+
+    void put_int(int32_t value) {
+        append(&value, sizeof(value));
+    }
+
+    void put_double(double value) {
+        append(&value, sizeof(value));
+    }
+
+    void put_string(const string &value) {
+        put_int(value.size());
+        append(value.data(), value.size());
+    }
+
+    void put_hash(const string &hash) {
+        char padded[HASH_SIZE] = {0};
+        memcpy(padded, hash.data(), min(hash.size(), (size_t)HASH_SIZE));
+        append(padded, HASH_SIZE);
+    }
+
+    /* a hash already padded to HASH_SIZE bytes */
+    void put_hash_slot(const char *slot) {
+        append(slot, HASH_SIZE);
+    }
+
+    void put_bitmap(const segment_bitmap &bitmap) {
+        put_int(bitmap.words.size());
+        append(bitmap.words.data(), bitmap.words.size() * sizeof(uint64_t));
+    }
+
+    const char *data() const {
+        return buffer.data();
+    }
+
+    int size() const {
+        return buffer.size();
+    }
+
+    void send(int destination, int tag) const {
+        MPI_Send(buffer.data(), buffer.size(), MPI_BYTE, destination, tag, MPI_COMM_WORLD);
+    }
+
+    /* The message followed by size bytes at payload, sent from where they are (a mapped file) */
+    void send_with_payload(const char *payload, int size, int destination, int tag) {
+        header()->payload_size += size;
+        MPI_Datatype type = two_buffers_type(buffer.data(), buffer.size(), payload, size);
+        MPI_Send(MPI_BOTTOM, 1, type, destination, tag, MPI_COMM_WORLD);
+        MPI_Type_free(&type);
+        header()->payload_size -= size;
+    }
+
+    /* the message must stay alive until the request completes */
+    void isend(int destination, int tag, MPI_Request *request) const {
+        MPI_Isend(buffer.data(), buffer.size(), MPI_BYTE, destination, tag, MPI_COMM_WORLD, request);
+    }
+
+private:
+    vector<char> buffer;
+
+    message_header *header() {
+        return (message_header *)buffer.data();
+    }
+
+    void append(const void *bytes, size_t size) {
+        buffer.insert(buffer.end(), (const char *)bytes, (const char *)bytes + size);
+        header()->payload_size += size;
+    }
+};
+
+/* Reads the fields of a received message in the order they were put; a truncated message reads as zeros */
+class message_reader {
+public:
+    explicit message_reader(vector<char> data) : buffer(move(data)), position(sizeof(message_header)) {
+        if (buffer.size() < sizeof(message_header)) {
+            buffer.resize(sizeof(message_header), 0);
+        }
+    }
+
+    int type() const {
+        message_header header;
+        memcpy(&header, buffer.data(), sizeof(header));
+        return header.type;
+    }
+
+    int32_t get_int() {
+        int32_t value = 0;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    double get_double() {
+        double value = 0;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    string get_string() {
+        int32_t size = get_int();
+        size = max(0, min(size, (int32_t)(buffer.size() - position)));
+        string value(buffer.data() + position, size);
+        position += size;
+        return value;
+    }
+
+    string get_hash() {
+        char padded[HASH_SIZE] = {0};
+        read(padded, HASH_SIZE);
+        return string(padded, strnlen(padded, HASH_SIZE));
+    }
+
+    segment_bitmap get_bitmap() {
+        int32_t num_words = get_int();
+        num_words = max(0, min(num_words, (int32_t)((buffer.size() - position) / sizeof(uint64_t))));
+        segment_bitmap bitmap;
+        bitmap.words.resize(num_words);
+        read(bitmap.words.data(), num_words * sizeof(uint64_t));
+        return bitmap;
+    }
+
+private:
+    vector<char> buffer;
+    size_t position;
+
+    void read(void *bytes, size_t size) {
+        size_t available = min(size, buffer.size() - position);
+        memcpy(bytes, buffer.data() + position, available);
+        position += available;
+    }
+};
+
+/* Receive a message found by a matched probe */
+inline message_reader recv_matched(MPI_Message &handle, const MPI_Status &probe_status, MPI_Status *status) {
+    int size;
+    MPI_Get_count(&probe_status, MPI_BYTE, &size);
+    vector<char> data(size);
+    MPI_Mrecv(data.data(), size, MPI_BYTE, &handle, MPI_STATUS_IGNORE);
+
+    if (status) {
+        *status = probe_status;
+    }
+    return message_reader(move(data));
+}
+
+/* Receive the next message from source (or MPI_ANY_SOURCE) with the tag, whatever its size */
+inline message_reader recv_message(int source, int tag, MPI_Status *status = NULL) {
+    MPI_Message handle;
+    MPI_Status probe_status;
+    MPI_Mprobe(source, tag, MPI_COMM_WORLD, &handle, &probe_status);
+    return recv_matched(handle, probe_status, status);
+}
+
+/* Like recv_message, but returns false at once if no message is waiting */
+inline bool try_recv_message(int source, int tag, message_reader &received, MPI_Status *status = NULL) {
+    int found;
+    MPI_Message handle;
+    MPI_Status probe_status;
+    MPI_Improbe(source, tag, MPI_COMM_WORLD, &found, &handle, &probe_status);
+    if (found) {
+        received = recv_matched(handle, probe_status, status);
+    }
+    return found;
+}
+
+#endif
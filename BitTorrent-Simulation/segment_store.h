@@ -0,0 +1,140 @@
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "protocol.h"
+
+using namespace std;
+
+/*
+ * The segments a peer serves, for every file by its ID (the tracker numbers the files in
+ * the ACK). A file is a contiguous array of HASH_SIZE slots with a flag per slot, allocated
+ * once when the file is added. The download thread writes a slot and then sets its flag
+ * (release); an upload worker only copies a slot whose flag it saw set (acquire), so any
+ * number of workers read without a lock while segments are added. Files are published the
+ * same way and never removed, so a file a reader saw stays valid until the store is destroyed.
+ * In payload mode a file also points to its bytes (a mapped file), and a flag set means the
+ * bytes of the segment are there too. A peer may own the first segments of a file it then
+ * downloads: the file is added again, larger, and replaces the one of the owned segments,
+ * which is kept for the readers that saw it, like any file, until the store is destroyed.
+ */
+class segment_store {
+public:
+    /* Before any thread uses the store */
+    void reset(int count) {
+        clear();
+        num_files = count;
+        files.reset(new atomic<file_segments *>[count]);
+        for (int i = 0; i < count; i++) {
+            files[i].store(NULL, memory_order_relaxed);
+        }
+    }
+
+    ~segment_store() {
+        clear();
+    }
+
+    /*
+     * A file with no segment yet, and its bytes in payload mode; only the thread that then puts
+     * its segments adds a file. A file added again with more segments keeps the segments it had,
+     * whose bytes must already be in the new payload.
+     */
+    void add_file(int file_id, int num_segments, const char *payload = NULL, size_t segment_bytes = 0) {
+        if (file_id < 0 || file_id >= num_files) {
+            return;
+        }
+        file_segments *known = files[file_id].load(memory_order_relaxed);
+        if (known && known->num_segments >= num_segments) {
+            return;
+        }
+        file_segments *file = new file_segments;
+        file->num_segments = num_segments;
+        file->payload = payload;
+        file->segment_bytes = segment_bytes;
+        file->hashes.reset(new char[(size_t)num_segments * HASH_SIZE]());
+        file->present.reset(new atomic<bool>[num_segments]);
+        for (int i = 0; i < num_segments; i++) {
+            file->present[i].store(false, memory_order_relaxed);
+        }
+        if (known) {
+            memcpy(file->hashes.get(), known->hashes.get(), (size_t)known->num_segments * HASH_SIZE);
+            for (int i = 0; i < known->num_segments; i++) {
+                file->present[i].store(known->present[i].load(memory_order_relaxed), memory_order_relaxed);
+            }
+            replaced.push_back(known);
+        }
+        files[file_id].store(file, memory_order_release);
+    }
+
+    void put(int file_id, int segment_idx, const string &hash) {
+        file_segments *file = find(file_id);
+        if (!file || segment_idx < 0 || segment_idx >= file->num_segments) {
+            return;
+        }
+        char *slot = &file->hashes[(size_t)segment_idx * HASH_SIZE];
+        memset(slot, 0, HASH_SIZE);
+        memcpy(slot, hash.data(), min(hash.size(), (size_t)HASH_SIZE));
+        file->present[segment_idx].store(true, memory_order_release);
+    }
+
+    /* Copies the segment in hash (HASH_SIZE bytes), false if the peer does not have it */
+    bool get(int file_id, int segment_idx, char *hash) const {
+        file_segments *file = find(file_id);
+        if (!file || segment_idx < 0 || segment_idx >= file->num_segments ||
+            !file->present[segment_idx].load(memory_order_acquire)) {
+            return false;
+        }
+        memcpy(hash, &file->hashes[(size_t)segment_idx * HASH_SIZE], HASH_SIZE);
+        return true;
+    }
+
+    /* The bytes of the segment in payload mode, NULL if the peer does not have them */
+    const char *payload(int file_id, int segment_idx) const {
+        file_segments *file = find(file_id);
+        if (!file || !file->payload || segment_idx < 0 || segment_idx >= file->num_segments ||
+            !file->present[segment_idx].load(memory_order_acquire)) {
+            return NULL;
+        }
+        return file->payload + (size_t)segment_idx * file->segment_bytes;
+    }
+
+private:
+    struct file_segments {
+        int num_segments;
+        const char *payload;
+        size_t segment_bytes;
+        unique_ptr<char[]> hashes;
+        unique_ptr<atomic<bool>[]> present;
+    };
+
+    unique_ptr<atomic<file_segments *>[]> files;
+    int num_files = 0;
+    /* Files added again larger, freed with the store */
+    vector<file_segments *> replaced;
+
+    file_segments *find(int file_id) const {
+        if (file_id < 0 || file_id >= num_files) {
+            return NULL;
+        }
+        return files[file_id].load(memory_order_acquire);
+    }
+
+    void clear() {
+        for (int i = 0; i < num_files; i++) {
+            delete files[i].load(memory_order_relaxed);
+        }
+        for (file_segments *file : replaced) {
+            delete file;
+        }
+        replaced.clear();
+        files.reset();
+        num_files = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Partial owners: rank 1 has a file of SEGMENTS segments, rank 2 has its first half and
+# wants all of it, and the next ranks want it too. Checks every output, with segments as
+# hashes and in payload mode, where rank 2 keeps serving the segments of its seed while it
+# downloads the others. Prints OK, or what failed and exits with 1.
+#
+# Usage: ./test_partial.sh [ranks] [segments]
+# MPIRUN can add options, e.g. MPIRUN="mpirun --oversubscribe" ./test_partial.sh
+
+RANKS=${1:-6}
+SEGMENTS=${2:-64}
+MPIRUN=${MPIRUN:-mpirun}
+
+BINARY=$(cd "$(dirname "$0")" && pwd)/BitTorrent
+if [ ! -x "$BINARY" ]; then
+    echo "Build the simulation first (make build)" >&2
+    exit 1
+fi
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+cd "$WORKDIR" || exit 1
+
+awk -v ranks="$RANKS" -v segments="$SEGMENTS" 'BEGIN {
+    srand(1)
+    for (s = 0; s < segments; s++) {
+        hash[s] = sprintf("%08x%08x%08x%08x", rand() * 2^32, rand() * 2^32, rand() * 2^32, rand() * 2^32)
+        printf "%s%s", (s ? "\n" : ""), hash[s] > "expected"
+    }
+    print 1 > "in1.txt"
+    print "file1", segments > "in1.txt"
+    for (s = 0; s < segments; s++) {
+        print hash[s] > "in1.txt"
+    }
+    print 0 > "in1.txt"
+
+    print 1 > "in2.txt"
+    print "file1", int(segments / 2) > "in2.txt"
+    for (s = 0; s < int(segments / 2); s++) {
+        print hash[s] > "in2.txt"
+    }
+    print 1 > "in2.txt"
+    print "file1" > "in2.txt"
+
+    for (r = 3; r < ranks; r++) {
+        out = "in" r ".txt"
+        print 0 > out
+        print 1 > out
+        print "file1" > out
+    }
+}'
+
+failed=0
+check() {
+    if ! "$@"; then
+        echo "FAILED: $MODE: $*"
+        failed=1
+    fi
+}
+
+for window in 1 8; do
+    MODE="hashes, window $window"
+    if ! $MPIRUN -np "$RANKS" "$BINARY" --window "$window" > log 2>&1; then
+        echo "FAILED: $MODE: the run failed"; cat log; failed=1
+    fi
+    for r in $(seq 2 $((RANKS - 1))); do
+        check cmp -s expected "client${r}_file1"
+    done
+    rm -f client*_*
+
+    MODE="payload, window $window"
+    if ! $MPIRUN -np "$RANKS" "$BINARY" --window "$window" --segment-size 4096 > log 2>&1; then
+        echo "FAILED: $MODE: the run failed"; cat log; failed=1
+    fi
+    for r in $(seq 2 $((RANKS - 1))); do
+        check cmp -s seed1_file1 "client${r}_file1"
+    done
+    # the seed of rank 2 is still its first half
+    check cmp -s -n $((SEGMENTS / 2 * 4096)) seed1_file1 seed2_file1
+    rm -f client*_* seed*_*
+done
+
+if [ "$failed" = 0 ]; then
+    echo OK
+fi
+exit "$failed"
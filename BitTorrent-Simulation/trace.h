@@ -0,0 +1,364 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+using namespace std;
+
+/*
+ * Tracing (--trace <file>): every thread of every rank records events in a buffer of its
+ * own, so recording takes no lock and no atomic operation, only a branch when tracing is
+ * off. A thread adds its buffer to a lock-free list the first time it records (a CAS on
+ * the head), and the buffers are only read after the threads are joined. At the end every
+ * peer sends its events to the tracker, which writes them as a Chrome trace (JSON, for
+ * chrome://tracing or Perfetto) and prints a summary: per-peer rates, tracker queue delay
+ * and how evenly the seeders are loaded. Times are from a barrier before the run, so the
+ * ranks share an origin up to the skew of the barrier.
+ */
+
+/* Events kept per thread; later ones are counted as dropped */
+#define TRACE_EVENTS_PER_THREAD (1 << 16)
+
+/* Kinds of events, and what peer, file, segment and value are for each one */
+#define TRACE_REQUEST_SENT 0        /* download: seeder, file ID, segment */
+#define TRACE_SEGMENT_RECEIVED 1    /* download, from the request to the response: seeder, file ID, segment */
+#define TRACE_NACK 2                /* download, from the request to the NACK: seeder, file ID, segment */
+#define TRACE_SEEDER_REFRESH 3      /* download, a seeder update to the tracker: file ID, value: seeders changed */
+#define TRACE_TRACKER_REQUEST 4     /* tracker, answering a request: requester, segment: message type,
+                                       value: microseconds the request waited for a worker */
+#define TRACE_SEGMENT_SERVED 5      /* upload worker: requester, file ID, segment, value: 1 if owned, 0 for a NACK */
+
+struct trace_event {
+    double start;       /* seconds from the origin */
+    double duration;
+    int32_t kind;
+    int32_t peer;
+    int32_t file;
+    int32_t segment;
+    int32_t value;
+};
+
+/* The events of one thread; only that thread writes them */
+struct trace_buffer {
+    unique_ptr<trace_event[]> events = unique_ptr<trace_event[]>(new trace_event[TRACE_EVENTS_PER_THREAD]);
+    int count = 0;
+    int dropped = 0;
+    int thread;
+    string name;
+    trace_buffer *next = NULL;
+};
+
+bool tracing = false;
+string trace_path;
+double trace_origin = 0;
+
+atomic<trace_buffer *> trace_buffers(NULL);
+atomic<int> trace_threads(0);
+thread_local trace_buffer *local_trace = NULL;
+
+inline double trace_now() {
+    return MPI_Wtime() - trace_origin;
+}
+
+/* Names the calling thread in the trace; a thread records nothing before */
+inline void trace_thread(const string &name) {
+    if (!tracing || local_trace) {
+        return;
+    }
+    trace_buffer *buffer = new trace_buffer;
+    buffer->thread = trace_threads++;
+    buffer->name = name;
+    buffer->next = trace_buffers.load(memory_order_relaxed);
+    while (!trace_buffers.compare_exchange_weak(buffer->next, buffer, memory_order_release, memory_order_relaxed)) {
+    }
+    local_trace = buffer;
+}
+
+inline void trace_record(int kind, double start, double end, int peer, int file = -1, int segment = -1, int value = 0) {
+    trace_buffer *buffer = local_trace;
+    if (!buffer) {
+        return;
+    }
+    if (buffer->count == TRACE_EVENTS_PER_THREAD) {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events[buffer->count++] = {start, end - start, kind, peer, file, segment, value};
+}
+
+/* An event together with where it was recorded */
+struct traced_event {
+    int rank;
+    int thread;
+    trace_event event;
+};
+
+/* Every rank calls it before the run */
+inline void trace_start() {
+    MPI_Barrier(MPI_COMM_WORLD);
+    trace_origin = MPI_Wtime();
+}
+
+/* The events of this rank as a TRACE_EVENTS message: threads and their names, then events (microseconds) */
+inline message pack_trace() {
+    vector<trace_buffer *> buffers;
+    for (trace_buffer *buffer = trace_buffers.load(memory_order_acquire); buffer; buffer = buffer->next) {
+        buffers.push_back(buffer);
+    }
+
+    message packed(TRACE_EVENTS);
+    packed.put_int(buffers.size());
+    for (trace_buffer *buffer : buffers) {
+        packed.put_int(buffer->thread);
+        packed.put_string(buffer->name);
+        packed.put_int(buffer->dropped);
+        packed.put_int(buffer->count);
+        for (int i = 0; i < buffer->count; i++) {
+            const trace_event &event = buffer->events[i];
+            packed.put_int(event.start * 1e6);
+            packed.put_int(event.duration * 1e6);
+            packed.put_int(event.kind);
+            packed.put_int(event.peer);
+            packed.put_int(event.file);
+            packed.put_int(event.segment);
+            packed.put_int(event.value);
+        }
+    }
+    return packed;
+}
+
+inline void unpack_trace(message_reader &packed, int rank, vector<traced_event> &events,
+                         map<pair<int, int>, string> &thread_names, long &dropped) {
+    int num_threads = packed.get_int();
+    for (int i = 0; i < num_threads; i++) {
+        int thread = packed.get_int();
+        thread_names[{rank, thread}] = packed.get_string();
+        dropped += packed.get_int();
+        int count = packed.get_int();
+        for (int j = 0; j < count; j++) {
+            traced_event traced = {rank, thread, {}};
+            traced.event.start = packed.get_int() / 1e6;
+            traced.event.duration = packed.get_int() / 1e6;
+            traced.event.kind = packed.get_int();
+            traced.event.peer = packed.get_int();
+            traced.event.file = packed.get_int();
+            traced.event.segment = packed.get_int();
+            traced.event.value = packed.get_int();
+            events.push_back(traced);
+        }
+    }
+}
+
+inline const char *trace_event_name(int kind) {
+    switch (kind) {
+    case TRACE_REQUEST_SENT: return "request";
+    case TRACE_SEGMENT_RECEIVED: return "segment";
+    case TRACE_NACK: return "nack";
+    case TRACE_SEEDER_REFRESH: return "seeder refresh";
+    case TRACE_TRACKER_REQUEST: return "tracker request";
+    case TRACE_SEGMENT_SERVED: return "serve";
+    }
+    return "event";
+}
+
+/*
+ * Chrome trace: a process per rank and a thread per traced thread. Requests are instants;
+ * segments and NACKs overlap on the download thread (the window), so they are async spans;
+ * seeder refreshes, tracker requests and served segments are complete events of their thread.
+ */
+inline bool write_chrome_trace(const string &path, const vector<traced_event> &events,
+                               const map<pair<int, int>, string> &thread_names) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *separator = "";
+    int last_rank = -1;
+    for (const auto &[where, name] : thread_names) {
+        if (where.first != last_rank) {
+            last_rank = where.first;
+            fprintf(out, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                    separator, where.first, where.first == TRACKER_RANK ? "tracker" : "peer", where.first);
+            separator = ",\n";
+        }
+        fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, where.first, where.second, name.c_str());
+        separator = ",\n";
+    }
+
+    long async_id = 0;
+    for (const traced_event &traced : events) {
+        const trace_event &event = traced.event;
+        const char *name = trace_event_name(event.kind);
+        char args[160];
+        if (event.kind == TRACE_TRACKER_REQUEST) {
+            snprintf(args, sizeof(args), "{\"peer\":%d,\"type\":%d,\"queue_us\":%d}", event.peer, event.segment, event.value);
+        } else if (event.kind == TRACE_SEEDER_REFRESH) {
+            snprintf(args, sizeof(args), "{\"file\":%d,\"changed\":%d}", event.file, event.value);
+        } else {
+            snprintf(args, sizeof(args), "{\"peer\":%d,\"file\":%d,\"segment\":%d,\"value\":%d}",
+                     event.peer, event.file, event.segment, event.value);
+        }
+
+        fputs(separator, out);
+        separator = ",\n";
+        if (event.kind == TRACE_REQUEST_SENT) {
+            fprintf(out, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f,\"args\":%s}",
+                    name, traced.rank, traced.thread, event.start * 1e6, args);
+        } else if (event.kind == TRACE_SEGMENT_RECEIVED || event.kind == TRACE_NACK) {
+            async_id++;
+            fprintf(out, "{\"ph\":\"b\",\"cat\":\"download\",\"id\":%ld,\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%.1f,\"args\":%s},\n",
+                    async_id, name, traced.rank, traced.thread, event.start * 1e6, args);
+            fprintf(out, "{\"ph\":\"e\",\"cat\":\"download\",\"id\":%ld,\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f}",
+                    async_id, name, traced.rank, traced.thread, (event.start + event.duration) * 1e6);
+        } else {
+            fprintf(out, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,\"args\":%s}",
+                    name, traced.rank, traced.thread, event.start * 1e6, event.duration * 1e6, args);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
+
+/* The value at fraction of the sorted values */
+inline double percentile(const vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[min(sorted.size() - 1, (size_t)(fraction * (sorted.size() - 1) + 0.5))];
+}
+
+/*
+ * Per peer: segments received over its download (first request to last segment) and
+ * segments served over the whole run; the tracker's queue delay and service time; the
+ * segments served by every peer against the mean, and the busiest seeders.
+ */
+inline void print_trace_summary(int numtasks, const vector<traced_event> &events, long dropped) {
+    struct peer_counters {
+        int received = 0, nacks = 0, served = 0, nacks_sent = 0, refreshes = 0;
+        double first_request = -1, last_segment = 0;
+    };
+    vector<peer_counters> peers(numtasks);
+    vector<double> queue_delays, service_times;
+    double run_start = -1, run_end = 0;
+
+    for (const traced_event &traced : events) {
+        const trace_event &event = traced.event;
+        peer_counters &peer = peers[traced.rank];
+        run_start = run_start < 0 ? event.start : min(run_start, event.start);
+        run_end = max(run_end, event.start + event.duration);
+
+        if (event.kind == TRACE_REQUEST_SENT) {
+            peer.first_request = peer.first_request < 0 ? event.start : min(peer.first_request, event.start);
+        } else if (event.kind == TRACE_SEGMENT_RECEIVED) {
+            peer.received++;
+            peer.last_segment = max(peer.last_segment, event.start + event.duration);
+        } else if (event.kind == TRACE_NACK) {
+            peer.nacks++;
+        } else if (event.kind == TRACE_SEEDER_REFRESH) {
+            peer.refreshes++;
+        } else if (event.kind == TRACE_TRACKER_REQUEST) {
+            queue_delays.push_back(event.value);
+            service_times.push_back(event.duration * 1e6);
+        } else if (event.kind == TRACE_SEGMENT_SERVED) {
+            (event.value ? peer.served : peer.nacks_sent)++;
+        }
+    }
+    double run_seconds = max(run_end - max(run_start, 0.0), 1e-9);
+
+    printf("Trace: %zu events, %ld dropped, written to %s\n", events.size(), dropped, trace_path.c_str());
+    int total_served = 0;
+    for (int rank = 1; rank < numtasks; rank++) {
+        const peer_counters &peer = peers[rank];
+        double download_seconds = peer.first_request < 0 ? 0 : max(peer.last_segment - peer.first_request, 1e-9);
+        double down_rate = download_seconds > 0 ? peer.received / download_seconds : 0;
+        double up_rate = peer.served / run_seconds;
+        printf("Peer %d: down %d segments in %.3f s, %.1f segments/s", rank, peer.received, download_seconds, down_rate);
+        if (segment_size > 0) {
+            printf(" (%.1f MB/s)", down_rate * segment_size / 1e6);
+        }
+        printf(", %d nacks; up %d segments, %.1f segments/s", peer.nacks, peer.served, up_rate);
+        if (segment_size > 0) {
+            printf(" (%.1f MB/s)", up_rate * segment_size / 1e6);
+        }
+        printf(", %d nacks sent; %d seeder refreshes\n", peer.nacks_sent, peer.refreshes);
+
+        total_served += peer.served;
+    }
+
+    sort(queue_delays.begin(), queue_delays.end());
+    double delay_sum = 0, service_sum = 0;
+    for (double delay : queue_delays) {
+        delay_sum += delay;
+    }
+    for (double service : service_times) {
+        service_sum += service;
+    }
+    size_t tracker_requests = max(queue_delays.size(), (size_t)1);
+    printf("Tracker: %zu requests, queue delay %.1f us mean, %.1f us p50, %.1f us p99, %.1f us max; "
+           "service %.1f us mean\n",
+           queue_delays.size(), delay_sum / tracker_requests, percentile(queue_delays, 0.5),
+           percentile(queue_delays, 0.99), percentile(queue_delays, 1), service_sum / tracker_requests);
+
+    /* Imbalance: the busiest seeder against the mean of all peers (1 is even) */
+    double mean_served = (double)total_served / max(1, numtasks - 1);
+    vector<pair<int, int>> busiest;
+    for (int rank = 1; rank < numtasks; rank++) {
+        busiest.push_back({peers[rank].served, rank});
+    }
+    sort(busiest.rbegin(), busiest.rend());
+    int max_served = busiest.empty() ? 0 : busiest[0].first;
+    printf("Seeders: %d segments served, %.1f per peer, max %d, imbalance %.2f; busiest:",
+           total_served, mean_served, max_served, mean_served > 0 ? max_served / mean_served : 0);
+    for (size_t i = 0; i < busiest.size() && i < 3; i++) {
+        printf(" peer %d (%d)", busiest[i].second, busiest[i].first);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+ * After the run, on every rank: the peers send their events to the tracker, which writes
+ * the Chrome trace and prints the summary
+ */
+inline void trace_finish(int numtasks, int rank) {
+    if (rank != TRACKER_RANK) {
+        pack_trace().send(TRACKER_RANK, TRACE_TAG);
+        return;
+    }
+
+    vector<traced_event> events;
+    map<pair<int, int>, string> thread_names;
+    long dropped = 0;
+    message own_events = pack_trace();
+    message_reader own(vector<char>(own_events.data(), own_events.data() + own_events.size()));
+    unpack_trace(own, TRACKER_RANK, events, thread_names, dropped);
+    for (int i = 1; i < numtasks; i++) {
+        MPI_Status status;
+        message_reader packed = recv_message(MPI_ANY_SOURCE, TRACE_TAG, &status);
+        unpack_trace(packed, status.MPI_SOURCE, events, thread_names, dropped);
+    }
+    sort(events.begin(), events.end(), [](const traced_event &a, const traced_event &b) {
+        return a.event.start < b.event.start;
+    });
+
+    if (!write_chrome_trace(trace_path, events, thread_names)) {
+        fprintf(stderr, "Failed to write the trace: %s\n", trace_path.c_str());
+    }
+    print_trace_summary(numtasks, events, dropped);
+}
+
+#endif
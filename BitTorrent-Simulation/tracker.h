@@ -0,0 +1,349 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <mpi.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+#include "trace.h"
+
+using namespace std;
+
+#define DEFAULT_TRACKER_THREADS 4
+
+/*
+ * The tracker: one thread polls for requests (MPI_Improbe) and hands the file and seeder
+ * requests to a pool of workers, which answer them in parallel. The state is kept per file,
+ * each file with its own lock, so requests for different files never wait for each other.
+ * Init and completion messages are handled by the polling thread: all the inits come before
+ * the ACK, and so before any request for a file.
+ *
+ * The seeders of a file are versioned: every change (a new seeder, or new segments of one)
+ * gets the next version of the file. A peer sends the version it last saw, and gets only
+ * the seeders that changed since, or SEEDERS_NOT_MODIFIED.
+ */
+
+struct tracker_seeder {
+    segment_bitmap segments;
+    int version;    /* version of the file when the seeder last changed */
+};
+
+/* A file known to the tracker: its hashes and its seeders, with the segments each one has */
+struct tracker_file {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    vector<string> hashes;
+    map<int, tracker_seeder> seeders;
+    int version = 0;
+
+    void set_seeder(int seeder, const segment_bitmap &segments) {
+        auto known = seeders.find(seeder);
+        if (known == seeders.end() || known->second.segments.words != segments.words) {
+            seeders[seeder] = {segments, ++version};
+        }
+    }
+};
+
+/* The files by ID, and the ID of every file name; only the polling thread adds files, before the ACK */
+deque<tracker_file> tracker_files;
+map<string, int> tracker_file_ids;
+
+/* Bytes of the responses to seeder updates, for the report */
+atomic<long> tracker_update_bytes(0);
+
+/* Worker threads of the tracker (--tracker-threads); with 0 the polling thread answers every request */
+int tracker_threads = DEFAULT_TRACKER_THREADS;
+/* The tracker prints the counters of the swarm at the end (--report) */
+bool report = false;
+
+/* A request waiting for a worker */
+struct tracker_job {
+    message_reader request;
+    int source;
+    double queued_at;   /* when it was received, for the queue delay in the trace */
+};
+
+class tracker_queue {
+public:
+    tracker_queue() {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&ready, NULL);
+    }
+
+    ~tracker_queue() {
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&ready);
+    }
+
+    void push(tracker_job job) {
+        pthread_mutex_lock(&lock);
+        jobs.push_back(move(job));
+        pthread_cond_signal(&ready);
+        pthread_mutex_unlock(&lock);
+    }
+
+    /* The next request, false once the queue is closed and empty */
+    bool pop(tracker_job &job) {
+        pthread_mutex_lock(&lock);
+        while (jobs.empty() && !closed) {
+            pthread_cond_wait(&ready, &lock);
+        }
+        bool found = !jobs.empty();
+        if (found) {
+            job = move(jobs.front());
+            jobs.pop_front();
+        }
+        pthread_mutex_unlock(&lock);
+        return found;
+    }
+
+    void close() {
+        pthread_mutex_lock(&lock);
+        closed = true;
+        pthread_cond_broadcast(&ready);
+        pthread_mutex_unlock(&lock);
+    }
+
+private:
+    deque<tracker_job> jobs;
+    bool closed = false;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+/*
+ * The version of the file, then the seeders that changed after since, except the requester
+ * (which knows its own segments); returns the number of seeders put
+ */
+int put_seeders(message &response, const tracker_file &file, int since, int requesting_peer) {
+    int changed = 0;
+    for (const auto &[seeder, state] : file.seeders) {
+        changed += state.version > since && seeder != requesting_peer;
+    }
+
+    response.put_int(file.version);
+    response.put_int(changed);
+    for (const auto &[seeder, state] : file.seeders) {
+        if (state.version > since && seeder != requesting_peer) {
+            response.put_int(seeder);
+            response.put_bitmap(state.segments);
+        }
+    }
+    return changed;
+}
+
+/* Receive all files owned by a peer, one by one, and add the peer to their swarms */
+void add_peer_files(message_reader &request, int client_rank) {
+    int num_files = request.get_int();
+    for (int i = 0; i < num_files; i++) {
+        string file_name = request.get_string();
+
+        /* Receive nr of segments + segments */
+        int num_segments = request.get_int();
+        vector<string> segments;
+        for (int j = 0; j < num_segments; j++) {
+            segments.emplace_back(request.get_hash());
+        }
+
+        auto [id, added] = tracker_file_ids.emplace(file_name, tracker_files.size());
+        if (added) {
+            tracker_files.emplace_back();
+        }
+        tracker_file &file = tracker_files[id->second];
+
+        /* A peer may only have the first segments of a file: the longest list is the file */
+        if (segments.size() > file.hashes.size()) {
+            file.hashes = segments;
+        }
+        segment_bitmap owned(num_segments);
+        owned.set_prefix(num_segments);
+        file.set_seeder(client_rank, owned);
+    }
+}
+
+/* FILE_REQUEST_MSG and RESEND_SEEDERS_MSG, which only lock the requested file */
+void answer_file_request(message_reader &request, int requesting_peer) {
+    int request_msg = request.type();
+    string requested_file = request.get_string();
+    message response(request_msg);
+
+    auto id = tracker_file_ids.find(requested_file);
+    if (id == tracker_file_ids.end()) {
+        /* Nobody has the file: no hashes and no seeders */
+        if (request_msg == FILE_REQUEST_MSG) {
+            response.put_int(0);
+        }
+        response.put_int(0);
+        response.put_int(0);
+        response.send(requesting_peer, TRACKER_RESPONSE_TAG);
+        return;
+    }
+
+    tracker_file &file = tracker_files[id->second];
+    pthread_mutex_lock(&file.lock);
+    if (request_msg == FILE_REQUEST_MSG) {
+        /* Mark the client as seed for the file, with no segment yet */
+        if (!file.seeders.count(requesting_peer)) {
+            file.set_seeder(requesting_peer, segment_bitmap(file.hashes.size()));
+        }
+
+        /* Send nr of hashes + list of hashes, then the version and all the seeders and their segments */
+        response.put_int(file.hashes.size());
+        for (const auto &hash : file.hashes) {
+            response.put_hash(hash);
+        }
+        put_seeders(response, file, -1, requesting_peer);
+    } else {
+        /* Keep the segments the peer received so far, then send what changed since its version */
+        int since = request.get_int();
+        file.set_seeder(requesting_peer, request.get_bitmap());
+        if (put_seeders(response, file, since, requesting_peer) == 0 && since >= 0) {
+            response = message(SEEDERS_NOT_MODIFIED);
+        }
+    }
+    pthread_mutex_unlock(&file.lock);
+    if (request_msg == RESEND_SEEDERS_MSG) {
+        tracker_update_bytes += response.size();
+    }
+    response.send(requesting_peer, TRACKER_RESPONSE_TAG);
+}
+
+/* Answer a request, traced with the time it waited for a worker */
+void serve_tracker_job(tracker_job &job) {
+    if (!tracing) {
+        answer_file_request(job.request, job.source);
+        return;
+    }
+    double started = trace_now();
+    answer_file_request(job.request, job.source);
+    trace_record(TRACE_TRACKER_REQUEST, started, trace_now(), job.source, -1, job.request.type(),
+                 (started - job.queued_at) * 1e6);
+}
+
+void *tracker_worker_func(void *arg)
+{
+    tracker_queue *queue = (tracker_queue *) arg;
+    tracker_job job = {message_reader(vector<char>()), 0, 0};
+    trace_thread("tracker worker");
+
+    while (queue->pop(job)) {
+        serve_tracker_job(job);
+    }
+
+    return NULL;
+}
+
+void tracker(int numtasks) {
+    int clients_got_wanted_files = 0;
+    int init_messages_received = 0;
+    long file_requests = 0;
+    download_stats swarm;
+    int downloading_peers = 0;
+    double start = 0, finish = 0, peer_seconds = 0, peer_rates = 0;
+
+    tracker_files.clear();
+    tracker_file_ids.clear();
+    tracker_update_bytes = 0;
+
+    trace_thread("tracker");
+    tracker_queue queue;
+    vector<pthread_t> workers(tracker_threads);
+    for (auto &worker : workers) {
+        if (pthread_create(&worker, NULL, tracker_worker_func, &queue)) {
+            printf("Eroare la crearea thread-ului de tracker\n");
+            exit(-1);
+        }
+    }
+
+    while (clients_got_wanted_files != numtasks - 1) {
+        /* All clients finished initialization process */
+        if (init_messages_received == numtasks - 1) {
+            /* The IDs of the files, so segment requests carry a number instead of a name */
+            message ack(ACK_MSG);
+            ack.put_int(tracker_file_ids.size());
+            for (const auto &[file_name, file_id] : tracker_file_ids) {
+                ack.put_string(file_name);
+                ack.put_int(file_id);
+            }
+            for (int client_rank = 1; client_rank < numtasks; client_rank++) {
+                ack.send(client_rank, TRACKER_TAG);
+            }
+            init_messages_received = -1;
+            start = MPI_Wtime();
+        }
+
+        /* All clients received all wanted files */
+        if (clients_got_wanted_files == numtasks - 1) {
+            break;
+        }
+
+        /* Poll, and let the workers run while no request is waiting */
+        MPI_Status status;
+        message_reader request(vector<char>{});
+        if (!try_recv_message(MPI_ANY_SOURCE, TRACKER_TAG, request, &status)) {
+            sched_yield();
+            continue;
+        }
+        int request_msg = request.type();
+
+        /* Tracker responds according to the request message */
+        if (request_msg == INIT_MSG_FROM_PEER) {
+            init_messages_received++;
+            add_peer_files(request, status.MPI_SOURCE);
+        } else if (request_msg == FILE_REQUEST_MSG || request_msg == RESEND_SEEDERS_MSG) {
+            file_requests++;
+            tracker_job job = {move(request), status.MPI_SOURCE, tracing ? trace_now() : 0};
+            if (tracker_threads > 0) {
+                queue.push(move(job));
+            } else {
+                serve_tracker_job(job);
+            }
+        } else if (request_msg == RECEIVED_ALL_FILES) {
+            clients_got_wanted_files++;
+            swarm.requests += request.get_int();
+            swarm.nacks += request.get_int();
+            int segments = request.get_int();
+            double seconds = request.get_double();
+            swarm.segments += segments;
+            peer_seconds += seconds;
+            if (segments > 0 && seconds > 0) {
+                downloading_peers++;
+                peer_rates += (double)segments * segment_size / seconds;
+            }
+            finish = MPI_Wtime();
+        }
+    }
+
+    /* A peer is done only after its last answer, so no request is left in the queue */
+    queue.close();
+    for (auto &worker : workers) {
+        pthread_join(worker, NULL);
+    }
+
+    /* Send all clients a message to close upload loop */
+    for (int client_rank = 1; client_rank < numtasks; client_rank++) {
+        message(CLIENT_CLOSE_UPLOAD).send(client_rank, UPLOAD_TAG);
+    }
+
+    if (report) {
+        printf("Swarm: %d peers, %d segments, %d requests, %d nacks, completed in %.3f s, %.3f s per peer, "
+               "%ld tracker requests, %ld update bytes\n",
+               numtasks - 1, swarm.segments, swarm.requests, swarm.nacks, finish - start,
+               peer_seconds / max(1, numtasks - 1), file_requests, tracker_update_bytes.load());
+        if (segment_size > 0) {
+            printf("Payload: %.1f MB, %.1f MB/s for the swarm, %.1f MB/s per downloading peer\n",
+                   (double)swarm.segments * segment_size / 1e6,
+                   (double)swarm.segments * segment_size / 1e6 / max(finish - start, 1e-9),
+                   peer_rates / 1e6 / max(1, downloading_peers));
+        }
+        fflush(stdout);
+    }
+}
+
+#endif
@@ -0,0 +1,165 @@
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "normalize.h"
+#include "normalize_utf8.h"
+
+using namespace std;
+
+/*
+ * Microbenchmark for the normalization kernels: compares the original per token
+ * modifyString against the block kernels on the given corpus files and checks
+ * that all of them produce the same words.
+ *
+ * Usage: ./bench_normalize <repetitions> <file> [<file> ...]
+ */
+
+// the mapper code before the block kernels, kept here as the reference
+string modifyString(string s) {
+    for (auto& c : s) {
+        if (isupper(c)) c = tolower(c);
+    }
+
+    // remove non alphabetical characters
+    s.erase(remove_if(s.begin(), s.end(), [](char c) { return !isalpha(c); }), s.end());
+
+    return s;
+}
+
+// words of the whole text, joined by ' ', the way the old mapper saw them
+string referenceWords(const string& text) {
+    string words;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t pos = text.find_first_of(" \n", start);
+        if (pos == string::npos) pos = text.size();
+
+        string modifiedWord = modifyString(text.substr(start, pos - start));
+        if (!modifiedWord.empty()) {
+            words += modifiedWord;
+            words += ' ';
+        }
+        start = pos + 1;
+    }
+    return words;
+}
+
+// words of the normalized buffer, joined by ' '
+string kernelWords(const char* data, size_t len) {
+    string words;
+    const char* pos = data;
+    const char* end = data + len;
+    while (pos < end) {
+        if (*pos == ' ') {
+            pos++;
+            continue;
+        }
+        const char* wordEnd = (const char*)memchr(pos, ' ', end - pos);
+        if (!wordEnd) wordEnd = end;
+        words.append(pos, wordEnd - pos);
+        words += ' ';
+        pos = wordEnd + 1;
+    }
+    return words;
+}
+
+template <typename F>
+double timeRuns(int repetitions, F run) {
+    auto begin = chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++) run();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <repetitions> <file> [<file> ...]" << endl;
+        return 1;
+    }
+
+    int repetitions = atoi(argv[1]);
+    if (repetitions <= 0) repetitions = 1;
+
+    string corpus;
+    for (int i = 2; i < argc; i++) {
+        ifstream in(argv[i], ios::binary);
+        if (!in) {
+            cout << "Could not open file: " << argv[i] << endl;
+            return 1;
+        }
+        stringstream content;
+        content << in.rdbuf();
+        corpus += content.str();
+        corpus += '\n';
+    }
+
+    double megabytes = corpus.size() * (double)repetitions / (1024 * 1024);
+    cout << "corpus: " << corpus.size() << " bytes, " << repetitions << " repetitions" << endl;
+
+    string expected = referenceWords(corpus);
+    volatile size_t sink = 0;
+
+    double seconds = timeRuns(repetitions, [&]() {
+        // same work as the old mapper: one copy per token, modifyString on each
+        size_t start = 0;
+        while (start <= corpus.size()) {
+            size_t pos = corpus.find_first_of(" \n", start);
+            if (pos == string::npos) pos = corpus.size();
+            sink += modifyString(corpus.substr(start, pos - start)).size();
+            start = pos + 1;
+        }
+    });
+    cout << "modifyString per token: " << megabytes / seconds << " MB/s" << endl;
+
+    struct Kernel {
+        const char* name;
+        NormalizeFunc func;
+        bool supported;
+        bool utf8;
+    };
+    vector<Kernel> kernels = {{"scalar", normalizeScalar, true, false}};
+#ifdef NORMALIZE_X86
+    __builtin_cpu_init();
+    kernels.push_back({"sse4.2", normalizeSSE42, (bool)__builtin_cpu_supports("sse4.2"), false});
+    kernels.push_back({"avx2", normalizeAVX2, (bool)__builtin_cpu_supports("avx2"), false});
+#endif
+    kernels.push_back({"utf8 scalar", normalizeUtf8Scalar, true, true});
+#ifdef NORMALIZE_X86
+    kernels.push_back({"utf8 sse4.2", normalizeUtf8SSE42, (bool)__builtin_cpu_supports("sse4.2"), true});
+    kernels.push_back({"utf8 avx2", normalizeUtf8AVX2, (bool)__builtin_cpu_supports("avx2"), true});
+#endif
+
+    // the UTF-8 kernels only give the same words as modifyString on ASCII text,
+    // on any text they must give the same bytes as the scalar one
+    bool asciiCorpus = all_of(corpus.begin(), corpus.end(), [](char c) { return (unsigned char)c < 0x80; });
+
+    vector<char> output(NORMALIZE_OUTPUT_SIZE(corpus.size()));
+    string utf8Expected(output.data(), normalizeUtf8Scalar(corpus.data(), corpus.size(), output.data()));
+    bool allMatch = true;
+    for (const auto& kernel : kernels) {
+        if (!kernel.supported) {
+            cout << kernel.name << ": not supported by this cpu" << endl;
+            continue;
+        }
+
+        size_t len = kernel.func(corpus.data(), corpus.size(), output.data());
+        bool match = (kernel.utf8 && !asciiCorpus) || kernelWords(output.data(), len) == expected;
+        if (kernel.utf8) match &= string(output.data(), len) == utf8Expected;
+        allMatch &= match;
+
+        seconds = timeRuns(repetitions, [&]() {
+            sink += kernel.func(corpus.data(), corpus.size(), output.data());
+        });
+        cout << kernel.name << " kernel: " << megabytes / seconds << " MB/s"
+             << (match ? "" : " (OUTPUT DIFFERS)") << endl;
+    }
+
+    return allMatch ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# Scaling benchmark: runs the indexer on a synthetic corpus for every pair of mapper and
+# reducer counts. Each run keeps its --stats report in $BENCH_DIR/stats; one CSV line per
+# run is printed and appended to $BENCH_DIR/results.csv, tagged with the current commit,
+# so that the same sweep on another commit shows scaling regressions.
+#
+# Settings, from the environment:
+#   BENCH_DIR    where the corpus, the reports and the results go (/tmp/inverted-index-bench)
+#   FILES, SIZE_MB, ZIPF, SIZE_SKEW, VOCABULARY, SEED    corpus, see gen_corpus.cpp
+#   MAPPERS, REDUCERS    thread counts to sweep ("1 2 4 8" and "1 2 4")
+#   REPETITIONS          runs of each configuration (3)
+#   EXTRA_ARGS           more indexer arguments, e.g. "--memory-budget 64"
+
+set -e
+cd "$(dirname "$0")"
+
+BENCH_DIR=${BENCH_DIR:-/tmp/inverted-index-bench}
+FILES=${FILES:-64}
+SIZE_MB=${SIZE_MB:-64}
+ZIPF=${ZIPF:-1.0}
+SIZE_SKEW=${SIZE_SKEW:-1.0}
+VOCABULARY=${VOCABULARY:-100000}
+SEED=${SEED:-1}
+MAPPERS=${MAPPERS:-"1 2 4 8"}
+REDUCERS=${REDUCERS:-"1 2 4"}
+REPETITIONS=${REPETITIONS:-3}
+
+EXEC=$(pwd)/exec
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+FIELDS="wall_seconds cpu_seconds map_wall_seconds reduce_wall_seconds log_wait_seconds barrier_wait_seconds lock_wait_seconds"
+
+mkdir -p "$BENCH_DIR/run" "$BENCH_DIR/stats"
+
+# the indexer reads the files from ../checker, relative to the directory it runs in
+corpus="files=$FILES size=$SIZE_MB zipf=$ZIPF skew=$SIZE_SKEW vocabulary=$VOCABULARY seed=$SEED"
+if [ "$(cat "$BENCH_DIR/corpus" 2>/dev/null)" != "$corpus" ]; then
+    echo "generating corpus: $corpus" >&2
+    rm -rf "$BENCH_DIR/checker"
+    ./gen_corpus "$BENCH_DIR/checker" "$FILES" "$SIZE_MB" --zipf "$ZIPF" --size-skew "$SIZE_SKEW" \
+        --vocabulary "$VOCABULARY" --seed "$SEED" > "$BENCH_DIR/run/input.txt"
+    echo "$corpus" > "$BENCH_DIR/corpus"
+fi
+
+# summary fields of a report are on lines of their own
+field() {
+    sed -n "s/^  \"$1\": \([0-9.]*\),$/\1/p" "$2"
+}
+
+header="commit,mappers,reducers,repetition,${FIELDS// /,}"
+[ -f "$BENCH_DIR/results.csv" ] || echo "$header" > "$BENCH_DIR/results.csv"
+echo "$header"
+
+for mappers in $MAPPERS; do
+    for reducers in $REDUCERS; do
+        for repetition in $(seq "$REPETITIONS"); do
+            report="$BENCH_DIR/stats/$COMMIT-m$mappers-r$reducers-$repetition.json"
+            (cd "$BENCH_DIR/run" && "$EXEC" "$mappers" "$reducers" input.txt --stats "$report" $EXTRA_ARGS > /dev/null)
+
+            line="$COMMIT,$mappers,$reducers,$repetition"
+            for name in $FIELDS; do
+                line="$line,$(field "$name" "$report")"
+            done
+            echo "$line" | tee -a "$BENCH_DIR/results.csv"
+        done
+    done
+done
@@ -0,0 +1,250 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <mpi.h>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "interner.h"
+#include "index_format.h"
+#include "text_output.h"
+
+using namespace std;
+
+/*
+ * MPI build (make mpi): the input files are split between the ranks, every rank maps its
+ * files with its own mapper threads, then each bucket (letter) goes to the rank that
+ * reduces it with one MPI_Alltoallv, and the reducer threads of that rank write it. The
+ * main thread of a rank is the only one that calls MPI.
+ */
+
+// one (word, file) record on the wire, followed by the bytes of the word
+struct WireRecord {
+    int32_t fileID;
+    uint32_t frequency;
+    uint32_t length;
+};
+
+// the input list read by rank 0 (ok tells if it could be read), on every rank; false everywhere if it failed
+inline bool broadcastNames(vector<string>& names, bool ok) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    // the names have no whitespace (the list is read with %s), so they go as one string
+    string packed;
+    int64_t size = -1;
+    if (rank == 0 && ok) {
+        for (const auto& name : names) packed += name + "\n";
+        size = packed.size();
+    }
+    MPI_Bcast(&size, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+    if (size < 0) return false;
+
+    packed.resize(size);
+    MPI_Bcast(packed.data(), size, MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank != 0) {
+        names.clear();
+        for (size_t start = 0, end; start < packed.size(); start = end + 1) {
+            end = packed.find('\n', start);
+            names.push_back(packed.substr(start, end - start));
+        }
+    }
+    return true;
+}
+
+/*
+ * Rank of every input file: rank 0 gives the biggest files first, each to the rank with the
+ * least bytes so far, and sends the result to the others. A big file is not split between
+ * ranks, but the mappers of its rank still process it in chunks.
+ */
+inline vector<int> assignFilesToRanks(const vector<string>& paths) {
+    int rank, nrRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nrRanks);
+
+    vector<int> owner(paths.size(), 0);
+    if (rank == 0) {
+        vector<size_t> sizes(paths.size(), 0), order(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            struct stat st;
+            if (stat(paths[i].c_str(), &st) == 0) sizes[i] = st.st_size;
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+        vector<size_t> load(nrRanks, 0);
+        for (size_t i : order) {
+            int lightest = min_element(load.begin(), load.end()) - load.begin();
+            owner[i] = lightest;
+            load[lightest] += sizes[i];
+        }
+    }
+    MPI_Bcast(owner.data(), owner.size(), MPI_INT, 0, MPI_COMM_WORLD);
+    return owner;
+}
+
+// records of every bucket over all the ranks
+inline vector<size_t> globalBucketRecords(const vector<PartialList>& lists, int nrBuckets) {
+    vector<uint64_t> records(nrBuckets, 0);
+    for (const auto& partialList : lists) {
+        for (int b = 0; b < nrBuckets; b++) records[b] += partialList[b].size();
+    }
+    MPI_Allreduce(MPI_IN_PLACE, records.data(), nrBuckets, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    return vector<size_t>(records.begin(), records.end());
+}
+
+// MPI counts are ints: sizes of messages, or -1 if one does not fit
+inline bool toCounts(const vector<size_t>& sizes, vector<int>& counts) {
+    counts.resize(sizes.size());
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (sizes[i] > INT_MAX) return false;
+        counts[i] = sizes[i];
+    }
+    return true;
+}
+
+/*
+ * The shuffle between ranks: the buckets of every file are sent to the rank that owns them
+ * (bucketRank), in file order, and the partial lists of this rank are refilled with the
+ * records it received. The words then live in received, so the arenas of the mappers can go.
+ * False (on every rank) if a rank would send more than 2 GiB to another one.
+ */
+inline bool exchangeBuckets(vector<PartialList>& lists, const vector<int>& bucketRank, vector<char>& received) {
+    int nrRanks;
+    MPI_Comm_size(MPI_COMM_WORLD, &nrRanks);
+    int nrBuckets = bucketRank.size();
+
+    vector<size_t> sendSizes(nrRanks, 0);
+    for (const auto& partialList : lists) {
+        for (int b = 0; b < nrBuckets; b++) {
+            for (const auto& wordRef : partialList[b]) sendSizes[bucketRank[b]] += sizeof(WireRecord) + wordRef.length;
+        }
+    }
+
+    vector<int> sendCounts, recvCounts(nrRanks);
+    int fits = toCounts(sendSizes, sendCounts);
+    MPI_Allreduce(MPI_IN_PLACE, &fits, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!fits) return false;
+    MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+
+    vector<int> sendDispls(nrRanks, 0), recvDispls(nrRanks, 0);
+    size_t recvSize = 0;
+    for (int r = 0; r < nrRanks; r++) {
+        recvDispls[r] = recvSize;
+        recvSize += recvCounts[r];
+        if (r > 0) sendDispls[r] = sendDispls[r - 1] + sendCounts[r - 1];
+    }
+    fits = recvSize <= INT_MAX;
+    MPI_Allreduce(MPI_IN_PLACE, &fits, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!fits) return false;
+
+    // for every rank its buckets, each one in file order
+    vector<char> sendBuffer(sendDispls[nrRanks - 1] + sendCounts[nrRanks - 1]);
+    vector<size_t> position(sendDispls.begin(), sendDispls.end());
+    for (auto& partialList : lists) {
+        for (int b = 0; b < nrBuckets; b++) {
+            char* out = sendBuffer.data() + position[bucketRank[b]];
+            for (const auto& wordRef : partialList[b]) {
+                WireRecord record = {wordRef.fileID, wordRef.frequency, wordRef.length};
+                memcpy(out, &record, sizeof(record));
+                memcpy(out + sizeof(record), wordRef.word, wordRef.length);
+                out += sizeof(record) + wordRef.length;
+            }
+            position[bucketRank[b]] = out - sendBuffer.data();
+            vector<WordRef>().swap(partialList[b]);
+        }
+    }
+
+    received.resize(recvSize);
+    MPI_Alltoallv(sendBuffer.data(), sendCounts.data(), sendDispls.data(), MPI_CHAR,
+                  received.data(), recvCounts.data(), recvDispls.data(), MPI_CHAR, MPI_COMM_WORLD);
+    vector<char>().swap(sendBuffer);
+
+    // a file comes from a single rank, so every bucket of a file gets its records in the original order
+    for (size_t offset = 0; offset < received.size();) {
+        WireRecord record;
+        memcpy(&record, received.data() + offset, sizeof(record));
+        const char* word = received.data() + offset + sizeof(record);
+        lists[record.fileID - 1][bucketOf(string_view(word, record.length))].push_back(
+            {word, record.length, record.fileID, record.frequency});
+        offset += sizeof(record) + record.length;
+    }
+    return true;
+}
+
+template <typename T>
+void appendBytes(vector<char>& buffer, const T* data, size_t count) {
+    const char* bytes = (const char*)data;
+    buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+const char* readBytes(const char* in, vector<T>& data, size_t count) {
+    data.resize(count);
+    memcpy(data.data(), in, count * sizeof(T));
+    return in + count * sizeof(T);
+}
+
+// the sections of the binary index encoded by the other ranks, sent to rank 0 which writes the file
+inline bool gatherSections(vector<IndexSection>& sections, const vector<int>& bucketRank) {
+    int rank, nrRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nrRanks);
+
+    if (rank != 0) {
+        vector<char> buffer;
+        for (size_t b = 0; b < sections.size(); b++) {
+            if (bucketRank[b] != rank) continue;
+            const IndexSection& section = sections[b];
+            uint64_t sizes[4] = {section.numTerms, section.terms.size(), section.postings.size(), section.blocks.size()};
+            appendBytes(buffer, sizes, 4);
+            appendBytes(buffer, section.terms.data(), section.terms.size());
+            appendBytes(buffer, section.postings.data(), section.postings.size());
+            appendBytes(buffer, section.blocks.data(), section.blocks.size());
+        }
+        int fits = buffer.size() <= INT_MAX;
+        MPI_Send(&fits, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
+        if (fits) MPI_Send(buffer.data(), buffer.size(), MPI_CHAR, 0, 0, MPI_COMM_WORLD);
+        return fits;
+    }
+
+    bool ok = true;
+    for (int r = 1; r < nrRanks; r++) {
+        int fits;
+        MPI_Recv(&fits, 1, MPI_INT, r, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (!fits) {
+            ok = false;
+            continue;
+        }
+
+        MPI_Status status;
+        int size;
+        MPI_Probe(r, 0, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_CHAR, &size);
+        vector<char> buffer(size);
+        MPI_Recv(buffer.data(), size, MPI_CHAR, r, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        const char* in = buffer.data();
+        for (size_t b = 0; b < sections.size(); b++) {
+            if (bucketRank[b] != r) continue;
+            IndexSection& section = sections[b];
+            uint64_t sizes[4];
+            memcpy(sizes, in, sizeof(sizes));
+            in += sizeof(sizes);
+            section.numTerms = sizes[0];
+            in = readBytes(in, section.terms, sizes[1]);
+            in = readBytes(in, section.postings, sizes[2]);
+            in = readBytes(in, section.blocks, sizes[3]);
+        }
+    }
+    return ok;
+}
+
+#endif
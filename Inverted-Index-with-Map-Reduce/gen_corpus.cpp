@@ -0,0 +1,133 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <unordered_set>
+#include <sys/stat.h>
+
+using namespace std;
+
+/*
+ * Synthetic corpus for the benchmark: the words follow a Zipf distribution (the k-th
+ * most frequent word appears about 1/k^s times as often as the first) and the sizes of
+ * the files follow a power law, so a few big files dominate when the skew is high.
+ * Some words are capitalized or followed by punctuation, as in real text.
+ *
+ * The files are written as <output_dir>/doc<i>.txt and the input list for the indexer
+ * (number of files, then their names) goes to the standard output.
+ *
+ * Usage: ./gen_corpus <output_dir> <nr_files> <total_MiB> [--zipf <s>] [--size-skew <a>]
+ *                     [--vocabulary <nr_words>] [--seed <n>]
+ */
+
+// distinct random lowercase words; the frequent ones are shorter, like in natural language
+vector<string> makeVocabulary(size_t size, mt19937_64& rng) {
+    vector<string> words;
+    unordered_set<string> seen;
+    while (words.size() < size) {
+        size_t maxLength = min(3 + (size_t)log2(words.size() + 2), (size_t)14);
+        size_t length = uniform_int_distribution<size_t>(1, maxLength)(rng);
+
+        string word(length, 'a');
+        for (char& c : word) c = 'a' + rng() % 26;
+        if (seen.insert(word).second) words.push_back(word);
+    }
+    return words;
+}
+
+// cumulative distribution of the ranks 1..size for the exponent s
+vector<double> zipfDistribution(size_t size, double s) {
+    vector<double> cdf(size);
+    double sum = 0;
+    for (size_t k = 0; k < size; k++) {
+        sum += 1 / pow((double)(k + 1), s);
+        cdf[k] = sum;
+    }
+    for (double& value : cdf) value /= sum;
+    return cdf;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        cout << "Usage: " << argv[0] << " <output_dir> <nr_files> <total_MiB> [--zipf <s>] [--size-skew <a>]"
+             << " [--vocabulary <nr_words>] [--seed <n>]" << endl;
+        return 1;
+    }
+
+    string outputDir = argv[1];
+    int nrFiles = atoi(argv[2]);
+    double totalBytes = atof(argv[3]) * (1 << 20);
+    if (nrFiles <= 0 || totalBytes <= 0) {
+        cout << "Invalid number of files or size" << endl;
+        return 1;
+    }
+
+    double zipf = 1.0, sizeSkew = 1.0;
+    size_t vocabularySize = 100000;
+    uint64_t seed = 1;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--zipf") == 0 && i + 1 < argc) {
+            zipf = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--size-skew") == 0 && i + 1 < argc) {
+            sizeSkew = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--vocabulary") == 0 && i + 1 < argc) {
+            vocabularySize = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            cout << "Unknown argument: " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    mkdir(outputDir.c_str(), 0755);
+    mt19937_64 rng(seed);
+    vector<string> vocabulary = makeVocabulary(vocabularySize, rng);
+    vector<double> cdf = zipfDistribution(vocabularySize, zipf);
+
+    // the i-th biggest file gets a share proportional to 1/i^a, in a random order
+    vector<double> shares(nrFiles);
+    double sum = 0;
+    for (int i = 0; i < nrFiles; i++) {
+        shares[i] = 1 / pow((double)(i + 1), sizeSkew);
+        sum += shares[i];
+    }
+    shuffle(shares.begin(), shares.end(), rng);
+
+    uniform_real_distribution<double> uniform(0, 1);
+    const char punctuation[] = ",.;:!?";
+
+    cout << nrFiles << endl;
+    for (int f = 0; f < nrFiles; f++) {
+        string name = "doc" + to_string(f + 1) + ".txt";
+        ofstream out(outputDir + "/" + name, ios::binary);
+        if (!out) {
+            cerr << "Could not create file: " << outputDir << "/" << name << endl;
+            return 1;
+        }
+
+        size_t size = max((size_t)1, (size_t)(totalBytes * shares[f] / sum));
+        string text;
+        text.reserve(size + 64);
+        int wordsOnLine = 0;
+        while (text.size() < size) {
+            size_t rank = lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+            string word = vocabulary[min(rank, vocabularySize - 1)];
+
+            double style = uniform(rng);
+            if (style < 0.05) word[0] = toupper(word[0]);
+            else if (style < 0.10) word += punctuation[rng() % (sizeof(punctuation) - 1)];
+
+            text += word;
+            text += ++wordsOnLine % 12 == 0 ? '\n' : ' ';
+        }
+        text.back() = '\n';
+        out << text;
+        cout << name << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+#
+# Generates unicode_tables.h, the character classes and simple case folding used by
+# the UTF-8 normalization (normalize_utf8.h), from the Unicode database of Python:
+#
+#   python3 gen_unicode_tables.py > unicode_tables.h
+#
+# Every code point gets a 16 bit entry, (index of its folding delta << 2) | class, in a
+# two stage table: the high bits of the code point select a block of entries, and
+# identical blocks are stored once.
+
+import sys
+import unicodedata
+
+MAX_CODE_POINT = 0x110000
+
+CLASS_DROP = 0        # removed from the text, like punctuation in the ASCII mode
+CLASS_WORD = 1        # letters and combining marks, kept (case folded)
+CLASS_SEPARATOR = 2   # ends a word
+
+
+def char_class(cp):
+    # the ASCII rules of the indexer: only ' ' and '\n' separate words
+    if cp < 0x80:
+        c = chr(cp)
+        if c.isascii() and c.isalpha():
+            return CLASS_WORD
+        return CLASS_SEPARATOR if c in ' \n' else CLASS_DROP
+
+    category = unicodedata.category(chr(cp))
+    if category[0] in 'LM':
+        return CLASS_WORD
+    if category in ('Zs', 'Zl', 'Zp'):
+        return CLASS_SEPARATOR
+    return CLASS_DROP
+
+
+def simple_fold(cp):
+    # simple (one to one) case folding: full foldings that expand (like U+00DF to "ss")
+    # fall back to the lowercase mapping when it is a single character
+    c = chr(cp)
+    for mapped in (c.casefold(), c.lower()):
+        if len(mapped) == 1:
+            return ord(mapped)
+    return cp
+
+
+def main():
+    deltas = [0]
+    delta_index = {0: 0}
+    entries = []
+    for cp in range(MAX_CODE_POINT):
+        cls = char_class(cp)
+        delta = simple_fold(cp) - cp if cls == CLASS_WORD else 0
+        if delta not in delta_index:
+            delta_index[delta] = len(deltas)
+            deltas.append(delta)
+        entries.append(delta_index[delta] << 2 | cls)
+
+    assert len(deltas) < (1 << 14)
+
+    # the block size with the smallest tables
+    best = None
+    for shift in range(5, 11):
+        size = 1 << shift
+        blocks, block_ids, index = [], {}, []
+        for start in range(0, MAX_CODE_POINT, size):
+            block = tuple(entries[start:start + size])
+            if block not in block_ids:
+                block_ids[block] = len(blocks)
+                blocks.append(block)
+            index.append(block_ids[block])
+        index_bytes = 1 if len(blocks) <= 256 else 2
+        total = len(index) * index_bytes + len(blocks) * size * 2
+        if best is None or total < best[0]:
+            best = (total, shift, blocks, index, index_bytes)
+
+    total, shift, blocks, index, index_bytes = best
+    index_type = 'uint8_t' if index_bytes == 1 else 'uint16_t'
+    size = 1 << shift
+
+    out = sys.stdout
+    out.write('// Generated by gen_unicode_tables.py from the Unicode %s database, do not edit.\n'
+              % unicodedata.unidata_version)
+    out.write('#ifndef UNICODE_TABLES_H\n#define UNICODE_TABLES_H\n\n#include <stdint.h>\n\n')
+    out.write('#define UNICODE_CLASS_DROP %d\n' % CLASS_DROP)
+    out.write('#define UNICODE_CLASS_WORD %d\n' % CLASS_WORD)
+    out.write('#define UNICODE_CLASS_SEPARATOR %d\n' % CLASS_SEPARATOR)
+    out.write('#define UNICODE_BLOCK_SHIFT %d\n\n' % shift)
+    out.write('// %d bytes in total\n\n' % (total + len(deltas) * 4))
+
+    out.write('static const int32_t unicodeFoldDeltas[%d] = {\n' % len(deltas))
+    for i in range(0, len(deltas), 12):
+        out.write('    ' + ', '.join(str(d) for d in deltas[i:i + 12]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('static const %s unicodeBlockIndex[%d] = {\n' % (index_type, len(index)))
+    for i in range(0, len(index), 24):
+        out.write('    ' + ', '.join(str(b) for b in index[i:i + 24]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('static const uint16_t unicodeBlocks[%d][%d] = {\n' % (len(blocks), size))
+    for block in blocks:
+        out.write('    {')
+        for i in range(0, size, 16):
+            out.write(('' if i == 0 else '\n     ') + ', '.join(str(e) for e in block[i:i + 16]) + ',')
+        out.write('},\n')
+    out.write('};\n\n#endif\n')
+
+
+if __name__ == '__main__':
+    main()
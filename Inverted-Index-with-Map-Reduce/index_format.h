@@ -0,0 +1,210 @@
+#ifndef INDEX_FORMAT_H
+#define INDEX_FORMAT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+/*
+ * Binary inverted index file (all integers little endian):
+ *
+ *   IndexHeader
+ *   BlockEntry[numBlocks]       first term of every block, for the binary search
+ *   term blocks                 up to INDEX_BLOCK_SIZE terms each, front coded
+ *   posting lists               sorted file IDs, delta + varint encoded, then the
+ *                               frequency of the term in each of these files (varints)
+ *   document lengths            uint32 per file ID (firstFileID .. firstFileID + numFiles - 1),
+ *                               number of words in the file (0 for IDs not in the index)
+ *
+ * A term block starts with a full term (varint length + bytes); every other term
+ * is stored as (varint shared prefix length, varint suffix length, suffix bytes).
+ * Each term is followed by its number of files and the size in bytes of its
+ * posting list; the posting lists of a block are contiguous, starting at the
+ * block's postingsOffset. A block ends where the next one starts (blocks of
+ * different sections are never merged, so some hold fewer terms). Terms are
+ * sorted alphabetically over the whole file.
+ */
+
+#define INDEX_MAGIC "IIDX"
+#define INDEX_VERSION 3
+#define INDEX_BLOCK_SIZE 16
+
+#define INDEX_FLAG_UTF8 1       // the words were normalized in UTF-8 mode, queries must be too
+
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numTerms;
+    uint32_t numBlocks;
+    uint32_t numFiles;          // entries of the document lengths table
+    uint32_t blockSize;
+    uint32_t firstFileID;       // file ID of the first entry of the document lengths table
+    uint32_t flags;             // INDEX_FLAG_*
+    uint64_t blocksOffset;      // from the start of the file
+    uint64_t termsOffset;
+    uint64_t postingsOffset;
+    uint64_t docLengthsOffset;
+    uint64_t fileSize;
+};
+static_assert(sizeof(IndexHeader) == 72, "IndexHeader is written as is");
+
+struct BlockEntry {
+    uint64_t termsOffset;       // from the start of the term blocks
+    uint64_t postingsOffset;    // from the start of the posting lists
+};
+
+static inline void putVarint(vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+static inline uint64_t getVarint(const uint8_t*& pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (*pos & 0x80) {
+        value |= (uint64_t)(*pos++ & 0x7F) << shift;
+        shift += 7;
+    }
+    value |= (uint64_t)(*pos++) << shift;
+    return value;
+}
+
+// same, for data that may be damaged: false if the varint does not end before end or has more than 64 bits
+static inline bool getVarint(const uint8_t*& pos, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// files a word appears in (sorted, unique) and how many times it appears in each of them
+struct Postings {
+    vector<int> fileIDs;
+    vector<uint32_t> frequencies;
+};
+
+/*
+ * Encoded part of the index (the terms of one letter), built by the reducer that owns it.
+ * Offsets are relative to the section until the index is assembled.
+ */
+struct IndexSection {
+    vector<uint8_t> terms;
+    vector<uint8_t> postings;
+    vector<BlockEntry> blocks;
+    uint32_t numTerms = 0;
+    string lastTerm;            // the next term is front coded against it
+};
+
+// append a term to the section: terms must come in alphabetical order, with their file IDs sorted and unique
+inline void appendTerm(IndexSection& section, string_view word, const int* fileIDs, const uint32_t* frequencies,
+                       size_t nrFiles) {
+    if (section.numTerms % INDEX_BLOCK_SIZE == 0) {
+        section.blocks.push_back({section.terms.size(), section.postings.size()});
+        putVarint(section.terms, word.size());
+        section.terms.insert(section.terms.end(), word.begin(), word.end());
+    } else {
+        const string& previous = section.lastTerm;
+        size_t shared = 0;
+        size_t limit = min(previous.size(), word.size());
+        while (shared < limit && previous[shared] == word[shared]) shared++;
+
+        putVarint(section.terms, shared);
+        putVarint(section.terms, word.size() - shared);
+        section.terms.insert(section.terms.end(), word.begin() + shared, word.end());
+    }
+
+    size_t postingsStart = section.postings.size();
+    int last = 0;
+    for (size_t i = 0; i < nrFiles; i++) {
+        putVarint(section.postings, fileIDs[i] - last);
+        last = fileIDs[i];
+    }
+    for (size_t i = 0; i < nrFiles; i++) {
+        putVarint(section.postings, frequencies[i]);
+    }
+
+    putVarint(section.terms, nrFiles);
+    putVarint(section.terms, section.postings.size() - postingsStart);
+
+    section.lastTerm.assign(word);
+    section.numTerms++;
+}
+
+inline void appendTerm(IndexSection& section, string_view word, const Postings& postings) {
+    appendTerm(section, word, postings.fileIDs.data(), postings.frequencies.data(), postings.fileIDs.size());
+}
+
+// words must be sorted alphabetically and every list of file IDs sorted and unique
+inline void encodeSection(const vector<pair<string_view, const Postings*>>& words, IndexSection& section) {
+    for (const auto& [word, postings] : words) appendTerm(section, word, *postings);
+}
+
+// concatenate the sections, which must be given in alphabetical order, in one index file;
+// docLengths[i] is the number of words of file firstFileID + i
+inline bool writeIndex(const string& path, const vector<IndexSection>& sections, const vector<uint32_t>& docLengths,
+                       uint32_t firstFileID = 1, uint32_t flags = 0) {
+    IndexHeader header;
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.version = INDEX_VERSION;
+    header.numTerms = 0;
+    header.numBlocks = 0;
+    header.numFiles = docLengths.size();
+    header.blockSize = INDEX_BLOCK_SIZE;
+    header.firstFileID = firstFileID;
+    header.flags = flags;
+
+    uint64_t termsSize = 0, postingsSize = 0;
+    for (const auto& section : sections) {
+        header.numTerms += section.numTerms;
+        header.numBlocks += section.blocks.size();
+        termsSize += section.terms.size();
+        postingsSize += section.postings.size();
+    }
+
+    header.blocksOffset = sizeof(IndexHeader);
+    header.termsOffset = header.blocksOffset + (uint64_t)header.numBlocks * sizeof(BlockEntry);
+    header.postingsOffset = header.termsOffset + termsSize;
+    header.docLengthsOffset = header.postingsOffset + postingsSize;
+    header.fileSize = header.docLengthsOffset + docLengths.size() * sizeof(uint32_t);
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    // block offsets become relative to the start of the whole term / posting area
+    uint64_t termsBase = 0, postingsBase = 0;
+    for (const auto& section : sections) {
+        for (BlockEntry block : section.blocks) {
+            block.termsOffset += termsBase;
+            block.postingsOffset += postingsBase;
+            ok = ok && fwrite(&block, sizeof(block), 1, file) == 1;
+        }
+        termsBase += section.terms.size();
+        postingsBase += section.postings.size();
+    }
+
+    for (const auto& section : sections) {
+        ok = ok && fwrite(section.terms.data(), 1, section.terms.size(), file) == section.terms.size();
+    }
+    for (const auto& section : sections) {
+        ok = ok && fwrite(section.postings.data(), 1, section.postings.size(), file) == section.postings.size();
+    }
+    ok = ok && fwrite(docLengths.data(), sizeof(uint32_t), docLengths.size(), file) == docLengths.size();
+
+    return fclose(file) == 0 && ok;
+}
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef INDEX_READER_H
+#define INDEX_READER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "index_format.h"
+
+using namespace std;
+
+/*
+ * Read-only access to a binary index file. The file is mapped in memory, so opening
+ * it costs nothing and a lookup only touches the block index, one term block and
+ * one posting list.
+ *
+ * The file may be damaged: open() checks that the sections and the blocks lie inside
+ * the file, in order, and every read of a term or a posting list stays inside its
+ * block and its list. A read that meets damaged data stops there and marks the
+ * index corrupt(), so the caller can report it.
+ */
+class IndexReader {
+public:
+    IndexReader() {}
+    IndexReader(const IndexReader&) = delete;
+    IndexReader& operator=(const IndexReader&) = delete;
+
+    ~IndexReader() {
+        close();
+    }
+
+    bool open(const string& path) {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+            ::close(fd);
+            return false;
+        }
+
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) return false;
+
+        data = (const uint8_t*)addr;
+        size = st.st_size;
+
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, INDEX_MAGIC, 4) != 0 || header.version != INDEX_VERSION ||
+            header.fileSize != size) {
+            close();
+            return false;
+        }
+
+        if (!checkLayout()) {
+            close();
+            return false;
+        }
+
+        blocks = (const BlockEntry*)(data + header.blocksOffset);
+        if (!checkBlocks()) {
+            close();
+            return false;
+        }
+        docLengths = data + header.docLengthsOffset;
+
+        uint64_t totalWords = 0;
+        for (uint32_t i = 0; i < header.numFiles; i++) totalWords += docLengthAt(i);
+        avgLength = header.numFiles ? (double)totalWords / header.numFiles : 0;
+        return true;
+    }
+
+    void close() {
+        if (data) munmap((void*)data, size);
+        data = nullptr;
+        size = 0;
+        corrupted = false;
+    }
+
+    // a lookup or a scan met damaged data, so what it returned may be incomplete
+    bool corrupt() const {
+        return corrupted;
+    }
+
+    uint32_t numTerms() const {
+        return header.numTerms;
+    }
+
+    uint32_t numFiles() const {
+        return header.numFiles;
+    }
+
+    uint32_t firstFileID() const {
+        return header.firstFileID;
+    }
+
+    uint32_t flags() const {
+        return header.flags;
+    }
+
+    // number of words of a file (0 for files the index does not cover)
+    uint32_t docLength(int fileID) const {
+        uint32_t offset = (uint32_t)fileID - header.firstFileID;
+        return fileID >= (int)header.firstFileID && offset < header.numFiles ? docLengthAt(offset) : 0;
+    }
+
+    double avgDocLength() const {
+        return avgLength;
+    }
+
+    // file IDs of the word, sorted, and optionally the occurrences in each file;
+    // false if the word is not in the index
+    bool lookup(string_view word, vector<int>& fileIDs, vector<uint32_t>* frequencies = nullptr) const {
+        fileIDs.clear();
+        if (frequencies) frequencies->clear();
+        if (!data || header.numBlocks == 0) return false;
+
+        // last block whose first term is <= word
+        uint32_t lo = 0, hi = header.numBlocks;
+        while (hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            if (firstTerm(mid) <= word) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        bool found = false;
+        scanBlock(lo, [&](string_view term, uint32_t count, const uint8_t* postings, const uint8_t* postingsEnd) {
+            if (term == word) {
+                found = decodePostings(postings, postingsEnd, count, fileIDs, frequencies);
+                corrupted |= !found;
+                return false;
+            }
+            // terms are sorted, no need to look further
+            return term < word;
+        });
+        return found;
+    }
+
+    // call f(term, fileIDs) for every term, in alphabetical order
+    template <typename F>
+    void forEachTerm(F f) const {
+        vector<int> fileIDs;
+        for (uint32_t b = 0; b < header.numBlocks && !corrupted; b++) {
+            scanBlock(b, [&](string_view term, uint32_t count, const uint8_t* postings, const uint8_t* postingsEnd) {
+                if (!decodePostings(postings, postingsEnd, count, fileIDs, nullptr)) {
+                    corrupted = true;
+                    return false;
+                }
+                f(term, fileIDs);
+                return true;
+            });
+        }
+    }
+
+    /*
+     * Walks the terms in alphabetical order one at a time, so several indexes can be
+     * merged term by term. The index must stay open while the cursor is used.
+     */
+    class TermCursor {
+    public:
+        TermCursor(const IndexReader& index) : index(index) {
+            if (index.data) {
+                next();
+            } else {
+                done = true;
+            }
+        }
+
+        bool valid() const {
+            return !done;
+        }
+
+        string_view term() const {
+            return current;
+        }
+
+        void postings(vector<int>& fileIDs, vector<uint32_t>* frequencies) const {
+            if (!decodePostings(postingList, nextPostings, count, fileIDs, frequencies)) index.corrupted = true;
+        }
+
+        // a damaged term ends the walk, with the index marked corrupt
+        void next() {
+            postingList = nextPostings;
+            bool first = false;
+            while (pos == blockEnd) {
+                if (block + 1 >= index.header.numBlocks) {
+                    done = true;
+                    return;
+                }
+                block++;
+                pos = index.termsStart(block);
+                blockEnd = index.termsEnd(block);
+                postingList = index.postingsStart(block);
+                postingsEnd = index.postingsEnd(block);
+                first = true;
+            }
+
+            uint64_t bytes;
+            if (!readTerm(pos, blockEnd, first, current, count, bytes) ||
+                !fitsPostings(postingList, postingsEnd, count, bytes)) {
+                index.corrupted = true;
+                done = true;
+                return;
+            }
+            nextPostings = postingList + bytes;
+        }
+
+    private:
+        const IndexReader& index;
+        uint32_t block = (uint32_t)-1;
+        const uint8_t* pos = nullptr;
+        const uint8_t* blockEnd = nullptr;
+        const uint8_t* postingList = nullptr;
+        const uint8_t* nextPostings = nullptr;
+        const uint8_t* postingsEnd = nullptr;
+        string current;
+        uint64_t count = 0;
+        bool done = false;
+    };
+
+private:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    IndexHeader header;
+    const BlockEntry* blocks = nullptr;
+    const uint8_t* docLengths = nullptr;
+    double avgLength = 0;
+    mutable bool corrupted = false;
+
+    // the sections follow each other in the order they are written, and the document lengths end the file
+    bool checkLayout() const {
+        if (header.blocksOffset != sizeof(IndexHeader) ||
+            (size - header.blocksOffset) / sizeof(BlockEntry) < header.numBlocks) {
+            return false;
+        }
+        uint64_t blocksEnd = header.blocksOffset + (uint64_t)header.numBlocks * sizeof(BlockEntry);
+        return header.termsOffset == blocksEnd && header.termsOffset <= header.postingsOffset &&
+               header.postingsOffset <= header.docLengthsOffset && header.docLengthsOffset <= size &&
+               (size - header.docLengthsOffset) / sizeof(uint32_t) == header.numFiles &&
+               (size - header.docLengthsOffset) % sizeof(uint32_t) == 0;
+    }
+
+    // the table follows the posting lists, so it is rarely aligned
+    uint32_t docLengthAt(uint32_t i) const {
+        uint32_t length;
+        memcpy(&length, docLengths + (size_t)i * sizeof(uint32_t), sizeof(length));
+        return length;
+    }
+
+    // every block holds at least one term, and the blocks start inside their sections, in order
+    bool checkBlocks() const {
+        uint64_t termsSize = header.postingsOffset - header.termsOffset;
+        uint64_t postingsSize = header.docLengthsOffset - header.postingsOffset;
+        for (uint32_t b = 0; b < header.numBlocks; b++) {
+            bool last = b + 1 == header.numBlocks;
+            if (blocks[b].termsOffset >= (last ? termsSize : blocks[b + 1].termsOffset) ||
+                blocks[b].postingsOffset > (last ? postingsSize : blocks[b + 1].postingsOffset)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // blocks never cross a section, so the last one of a letter may be shorter: a block ends where the next one starts
+    const uint8_t* termsStart(uint32_t block) const {
+        return data + header.termsOffset + blocks[block].termsOffset;
+    }
+
+    const uint8_t* termsEnd(uint32_t block) const {
+        return block + 1 < header.numBlocks ? termsStart(block + 1) : data + header.postingsOffset;
+    }
+
+    const uint8_t* postingsStart(uint32_t block) const {
+        return data + header.postingsOffset + blocks[block].postingsOffset;
+    }
+
+    const uint8_t* postingsEnd(uint32_t block) const {
+        return block + 1 < header.numBlocks ? postingsStart(block + 1) : data + header.docLengthsOffset;
+    }
+
+    // empty if the term is damaged
+    string_view firstTerm(uint32_t block) const {
+        const uint8_t* pos = termsStart(block);
+        const uint8_t* end = termsEnd(block);
+        uint64_t length;
+        if (!getVarint(pos, end, length) || length > (uint64_t)(end - pos)) {
+            corrupted = true;
+            return string_view();
+        }
+        return string_view((const char*)pos, length);
+    }
+
+    /*
+     * Decode the next term of a block at pos (the first one of a block is stored whole, the
+     * others front coded against term), then its number of files and the size of its posting
+     * list; false if it runs past the end of the block, shares more than the previous term or
+     * is empty
+     */
+    static bool readTerm(const uint8_t*& pos, const uint8_t* blockEnd, bool first, string& term, uint64_t& count,
+                         uint64_t& bytes) {
+        uint64_t shared = 0, suffix;
+        if ((!first && !getVarint(pos, blockEnd, shared)) || !getVarint(pos, blockEnd, suffix) ||
+            shared > term.size() || suffix > (uint64_t)(blockEnd - pos)) {
+            return false;
+        }
+        term.resize(shared);
+        term.append((const char*)pos, suffix);
+        pos += suffix;
+        return !term.empty() && getVarint(pos, blockEnd, count) && getVarint(pos, blockEnd, bytes);
+    }
+
+    // a posting list of count files takes at least a byte per file ID and per frequency
+    static bool fitsPostings(const uint8_t* postings, const uint8_t* postingsEnd, uint64_t count, uint64_t bytes) {
+        return bytes <= (uint64_t)(postingsEnd - postings) && count <= bytes / 2;
+    }
+
+    // decode the terms of a block one by one while visit(term, count, postings, postingsEnd) returns true
+    template <typename F>
+    void scanBlock(uint32_t block, F visit) const {
+        const uint8_t* pos = termsStart(block);
+        const uint8_t* blockEnd = termsEnd(block);
+        const uint8_t* postings = postingsStart(block);
+        const uint8_t* blockPostingsEnd = postingsEnd(block);
+
+        string term;
+        for (bool first = true; pos < blockEnd; first = false) {
+            uint64_t count, bytes;
+            if (!readTerm(pos, blockEnd, first, term, count, bytes) ||
+                !fitsPostings(postings, blockPostingsEnd, count, bytes)) {
+                corrupted = true;
+                return;
+            }
+            if (!visit(string_view(term), count, postings, postings + bytes)) return;
+            postings += bytes;
+        }
+    }
+
+    // false, with no file, if the list does not hold count increasing file IDs and their frequencies before end
+    static bool decodePostings(const uint8_t* pos, const uint8_t* end, uint64_t count, vector<int>& fileIDs,
+                               vector<uint32_t>* frequencies) {
+        fileIDs.resize(count);
+        if (frequencies) frequencies->resize(count);
+
+        uint64_t last = 0, value;
+        bool ok = true;
+        for (uint64_t i = 0; i < count && ok; i++) {
+            ok = getVarint(pos, end, value) && value != 0 && value <= (uint64_t)INT_MAX - last;
+            last += value;
+            fileIDs[i] = last;
+        }
+
+        // the frequencies follow the file IDs
+        for (uint64_t i = 0; frequencies && i < count && ok; i++) {
+            ok = getVarint(pos, end, value);
+            (*frequencies)[i] = value;
+        }
+
+        if (!ok) {
+            fileIDs.clear();
+            if (frequencies) frequencies->clear();
+        }
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef INTERNER_H
+#define INTERNER_H
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <stdint.h>
+
+using namespace std;
+
+#define ARENA_BLOCK_SIZE (1 << 20)   // bytes allocated at once for the words of a mapper
+#define INITIAL_SLOTS (1 << 12)      // power of two
+
+// a word of a partial list: points into the arena of the mapper that found it
+struct WordRef {
+    const char* word;
+    uint32_t length;
+    int fileID;
+    uint32_t frequency;   // occurrences of the word in the file (or chunk)
+
+    string_view view() const {
+        return string_view(word, length);
+    }
+};
+
+// words of one file (or of one chunk of a file), split in one bucket per first letter
+typedef vector<vector<WordRef>> PartialList;
+
+static inline uint64_t hashWord(string_view word) {
+    const uint64_t mul = 0x9E3779B97F4A7C15ull;
+    uint64_t h = word.size() * mul;
+    const char* p = word.data();
+    size_t n = word.size();
+
+    while (n >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, p, 8);
+        h = (h ^ chunk) * mul;
+        h ^= h >> 29;
+        p += 8;
+        n -= 8;
+    }
+    if (n > 0) {
+        uint64_t chunk = 0;
+        memcpy(&chunk, p, n);
+        h = (h ^ chunk) * mul;
+    }
+    return h ^ (h >> 32);
+}
+
+/*
+ * String interner owned by one mapper thread. Every distinct word is copied once
+ * in an append-only arena (so references stay valid until the interner is
+ * destroyed) and found again through an open addressing table with linear probing.
+ * Each slot remembers the last task that reported the word, which replaces the
+ * per file set used to avoid duplicates, and a value the caller uses to find the
+ * record of the word in the current task again (to count its occurrences).
+ */
+class WordInterner {
+public:
+    WordInterner() : slots(INITIAL_SLOTS), used(0) {}
+
+    // intern the word; firstInTask tells if the task reports it for the first time. The returned
+    // reference is the slot's record value, valid until the next call
+    uint32_t& addForTask(string_view word, int task, const char*& stored, bool& firstInTask) {
+        // keep the load factor under 1/2; grow first so the returned slot does not move
+        if ((used + 1) * 2 > slots.size()) grow();
+
+        uint64_t hash = hashWord(word);
+        size_t mask = slots.size() - 1;
+        size_t idx = hash & mask;
+
+        while (slots[idx].word) {
+            Slot& slot = slots[idx];
+            if (slot.hash == (uint32_t)hash && slot.length == word.size() &&
+                memcmp(slot.word, word.data(), word.size()) == 0) {
+                stored = slot.word;
+                firstInTask = slot.lastTask != task;
+                slot.lastTask = task;
+                return slot.record;
+            }
+            idx = (idx + 1) & mask;
+        }
+
+        Slot& slot = slots[idx];
+        slot.word = copyToArena(word);
+        slot.length = word.size();
+        slot.hash = (uint32_t)hash;
+        slot.lastTask = task;
+        used++;
+
+        stored = slot.word;
+        firstInTask = true;
+        return slot.record;
+    }
+
+    // forget every word and give the arena back; pointers to the words become invalid
+    void clear() {
+        vector<Slot>(INITIAL_SLOTS).swap(slots);
+        used = 0;
+        blocks.clear();
+        blockPos = nullptr;
+        blockLeft = 0;
+        arenaBytes = 0;
+    }
+
+    // bytes held by the table and the arena
+    size_t memoryUsage() const {
+        return slots.size() * sizeof(Slot) + arenaBytes;
+    }
+
+private:
+    struct Slot {
+        const char* word = nullptr;
+        uint32_t length = 0;
+        uint32_t hash = 0;
+        int lastTask = -1;
+        uint32_t record = 0;
+    };
+
+    vector<Slot> slots;
+    size_t used;
+
+    vector<unique_ptr<char[]>> blocks;
+    char* blockPos = nullptr;
+    size_t blockLeft = 0;
+    size_t arenaBytes = 0;
+
+    const char* copyToArena(string_view word) {
+        if (word.size() > blockLeft) {
+            // words longer than a block get a block of their own
+            size_t size = word.size() > ARENA_BLOCK_SIZE ? word.size() : ARENA_BLOCK_SIZE;
+            blocks.emplace_back(new char[size]);
+            arenaBytes += size;
+            blockPos = blocks.back().get();
+            blockLeft = size;
+        }
+
+        char* stored = blockPos;
+        memcpy(stored, word.data(), word.size());
+        blockPos += word.size();
+        blockLeft -= word.size();
+        return stored;
+    }
+
+    void grow() {
+        vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+
+        size_t mask = slots.size() - 1;
+        for (const Slot& slot : old) {
+            if (!slot.word) continue;
+            // the low bits of the stored hash are enough while the table stays under 2^32 slots
+            size_t idx = slot.hash & mask;
+            while (slots[idx].word) idx = (idx + 1) & mask;
+            slots[idx] = slot;
+        }
+    }
+};
+
+#endif
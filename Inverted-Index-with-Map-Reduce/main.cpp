@@ -4,15 +4,34 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <fstream>
 #include <algorithm>
-#include <queue>
 #include <vector>
-#include <map>
 #include <unordered_map>
-#include <set>
 #include <unordered_set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include "normalize.h"
+#include "normalize_utf8.h"
+#include "scheduler.h"
+#include "interner.h"
+#include "index_format.h"
+#include "segments.h"
+#include "text_output.h"
+#include "spill.h"
+#include "pipeline.h"
+#include "stats.h"
+#ifdef USE_MPI
+#include "distributed.h"
+#endif
+
+#define BLOCK_SIZE (1 << 16) // bytes of a mapped file normalized at once
 
 using namespace std;
 
@@ -21,272 +40,1060 @@ struct ThreadArgs {
     int NrMapperThreads;
     int NrReducerThreads;
 
-    queue<pair<string, int>>* filesQueue;                // queue to store all the files that need to be processed
-    vector<vector<pair<string, int>>>* allPartialLists;  // vector to store all the vectors of words from each files
-    map<string, vector<int>>* finalAggreagtedList;       // map to store each unique word from all the files + all the files the word appears in
+    FileScheduler* scheduler;                            // files (and chunks of big files) that need to be processed
+    vector<WordInterner>* interners;                     // one per mapper, owns the memory of all the words it found
+    vector<PartialList>* allPartialLists;                // words of each file, already split in one bucket per letter
+    vector<size_t>* letterRecords;                       // nrBuckets counters per mapper, records added to each bucket
+    vector<int>* letterOwner;                            // reducer of each letter, decided before the mappers start
+    CompletionLog* completed;                            // files whose partial list is ready for the reducers
+    bool overlap;                                        // reducers aggregate while the mappers run (enough cores)
+    vector<IndexSection>* indexSections;                 // binary index, one section per letter; NULL if not requested
+    bool writeText;                                      // false when only the binary index is built (incremental mode)
+    int fileIDOffset;                                    // added to the file IDs stored in the binary index
+    size_t memoryBudget;                                 // streaming mode: bytes for all the threads; 0 keeps everything in memory
+    vector<MapperSpill>* spills;                         // streaming mode: sorted runs written by each mapper
+    ThreadStats* stats;                                  // time and counters of this thread; NULL without --stats
+    const char* outputDir;                               // where the a.txt ... z.txt files go
+    NormalizeFunc normalize;                             // ASCII or UTF-8 kernel
+    int nrBuckets;                                       // NR_LETTERS, or NR_UTF8_BUCKETS in UTF-8 mode
 
-    pthread_mutex_t* queueMutex;
     pthread_mutex_t* printMutex;
-    pthread_mutex_t* finalAggreagtedListMutex;
     
-    pthread_barrier_t* barrier;                     // barrier waiting for NrMapperThreads + NrReducerThreads
-    pthread_barrier_t* reducerBarrier;              // barrier waiting only for Reducer threads
+    pthread_barrier_t* barrier;                     // streaming mode: the reducers wait for all the runs
 };
 
-string modifyString(string s) {
-    for (auto& c : s) {
-        if (isupper(c)) c = tolower(c);
+/*
+ * Give every letter to a reducer so that all reducers get about the same number of
+ * records (word, file) to aggregate, sort and write: biggest letters first, each one to
+ * the reducer with the least records so far. Every reducer runs it on the same counts,
+ * so they all agree on the result without any communication.
+ */
+vector<int> assignLetters(const vector<size_t>& records, int NrReducerThreads) {
+    vector<int> letters(records.size());
+    for (size_t i = 0; i < records.size(); i++) letters[i] = i;
+    stable_sort(letters.begin(), letters.end(), [&](int a, int b) { return records[a] > records[b]; });
+
+    vector<int> owner(records.size());
+    vector<size_t> load(NrReducerThreads, 0);
+    vector<int> count(NrReducerThreads, 0);
+    for (int letter : letters) {
+        int lightest = 0;
+        for (int r = 1; r < NrReducerThreads; r++) {
+            if (load[r] < load[lightest] || (load[r] == load[lightest] && count[r] < count[lightest])) {
+                lightest = r;
+            }
+        }
+        owner[letter] = lightest;
+        load[lightest] += records[letter];
+        count[lightest]++;
     }
+    return owner;
+}
+
+// forward declaration, the sampling below normalizes text like the mappers do
+template <typename F>
+void forEachWord(const char* text, size_t size, vector<char>& buffer, NormalizeFunc normalize, F onWord,
+                 bool releasePages = false, ThreadStats* stats = NULL);
+
+#define SAMPLE_FILES 16          // input files read to estimate the size of each letter
+#define SAMPLE_BYTES (1 << 16)   // bytes read from the start of each of them
 
-    // remove non alphabetical characters
-    s.erase(remove_if(s.begin(), s.end(), [](char c) { return !isalpha(c); }), s.end());
+/*
+ * Estimate the number of records of every letter from the start of a few input files,
+ * so the letters can be given to the reducers before any file is mapped (they start
+ * aggregating while the mappers are still running).
+ */
+vector<size_t> sampleLetterRecords(const vector<InputFile>& files, int nrBuckets, NormalizeFunc normalize) {
+    vector<size_t> records(nrBuckets, 1);
+    vector<char> text(SAMPLE_BYTES), buffer;
+    size_t step = max(files.size() / SAMPLE_FILES, (size_t)1);
 
-    return s;
+    for (size_t f = 0; f < files.size(); f += step) {
+        int fd = open(files[f].fullPath.c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        ssize_t size = pread(fd, text.data(), SAMPLE_BYTES, 0);
+        close(fd);
+        if (size <= 0) continue;
+
+        // a record is a distinct word of a file (the last word may be cut, it hardly matters)
+        unordered_set<string> seen;
+        forEachWord(text.data(), size, buffer, normalize, [&](string_view word) {
+            if (seen.emplace(word).second) records[bucketOf(word)]++;
+        });
+    }
+    return records;
 }
 
-void* threadFunc(void* arg) {
-    ThreadArgs* args = (ThreadArgs*)arg;
+// read-only view of a whole input file, mapped in memory
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+};
 
-    if (args->id <= args->NrMapperThreads) {
-        while (true) {
-            pair<string, int> fileToProcess;
-
-            /* safely fetch a file from the queue */
-            pthread_mutex_lock(args->queueMutex);
-            if (!args->filesQueue->empty()) {
-                fileToProcess = args->filesQueue->front();
-                args->filesQueue->pop();
-            }
-            pthread_mutex_unlock(args->queueMutex);
+bool mapFile(const string& path, MappedFile& mapped) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
 
-            if (fileToProcess.first.empty()) break;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
 
-            /* Process the file */
-            string fullPath = "../checker/" + fileToProcess.first;
-            FILE* file = fopen(fullPath.c_str(), "r");
-            if (!file) {
-                pthread_mutex_lock(args->printMutex);
-                cout << "Couldn't open file: " << fileToProcess.first << endl;
-                pthread_mutex_unlock(args->printMutex);
-                continue;
+    mapped.size = st.st_size;
+    mapped.data = nullptr;
+    // mmap does not accept empty mappings, an empty file simply has no words
+    if (mapped.size > 0) {
+        void* addr = mmap(NULL, mapped.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(addr, mapped.size, MADV_SEQUENTIAL);
+        mapped.data = (const char*)addr;
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    return true;
+}
+
+void unmapFile(MappedFile& mapped) {
+    if (mapped.data) munmap((void*)mapped.data, mapped.size);
+    mapped.data = nullptr;
+    mapped.size = 0;
+}
+
+// call onWord for every word of an already normalized buffer (words separated by ' ')
+template <typename F>
+void splitWords(const char* data, size_t len, F& onWord) {
+    const char* pos = data;
+    const char* end = data + len;
+    while (pos < end) {
+        if (*pos == ' ') {
+            pos++;
+            continue;
+        }
+
+        const char* wordEnd = (const char*)memchr(pos, ' ', end - pos);
+        if (!wordEnd) wordEnd = end;
+        onWord(string_view(pos, wordEnd - pos));
+        pos = wordEnd + 1;
+    }
+}
+
+// normalize the mapped file block by block and call onWord for every valid word;
+// the unfinished word at the end of a block is carried to the front of the buffer for the next one
+template <typename F>
+void forEachWord(const char* text, size_t size, vector<char>& buffer, NormalizeFunc normalize, F onWord,
+                 bool releasePages, ThreadStats* stats) {
+    const uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t released = ((uintptr_t)text + pageMask) & ~pageMask;
+
+    size_t carry = 0;
+    for (size_t offset = 0, blockSize; offset < size; offset += blockSize) {
+        blockSize = min((size_t)BLOCK_SIZE, size - offset);
+        // a block never ends inside a UTF-8 character (at most 3 continuation bytes to move back)
+        for (int k = 0; k < 3 && offset + blockSize < size && blockSize > 1 &&
+                        ((unsigned char)text[offset + blockSize] & 0xC0) == 0x80; k++) {
+            blockSize--;
+        }
+        if (buffer.size() < carry + NORMALIZE_OUTPUT_SIZE(blockSize)) {
+            buffer.resize(carry + NORMALIZE_OUTPUT_SIZE(blockSize));
+        }
+
+        char* data = buffer.data();
+        size_t len;
+        {
+            // the pages of the mapping are read from the disk here, when the kernel touches them
+            PhaseTimer timer(stats, PHASE_NORMALIZE);
+            len = carry + normalize(text + offset, blockSize, data + carry);
+        }
+
+        // everything before the last separator is made of complete words
+        const char* lastSpace = (const char*)memrchr(data, ' ', len);
+        size_t complete = lastSpace ? lastSpace - data : 0;
+        {
+            PhaseTimer timer(stats, PHASE_TOKENIZE);
+            splitWords(data, complete, onWord);
+        }
+
+        carry = len - complete;
+        memmove(data, data + complete, carry);
+
+        // the normalized pages are not read again: dropping them from the mapping keeps a
+        // big file from staying resident (the page cache still has them)
+        if (releasePages) {
+            uintptr_t done = (uintptr_t)(text + offset + blockSize) & ~pageMask;
+            if (done > released) {
+                madvise((void*)released, done - released, MADV_DONTNEED);
+                released = done;
             }
+        }
+    }
 
-            // partial list for the words in the current file
-            vector<pair<string, int>>& partialList = (*args->allPartialLists)[fileToProcess.second - 1];
-            // local set to avoid having duplicates in partialList
-            set<string> uniqueWords; 
-
-            char line[3000]; // 3000 because lines are very long in the files
-            while (fgets(line, sizeof(line), file)) {
-                string stringLine(line); // convert for safety
-
-                size_t pos = 0;
-                while ((pos = stringLine.find_first_of(" \n")) != string::npos) {
-                    string token = stringLine.substr(0, pos); // get the string from the beginning to the first withespace or '\n'
-                    stringLine.erase(0, pos + 1);             // remove the token from the line
-                    
-                    string modifiedWord = modifyString(token);
-                    // check if the word is still valid after modification and does not
-                    // already have an entry in the set
-                    if (!modifiedWord.empty() && uniqueWords.insert(modifiedWord).second) {
-                        partialList.emplace_back(modifiedWord, fileToProcess.second);
-                    }
-                }
+    PhaseTimer timer(stats, PHASE_TOKENIZE);
+    splitWords(buffer.data(), carry, onWord);
+}
 
-                if (!stringLine.empty()) {
-                    string modifiedWord = modifyString(stringLine);
-                    // same as above
-                    if (!modifiedWord.empty() && uniqueWords.insert(modifiedWord).second) {
-                        partialList.emplace_back(modifiedWord, fileToProcess.second);
-                    }
-                }
+static inline bool isSeparator(char c) {
+    return c == ' ' || c == '\n';
+}
+
+// move the ends of the task's byte range so it covers exactly the words that start inside it
+void alignToWords(const MappedFile& file, const MapTask& task, size_t& begin, size_t& end) {
+    begin = min(task.begin, file.size);
+    end = min(task.end, file.size);
+
+    // the word cut by the start of the range belongs to the previous chunk
+    if (begin > 0) {
+        while (begin < file.size && !isSeparator(file.data[begin - 1])) begin++;
+    }
+    // the word cut by the end of the range is finished here
+    while (end < file.size && end > 0 && !isSeparator(file.data[end - 1])) end++;
+    begin = min(begin, end);
+}
+
+// merge the lists of the chunks of a split file in its partial list, without duplicates
+void mergeChunkLists(FileScheduler& scheduler, int fileIdx, PartialList& partialList) {
+    for (size_t t = 0; t < scheduler.tasks.size(); t++) {
+        if (scheduler.tasks[t].file != fileIdx) continue;
+
+        auto& chunkList = scheduler.chunkLists[t];
+        for (size_t b = 0; b < chunkList.size(); b++) {
+            move(chunkList[b].begin(), chunkList[b].end(), back_inserter(partialList[b]));
+        }
+        PartialList().swap(chunkList);
+    }
+
+    // the chunks were processed by different mappers, so equal words may live in different arenas;
+    // keep one record per word with the occurrences of all the chunks
+    for (auto& bucket : partialList) {
+        sort(bucket.begin(), bucket.end(), [](const WordRef& a, const WordRef& b) { return a.view() < b.view(); });
+
+        size_t kept = 0;
+        for (size_t i = 0; i < bucket.size(); i++) {
+            if (kept > 0 && bucket[kept - 1].view() == bucket[i].view()) {
+                bucket[kept - 1].frequency += bucket[i].frequency;
+            } else {
+                bucket[kept++] = bucket[i];
             }
+        }
+        bucket.resize(kept);
+    }
+}
 
-            fclose(file);
+/*
+ * Streaming mode: merge the runs of all the mappers for one letter. The words come out in
+ * alphabetical order, so they go straight to the binary index; the text output is put in
+ * its own order by an EntrySorter, which spills to disk when it needs more than its share.
+ */
+void reduceLetterFromRuns(ThreadArgs* args, int letter, LetterWriter& outFile) {
+    size_t reducerBudget = max(args->memoryBudget / 2 / args->NrReducerThreads, (size_t)MIN_THREAD_BUDGET);
+    size_t runs = 0;
+    for (const auto& spill : *args->spills) runs += spill.runs.size();
+    size_t readBuffer = clamp(reducerBudget / 2 / max(runs, (size_t)1), (size_t)SPILL_READ_BUFFER_MIN,
+                              (size_t)SPILL_READ_BUFFER_MAX);
+
+    EntrySorter sorter(reducerBudget / 2, readBuffer);
+    bool ok = true;
+    PhaseTimer mergeTimer(args->stats, PHASE_MERGE_RUNS);
+    mergeRuns(*args->spills, letter, readBuffer, [&](string_view word, Postings& postings) {
+        countStat(args->stats, COUNT_WORDS);
+        countStat(args->stats, COUNT_RECORDS, postings.fileIDs.size());
+        if (args->writeText) ok = sorter.add(word, postings.fileIDs) && ok;
+        if (args->indexSections) {
+            if (args->fileIDOffset) {
+                for (int& fileID : postings.fileIDs) fileID += args->fileIDOffset;
+            }
+            appendTerm((*args->indexSections)[letter], word, postings);
+        }
+    });
+    if (args->writeText) {
+        PhaseTimer timer(args->stats, PHASE_WRITE);
+        ok = sorter.write(outFile) && ok;
+        countStat(args->stats, COUNT_BYTES_WRITTEN, outFile.bytesWritten());
+        if (!outFile.close()) {
+            lockMutex(args->printMutex, args->stats);
+            cout << "Error writing file: " << bucketFileName(letter) << endl;
+            pthread_mutex_unlock(args->printMutex);
         }
+    }
+    if (args->indexSections) {
+        const IndexSection& section = (*args->indexSections)[letter];
+        countStat(args->stats, COUNT_BYTES_WRITTEN, section.terms.size() + section.postings.size());
+    }
 
-        pthread_barrier_wait(args->barrier);
+    if (!ok) {
+        lockMutex(args->printMutex, args->stats);
+        cout << "Error writing spill file" << endl;
+        pthread_mutex_unlock(args->printMutex);
+    }
+}
 
-    } else {
-        pthread_barrier_wait(args->barrier);
+// open the output file of a letter (nothing to open when only the binary index is built)
+bool openLetterFile(ThreadArgs* args, int letter, LetterWriter& outFile) {
+    if (!args->writeText) return true;
 
-        size_t chunk, start, end;
+    string filename = string(args->outputDir) + "/" + bucketFileName(letter);
+    if (!outFile.open(filename)) {
+        lockMutex(args->printMutex, args->stats);
+        cout << "Error creating file: " << filename << endl;
+        pthread_mutex_unlock(args->printMutex);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Words of one letter gathered by a reducer from the files the mappers finished so far.
+ * The bucket of a letter in a file holds exactly the words starting with it, each once,
+ * and the words are read straight from the arenas of the mappers.
+ *
+ * The postings are not stored per word: every bucket is appended as one run of
+ * (word, frequency) records of its file, and finish() lays out the postings of all the
+ * words in one array, with the files of each word in order. There is no allocation per
+ * word, and files that arrived out of order only cost sorting the runs.
+ */
+struct LetterWords {
+    vector<string_view> words;
 
-        // each reducer will merge a number of partial lists in a local aggregated list
-        size_t allPartialListsize = args->allPartialLists->size();
-        chunk = (allPartialListsize + args->NrReducerThreads - 1) / args->NrReducerThreads;
-        start = (args->id - args->NrMapperThreads - 1) * chunk;
-        end = min(allPartialListsize, start + chunk);
+    // after finish(): the files of words[i] and the occurrences in each of them, at [start[i], start[i + 1])
+    vector<size_t> start;
+    vector<int> fileIDs;
+    vector<uint32_t> frequencies;
 
-        // merge the lists he is responsible for
-        unordered_map<string, unordered_set<int>> aggreagtedList;
-        for (size_t i = start; i < end; ++i) {
-            for (const auto& wordPair : (*args->allPartialLists)[i]) {
-                aggreagtedList[wordPair.first].insert(wordPair.second);
+    void add(const vector<WordRef>& bucket) {
+        if (bucket.empty()) return;
+        runs.push_back({bucket[0].fileID, records.size()});
+        for (const auto& wordRef : bucket) records.push_back({find(wordRef.view()), wordRef.frequency});
+    }
+
+    size_t nrFiles(size_t word) const {
+        return start[word + 1] - start[word];
+    }
+
+    void finish() {
+        // a counting sort by word of the records, taking the runs in file order
+        start.assign(words.size() + 1, 0);
+        for (const auto& record : records) start[record.word]++;
+        for (size_t i = 1; i <= words.size(); i++) start[i] += start[i - 1];
+
+        vector<uint32_t> order(runs.size());
+        for (size_t r = 0; r < runs.size(); r++) order[r] = r;
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return runs[a].fileID < runs[b].fileID; });
+
+        // filled from the end, so start[i] ends up at the first posting of word i
+        fileIDs.resize(records.size());
+        frequencies.resize(records.size());
+        for (size_t r = order.size(); r-- > 0;) {
+            const Run& run = runs[order[r]];
+            size_t end = order[r] + 1 < runs.size() ? runs[order[r] + 1].begin : records.size();
+            for (size_t k = end; k-- > run.begin;) {
+                size_t position = --start[records[k].word];
+                fileIDs[position] = run.fileID;
+                frequencies[position] = records[k].frequency;
             }
         }
 
-        // ensure the final merge (of all aggregated lists) does not start before each thread has completed its own aggregated list
-        pthread_barrier_wait(args->reducerBarrier);
+        vector<Record>().swap(records);
+        vector<Run>().swap(runs);
+        vector<uint32_t>().swap(slots);
+    }
+
+private:
+    struct Record {
+        uint32_t word;          // index in words
+        uint32_t frequency;
+    };
+    struct Run {
+        int fileID;
+        size_t begin;           // first record of the file
+    };
 
+    vector<Record> records;
+    vector<Run> runs;
+    vector<uint32_t> slots;     // open addressing over words: index + 1, 0 when empty
 
-        // merge all aggregated lists in shared finalAggregatedList
-        pthread_mutex_lock(args->finalAggreagtedListMutex);
-        for (auto& [word, fileIDs] : aggreagtedList) {
-            auto& globalFileIDs = (*args->finalAggreagtedList)[word];
-            globalFileIDs.insert(globalFileIDs.end(), fileIDs.begin(), fileIDs.end());
+    // index of the word, added if it is new; all the letters of a reducer are filled at the
+    // same time, so a flat table keeps them small compared to one node per word
+    uint32_t find(string_view word) {
+        if ((words.size() + 1) * 2 > slots.size()) grow();
+
+        size_t mask = slots.size() - 1;
+        size_t idx = hashWord(word) & mask;
+        while (slots[idx]) {
+            if (words[slots[idx] - 1] == word) return slots[idx] - 1;
+            idx = (idx + 1) & mask;
         }
-        pthread_mutex_unlock(args->finalAggreagtedListMutex);
 
+        words.push_back(word);
+        slots[idx] = words.size();
+        return words.size() - 1;
+    }
 
-        // wait for all reducers to add their aggregated list
-        pthread_barrier_wait(args->reducerBarrier);
+    void grow() {
+        vector<uint32_t>(max(slots.size() * 2, (size_t)64)).swap(slots);
+        size_t mask = slots.size() - 1;
+        for (size_t i = 0; i < words.size(); i++) {
+            size_t idx = hashWord(words[i]) & mask;
+            while (slots[idx]) idx = (idx + 1) & mask;
+            slots[idx] = i + 1;
+        }
+    }
+};
 
-        // Now, sort and remove duplicates for all accumulated file IDs for each word in the finalAggregatedList
-        if (args->id == args->NrMapperThreads + 1) {
-            for (auto& [word, fileIDs] : *args->finalAggreagtedList) {
-                // Sort the file IDs and remove duplicates
-                sort(fileIDs.begin(), fileIDs.end());
-                fileIDs.erase(unique(fileIDs.begin(), fileIDs.end()), fileIDs.end());
-            }
+// sort and write the words of a letter, and encode its section of the binary index
+void writeLetter(ThreadArgs* args, int letter, LetterWords& aggregated, LetterWriter& outFile) {
+    aggregated.finish();
+    const vector<string_view>& words = aggregated.words;
+    countStat(args->stats, COUNT_WORDS, words.size());
+
+    if (args->writeText) {
+        PhaseTimer sortTimer(args->stats, PHASE_SORT);
+
+        // Sort the words by the number of files they appear in descending order or alphabetically for ties
+        struct Entry {
+            string_view word;
+            size_t nrFiles;
+            const int* fileIDs;
+        };
+        vector<Entry> wordsWithCurrentLetter(words.size());
+        for (size_t i = 0; i < words.size(); i++) {
+            wordsWithCurrentLetter[i] = {words[i], aggregated.nrFiles(i), &aggregated.fileIDs[aggregated.start[i]]};
+        }
+        sort(wordsWithCurrentLetter.begin(), wordsWithCurrentLetter.end(),
+             [](const Entry& a, const Entry& b) {
+                 if (a.nrFiles != b.nrFiles) {
+                     return a.nrFiles > b.nrFiles;
+                 }
+                 return a.word < b.word;
+             });
+
+        PhaseTimer writeTimer(args->stats, PHASE_WRITE);
+        // format the sorted vector in one buffer, written to the file at once
+        size_t bytes = 0;
+        for (const auto& entry : wordsWithCurrentLetter) bytes += LetterWriter::maxEntrySize(entry.word.size(), entry.nrFiles);
+        outFile.reserve(bytes);
+        for (const auto& entry : wordsWithCurrentLetter) outFile.add(entry.word, entry.fileIDs, entry.nrFiles);
+
+        countStat(args->stats, COUNT_BYTES_WRITTEN, outFile.bytesWritten());
+        if (!outFile.close()) {
+            lockMutex(args->printMutex, args->stats);
+            cout << "Error writing file: " << bucketFileName(letter) << endl;
+            pthread_mutex_unlock(args->printMutex);
+        }
+    }
+
+    // the binary index keeps the words of the letter in alphabetical order
+    if (args->indexSections) {
+        PhaseTimer timer(args->stats, PHASE_ENCODE);
+        if (args->fileIDOffset) {
+            for (int& fileID : aggregated.fileIDs) fileID += args->fileIDOffset;
         }
 
-        // wait for the list to be sorted
-        pthread_barrier_wait(args->reducerBarrier);
+        vector<uint32_t> alphabetical(words.size());
+        for (size_t i = 0; i < words.size(); i++) alphabetical[i] = i;
+        sort(alphabetical.begin(), alphabetical.end(), [&](uint32_t a, uint32_t b) { return words[a] < words[b]; });
+
+        IndexSection& section = (*args->indexSections)[letter];
+        for (uint32_t i : alphabetical) {
+            size_t first = aggregated.start[i];
+            appendTerm(section, words[i], &aggregated.fileIDs[first], &aggregated.frequencies[first], aggregated.nrFiles(i));
+        }
+        countStat(args->stats, COUNT_BYTES_WRITTEN, section.terms.size() + section.postings.size());
+    }
+}
+
+void* threadFunc(void* arg) {
+    ThreadArgs* args = (ThreadArgs*)arg;
+    ThreadStats* stats = args->stats;
+    if (stats) stats->begin();
+
+    if (args->id <= args->NrMapperThreads) {
+        // buffer for the normalized blocks of the current file, reused for all the files
+        vector<char> normalized;
 
-        // each reducer thread is responsible for a set of letters
-        size_t totalLetters = 26;
-        chunk = (totalLetters + args->NrReducerThreads - 1) / args->NrReducerThreads;
-        start = (args->id - args->NrMapperThreads - 1) * chunk;
-        end = min(totalLetters, start + chunk);
+        int taskIdx;
+        int mapperIdx = args->id - 1;
+        FileScheduler& scheduler = *args->scheduler;
+        WordInterner& interner = (*args->interners)[mapperIdx];
 
-        for (size_t i = start; i < end; i++) {
-            char letter = 'a' + i;
-            string filename = string(1, letter) + ".txt";
+        // records added to the bucket of each letter, used by the reducers to balance their work
+        size_t letterRecords[NR_UTF8_BUCKETS] = {0};
 
-            ofstream outFile(filename);
-            if (!outFile) {
-                pthread_mutex_lock(args->printMutex);
-                cout << "Error creating file: " << filename << endl;
+        // streaming mode: the records of all the tasks go to one run, written out when it gets too big
+        bool streaming = args->memoryBudget > 0;
+        size_t mapperBudget = max(args->memoryBudget / 2 / args->NrMapperThreads, (size_t)MIN_THREAD_BUDGET);
+        size_t reducerBudget = max(args->memoryBudget / 2 / args->NrReducerThreads, (size_t)MIN_THREAD_BUDGET);
+        // every reducer reads all the runs at once, with a buffer of at least SPILL_READ_BUFFER_MIN each
+        size_t maxRuns = reducerBudget / 2 / SPILL_READ_BUFFER_MIN / args->NrMapperThreads;
+        MapperSpill& spill = (*args->spills)[mapperIdx];
+        PartialList run(args->nrBuckets);
+        auto spillRun = [&]() {
+            // the buckets and the interner are empty again before the runs are merged
+            PhaseTimer timer(stats, PHASE_SPILL);
+            countStat(stats, COUNT_RUNS);
+            bool ok = spillBuckets(spill, run);
+            PartialList(args->nrBuckets).swap(run);
+            interner.clear();
+            if (!ok || !mergeFullLevels(spill, mapperBudget)) {
+                lockMutex(args->printMutex, args->stats);
+                cout << "Error writing spill file" << endl;
                 pthread_mutex_unlock(args->printMutex);
-                continue;
             }
+        };
+        auto runMemory = [&]() {
+            size_t bytes = interner.memoryUsage();
+            for (const auto& bucket : run) bytes += bucket.capacity() * sizeof(WordRef);
+            return bytes;
+        };
 
-            // iterate through the finalAggregatedList and group
-            // the words starting with the current letter
-            vector<pair<string, vector<int>>> wordsWithCurrentLetter;
-            for (const auto& [word, fileIDs] : *args->finalAggreagtedList) {
-                if (!word.empty() && word[0] == letter) {
-                    wordsWithCurrentLetter.emplace_back(word, fileIDs);
-                }
+        /* take tasks from the own deque, or steal from the other mappers when it is empty */
+        bool stolen;
+        while (scheduler.nextTask(mapperIdx, taskIdx, stolen)) {
+            const MapTask& task = scheduler.tasks[taskIdx];
+            const InputFile& fileToProcess = scheduler.files[task.file];
+            bool split = fileToProcess.numChunks > 1;
+            countStat(stats, COUNT_TASKS);
+            countStat(stats, COUNT_STOLEN_TASKS, stolen);
+
+            /* Process the file */
+            MappedFile file;
+            bool mapped;
+            {
+                PhaseTimer timer(stats, PHASE_MAP_FILE);
+                mapped = mapFile(fileToProcess.fullPath, file);
             }
+            if (!mapped) {
+                lockMutex(args->printMutex, args->stats);
+                cout << "Couldn't open file: " << fileToProcess.name << endl;
+                pthread_mutex_unlock(args->printMutex);
+            } else {
+                // partial list for the words in the current file, or in the current chunk of a split file
+                PartialList& partialList = streaming ? run
+                                           : split ? scheduler.chunkLists[taskIdx]
+                                                   : (*args->allPartialLists)[fileToProcess.fileID - 1];
+                partialList.resize(args->nrBuckets);
+
+                size_t begin, end;
+                alignToWords(file, task, begin, end);
+                uint64_t words = 0, records = 0;
+                forEachWord(file.data + begin, end - begin, normalized, args->normalize, [&](string_view word) {
+                    // the interner keeps a single copy of each word and tells if it was already seen in this task
+                    const char* stored;
+                    bool firstInTask;
+                    uint32_t& record = interner.addForTask(word, taskIdx, stored, firstInTask);
 
-            // Sort the words by the number of files they appear in descending order or alphabetically for ties
-            sort(wordsWithCurrentLetter.begin(), wordsWithCurrentLetter.end(),
-                 [](const auto& a, const auto& b) {
-                     if (a.second.size() != b.second.size()) {
-                         return a.second.size() > b.second.size();
-                     }
-                     return a.first < b.first;
-                 });
-
-            // write the sorted vector in the file
-            for (const auto& [word, IDs] : wordsWithCurrentLetter) {
-                outFile << word << ":["; 
-                for (size_t j = 0; j < IDs.size(); j++) {
-                    outFile << IDs[j];
-                    if (j != IDs.size() - 1) {
-                        outFile << " ";
+                    // shuffle: every word goes straight to the bucket of its first letter
+                    int letter = bucketOf(word);
+                    vector<WordRef>& bucket = partialList[letter];
+                    if (firstInTask) {
+                        record = bucket.size();
+                        bucket.push_back({stored, (uint32_t)word.size(), fileToProcess.fileID, 1});
+                        letterRecords[letter]++;
+                        records++;
+                    } else {
+                        bucket[record].frequency++;
                     }
+                    words++;
+
+                    // a run may end in the middle of a task: the reducers add up the records of the same file
+                    if (streaming && words % SPILL_CHECK_WORDS == 0 && runMemory() > mapperBudget) spillRun();
+                }, streaming, stats);
+                scheduler.taskWords[taskIdx] = words;
+                countStat(stats, COUNT_RECORDS, records);
+                countStat(stats, COUNT_BYTES_READ, end - begin);
+                countStat(stats, COUNT_WORDS, words);
+
+                PhaseTimer timer(stats, PHASE_MAP_FILE);
+                unmapFile(file);
+            }
+
+            // the last chunk to finish puts the whole file together in its own slot and hands it to the reducers
+            if (scheduler.finishChunk(task.file) && !streaming) {
+                if (split) {
+                    PhaseTimer timer(stats, PHASE_MERGE_CHUNKS);
+                    mergeChunkLists(scheduler, task.file, (*args->allPartialLists)[fileToProcess.fileID - 1]);
+                }
+                PhaseTimer timer(stats, PHASE_PUBLISH);
+                args->completed->publish(task.file);
+            }
+        }
+
+        if (streaming) {
+            bool empty = true;
+            for (const auto& bucket : run) empty = empty && bucket.empty();
+            if (!empty) spillRun();
+            bool limited;
+            {
+                PhaseTimer timer(stats, PHASE_SPILL);
+                limited = limitRuns(spill, maxRuns, mapperBudget);
+            }
+            if (!limited) {
+                lockMutex(args->printMutex, args->stats);
+                cout << "Error writing spill file" << endl;
+                pthread_mutex_unlock(args->printMutex);
+            }
+
+            // published to the reducers by the barrier
+            copy(letterRecords, letterRecords + args->nrBuckets, args->letterRecords->begin() + mapperIdx * args->nrBuckets);
+            PhaseTimer timer(stats, PHASE_BARRIER_WAIT);
+            pthread_barrier_wait(args->barrier);
+        }
+
+    } else if (args->memoryBudget > 0) {
+        // streaming mode: the runs are only complete once every mapper is done
+        {
+            PhaseTimer timer(stats, PHASE_BARRIER_WAIT);
+            pthread_barrier_wait(args->barrier);
+        }
+
+        int reducerIdx = args->id - args->NrMapperThreads - 1;
+
+        // records of each letter over all the mappers, to split the letters evenly between reducers
+        vector<size_t> records(args->nrBuckets, 0);
+        for (int m = 0; m < args->NrMapperThreads; m++) {
+            for (int i = 0; i < args->nrBuckets; i++) {
+                records[i] += (*args->letterRecords)[m * args->nrBuckets + i];
+            }
+        }
+        vector<int> owner = assignLetters(records, args->NrReducerThreads);
+
+        for (int i = 0; i < args->nrBuckets; i++) {
+            if (owner[i] != reducerIdx) continue;
+            // the files of the letters always exist, the other buckets only when they have words
+            if (i >= NR_LETTERS && records[i] == 0) continue;
+
+            // the entries come out of the sorter in order, so the file is written in small parts
+            LetterWriter outFile(SPILL_WRITE_BUFFER);
+            if (openLetterFile(args, i, outFile)) reduceLetterFromRuns(args, i, outFile);
+        }
+
+    } else {
+        int reducerIdx = args->id - args->NrMapperThreads - 1;
+
+        vector<int> letters;
+        for (int i = 0; i < args->nrBuckets; i++) {
+            if ((*args->letterOwner)[i] == reducerIdx) letters.push_back(i);
+        }
+        vector<LetterWords> aggregated(args->nrBuckets);
+
+        // with a core of its own a reducer aggregates every file as soon as a mapper finishes it;
+        // the bucket is not needed afterwards (no other reducer reads it), so its memory is given
+        // back right away. Otherwise it would only slow the mappers down, so it waits for all of
+        // them and then does one letter at a time, in file order, which keeps the postings sorted
+        size_t NrOfFiles = args->scheduler->files.size();
+        for (size_t received = 0; received < NrOfFiles; received++) {
+            int fileIdx;
+            {
+                PhaseTimer timer(stats, PHASE_LOG_WAIT);
+                fileIdx = args->completed->wait(reducerIdx, received);
+            }
+            countStat(stats, COUNT_FILES);
+            if (!args->overlap) continue;
+
+            PhaseTimer timer(stats, PHASE_AGGREGATE);
+            PartialList& partialList = (*args->allPartialLists)[args->scheduler->files[fileIdx].fileID - 1];
+            for (int i : letters) {
+                countStat(stats, COUNT_RECORDS, partialList[i].size());
+                aggregated[i].add(partialList[i]);
+                vector<WordRef>().swap(partialList[i]);
+            }
+        }
+
+        for (int i : letters) {
+            if (!args->overlap) {
+                PhaseTimer timer(stats, PHASE_AGGREGATE);
+                for (auto& partialList : *args->allPartialLists) {
+                    countStat(stats, COUNT_RECORDS, partialList[i].size());
+                    aggregated[i].add(partialList[i]);
+                    vector<WordRef>().swap(partialList[i]);
                 }
-                outFile << "]" << endl;
             }
 
-            outFile.close();
+            if (i >= NR_LETTERS && aggregated[i].words.empty()) continue;
+
+            LetterWriter outFile;
+            if (openLetterFile(args, i, outFile)) writeLetter(args, i, aggregated[i], outFile);
+            aggregated[i] = LetterWords();
         }
     }
 
+    if (stats) stats->end();
     return NULL;
 }
 
-int main(int argc, char** argv) {
-    if (argc != 4) {
-        cout << "Usage: " << argv[0] << " <nr_mapper_threads> <nr_reducer_threads> <input_file>" << endl;
-        return 1;
-    }
+struct CompactionArgs {
+    string dir;
+    Manifest manifest;
+    bool ok;
+};
 
-    int NrMapperThreads = atoi(argv[1]);
-    int NrReducerThreads = atoi(argv[2]);
-    const char* inputFile = argv[3];
+void* compactionFunc(void* arg) {
+    CompactionArgs* args = (CompactionArgs*)arg;
+    args->ok = compactSegments(args->dir, args->manifest);
+    return NULL;
+}
 
+// read the number of files and their names; false (after printing why) if the list is not valid
+bool readInputList(const char* inputFile, vector<string>& names) {
     FILE* file = fopen(inputFile, "r");
     if (!file) {
         cout << "Could not open input file: " << inputFile << endl;
-        return 1;
+        return false;
     }
 
     int NrOfFiles;
     if (fscanf(file, "%d", &NrOfFiles) != 1 || NrOfFiles <= 0) {
         cout << "Invalid format for input file" << endl;
         fclose(file);
-        return 1;
+        return false;
     }
 
-    // Create the queue with files to process
-    queue<pair<string, int>> filesQueue;
     for (int i = 0; i < NrOfFiles; i++) {
         char fileName[256];
         if (fscanf(file, "%s", fileName) != 1) {
             cout << "Error reading file name" << endl;
             fclose(file);
-            return 1;
+            return false;
         }
-        // emplace is more efficient than push
-        filesQueue.emplace(fileName, i + 1);
+        names.push_back(fileName);
     }
     fclose(file);
+    return true;
+}
 
+int runIndexer(int argc, char** argv) {
+#ifdef USE_MPI
+    int mpiRank, nrRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpiRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nrRanks);
+#endif
 
-    // lists for mapper threads -> vector storing a list of words for each file
-    vector<vector<pair<string, int>>> allPartialLists(NrOfFiles);
+    if (argc < 4) {
+        cout << "Usage: " << argv[0] << " <nr_mapper_threads> <nr_reducer_threads> <input_file>"
+             << " [--binary-index <index_file> | --incremental <index_dir>] [--memory-budget <MiB>]"
+             << " [--stats <json_file>] [--input-root <dir>] [--output-dir <dir>] [--utf8]" << endl;
+        return 1;
+    }
 
-    // map with all the unique words from all files
-    map<string, vector<int>> allUniqueWords;
+    int NrMapperThreads = atoi(argv[1]);
+    int NrReducerThreads = atoi(argv[2]);
+    const char* inputFile = argv[3];
 
+    // optional arguments
+    string binaryIndexPath, incrementalDir, statsPath;
+    string inputRoot = "../checker", outputDir = ".";
+    bool utf8 = false;
+    size_t memoryBudget = 0;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--binary-index") == 0 && i + 1 < argc) {
+            binaryIndexPath = argv[++i];
+        } else if (strcmp(argv[i], "--incremental") == 0 && i + 1 < argc) {
+            incrementalDir = argv[++i];
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            memoryBudget = (size_t)max(1, atoi(argv[++i])) << 20;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            statsPath = argv[++i];
+        } else if (strcmp(argv[i], "--input-root") == 0 && i + 1 < argc) {
+            inputRoot = argv[++i];
+        } else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            outputDir = argv[++i];
+        } else if (strcmp(argv[i], "--utf8") == 0) {
+            utf8 = true;
+        } else {
+            cout << "Unknown argument: " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (!binaryIndexPath.empty() && !incrementalDir.empty()) {
+        cout << "--binary-index and --incremental can not be used together" << endl;
+        return 1;
+    }
+    bool incremental = !incrementalDir.empty();
+#ifdef USE_MPI
+    if (incremental || memoryBudget > 0) {
+        cout << "--incremental and --memory-budget are not supported by the MPI build" << endl;
+        return 1;
+    }
+#endif
+
+    // UTF-8 mode: words of any script, with one more bucket per first byte of a multibyte character
+    NormalizeFunc normalize = utf8 ? utf8Normalize() : asciiNormalize();
+    int nrBuckets = utf8 ? NR_UTF8_BUCKETS : NR_LETTERS;
+    uint32_t indexFlags = utf8 ? INDEX_FLAG_UTF8 : 0;
+
+    // one entry per thread, the main thread first; every thread only writes its own
     int TotalThreads = NrMapperThreads + NrReducerThreads;
+    vector<ThreadStats> threadStats(statsPath.empty() ? 0 : TotalThreads + 1);
+    ThreadStats* mainStats = threadStats.empty() ? NULL : &threadStats[0];
+    if (mainStats) {
+        mainStats->role = "main";
+        mainStats->begin();
+    }
+    PhaseTimer scheduleTimer(mainStats, PHASE_SCHEDULE);
+
+    // the big buffers of a run are freed after every spill: with a fixed threshold they are
+    // always mapped on their own, so the memory goes back to the system instead of the heap
+    if (memoryBudget > 0) mallopt(M_MMAP_THRESHOLD, SPILL_WRITE_BUFFER);
+
+    // Read the list of files to process
+    vector<string> names, paths;
+#ifdef USE_MPI
+    // rank 0 reads it for all the ranks
+    if (!broadcastNames(names, mpiRank == 0 && readInputList(inputFile, names))) return 1;
+#else
+    if (!readInputList(inputFile, names)) return 1;
+#endif
+    int NrOfFiles = names.size();
+    for (const auto& name : names) paths.push_back(inputRoot + "/" + name);
+
+    // a missing output directory is created; any other problem shows when the files are opened
+    mkdir(outputDir.c_str(), 0755);
+
+    // in incremental mode only the new and changed files go through map-reduce
+    vector<size_t> toIndex;
+    Manifest manifest;
+    if (incremental) {
+        mkdir(incrementalDir.c_str(), 0755);
+        if (!manifest.load(incrementalDir)) {
+            cout << "Invalid manifest in: " << incrementalDir << endl;
+            return 1;
+        }
+        // the segments of an index must all be normalized the same way
+        if (!manifest.docs.empty() && manifest.flags != indexFlags) {
+            cout << "The index in " << incrementalDir << " was built " << (utf8 ? "without" : "with")
+                 << " --utf8, rebuild it in a new directory" << endl;
+            return 1;
+        }
+        manifest.flags = indexFlags;
+        updateDocuments(manifest, names, paths, toIndex);
+        NrOfFiles = toIndex.size();
+    } else {
+        for (int i = 0; i < NrOfFiles; i++) toIndex.push_back(i);
+    }
+
+#ifdef USE_MPI
+    // every rank maps its share of the files, which keep their IDs in the whole list
+    vector<int> fileRank = assignFilesToRanks(paths);
+#endif
+
+    FileScheduler scheduler;
+    for (int i = 0; i < NrOfFiles; i++) {
+#ifdef USE_MPI
+        if (fileRank[i] != mpiRank) continue;
+#endif
+        scheduler.files.push_back({names[toIndex[i]], paths[toIndex[i]], i + 1, 0, 1});
+    }
+
+    // split the work between the mappers by size, biggest files first
+    buildSchedule(scheduler, NrMapperThreads);
+
+    // lists for mapper threads -> vector storing a list of words for each file (not used when streaming)
+    vector<PartialList> allPartialLists(memoryBudget ? 0 : NrOfFiles, PartialList(nrBuckets));
+
+    // streaming mode: the runs each mapper wrote to its spill file
+    vector<MapperSpill> spills(NrMapperThreads);
+
+    // per mapper record counters of every letter
+    vector<size_t> letterRecords(NrMapperThreads * nrBuckets, 0);
+
+    // sections of the binary index, encoded by the reducers in parallel
+    bool buildIndex = !binaryIndexPath.empty() || incremental;
+    vector<IndexSection> indexSections(buildIndex ? nrBuckets : 0);
+
+    // the segment stores the stable IDs of the documents, which are consecutive for the new ones
+    int firstDocID = incremental && NrOfFiles > 0 ? manifest.docs[toIndex[0]].docID : 1;
+
+    // the reducers own their letters from the start, so they can aggregate every file as soon as it is mapped
+    vector<int> letterOwner;
+    {
+        PhaseTimer timer(mainStats, PHASE_SAMPLE);
+        letterOwner = assignLetters(sampleLetterRecords(scheduler.files, nrBuckets, normalize), NrReducerThreads);
+    }
+    CompletionLog completed(NrOfFiles, NrReducerThreads);
+
+    // word arenas of the mappers, alive until every reducer has finished
+    vector<WordInterner> interners(NrMapperThreads);
+
+    bool overlap = sysconf(_SC_NPROCESSORS_ONLN) >= TotalThreads;
+#ifdef USE_MPI
+    // the reducers only start once the buckets of all the ranks arrived
+    overlap = false;
+#endif
     pthread_t threads[TotalThreads];
     ThreadArgs arguments[TotalThreads];
 
     // synchronization primitives
     pthread_barrier_t barrier;
-    pthread_barrier_t reducerBarrier;
 
-    pthread_mutex_t queueMutex;
     pthread_mutex_t printMutex;
-    pthread_mutex_t mapMutex; // mutex for finalAggregatedList map
 
     pthread_barrier_init(&barrier, NULL, TotalThreads);
-    pthread_barrier_init(&reducerBarrier, NULL, NrReducerThreads);
-    pthread_mutex_init(&queueMutex, NULL);
     pthread_mutex_init(&printMutex, NULL);
-    pthread_mutex_init(&mapMutex, NULL);
 
     for (int id = 0; id < TotalThreads; id++) {
-        arguments[id] = {id + 1, NrMapperThreads, NrReducerThreads, &filesQueue, &allPartialLists, &allUniqueWords,
-                         &queueMutex, &printMutex, &mapMutex, &barrier, &reducerBarrier};
+        ThreadStats* stats = NULL;
+        if (mainStats) {
+            stats = &threadStats[id + 1];
+            stats->role = id < NrMapperThreads ? "mapper" : "reducer";
+            stats->index = id < NrMapperThreads ? id : id - NrMapperThreads;
+        }
+        arguments[id] = {id + 1, NrMapperThreads, NrReducerThreads, &scheduler, &interners, &allPartialLists,
+                         &letterRecords, &letterOwner, &completed, overlap, buildIndex ? &indexSections : NULL, !incremental, firstDocID - 1,
+                         memoryBudget, &spills, stats, outputDir.c_str(), normalize, nrBuckets, &printMutex, &barrier};
+#ifndef USE_MPI
+        pthread_create(&threads[id], NULL, threadFunc, &arguments[id]);
+#endif
+    }
+
+#ifdef USE_MPI
+    // map the files of this rank, send every bucket to the rank that reduces it, then reduce
+    vector<int> bucketRank;
+    vector<char> receivedWords;
+    {
+        PhaseTimer joinTimer(mainStats, PHASE_JOIN);
+        for (int id = 0; id < NrMapperThreads; id++) pthread_create(&threads[id], NULL, threadFunc, &arguments[id]);
+        for (int id = 0; id < NrMapperThreads; id++) pthread_join(threads[id], NULL);
 
+        PhaseTimer exchangeTimer(mainStats, PHASE_EXCHANGE);
+        vector<size_t> records = globalBucketRecords(allPartialLists, nrBuckets);
+        bucketRank = assignLetters(records, nrRanks);
+        if (!exchangeBuckets(allPartialLists, bucketRank, receivedWords)) {
+            if (mpiRank == 0) cout << "A rank has more than 2 GiB of records to exchange, use more ranks" << endl;
+            return 1;
+        }
+        vector<WordInterner>().swap(interners);
+
+        // the letters of this rank are split between its reducers, the others belong to no one here
+        vector<int> owned;
+        vector<size_t> ownedRecords;
+        for (int i = 0; i < nrBuckets; i++) {
+            if (bucketRank[i] != mpiRank) continue;
+            owned.push_back(i);
+            ownedRecords.push_back(records[i]);
+        }
+        vector<int> reducerOfOwned = assignLetters(ownedRecords, NrReducerThreads);
+        letterOwner.assign(nrBuckets, -1);
+        for (size_t k = 0; k < owned.size(); k++) letterOwner[owned[k]] = reducerOfOwned[k];
+    }
+    for (int id = NrMapperThreads; id < TotalThreads; id++) {
         pthread_create(&threads[id], NULL, threadFunc, &arguments[id]);
     }
+#endif
 
+    PhaseTimer joinTimer(mainStats, PHASE_JOIN);
     for (int id = 0; id < TotalThreads; id++) {
+#ifdef USE_MPI
+        if (id < NrMapperThreads) continue;
+#endif
         pthread_join(threads[id], NULL);
     }
+    for (const auto& spill : spills) {
+        if (spill.fd >= 0) close(spill.fd);
+    }
+
+    // number of words of every file, summed over its chunks
+    vector<uint32_t> docLengths(NrOfFiles, 0);
+    for (size_t t = 0; t < scheduler.tasks.size(); t++) {
+        docLengths[scheduler.files[scheduler.tasks[t].file].fileID - 1] += scheduler.taskWords[t];
+    }
+#ifdef USE_MPI
+    // rank 0 writes the binary index, with the sections and the lengths of every rank
+    if (!binaryIndexPath.empty()) {
+        PhaseTimer timer(mainStats, PHASE_EXCHANGE);
+        MPI_Allreduce(MPI_IN_PLACE, docLengths.data(), NrOfFiles, MPI_UINT32_T, MPI_SUM, MPI_COMM_WORLD);
+        if (!gatherSections(indexSections, bucketRank)) {
+            if (mpiRank == 0) cout << "A rank has more than 2 GiB of binary index, use more ranks" << endl;
+            binaryIndexPath.clear();
+        } else if (mpiRank != 0) {
+            binaryIndexPath.clear();
+        }
+    }
+#endif
+
+    PhaseTimer indexTimer(mainStats, PHASE_INDEX);
+
+    // the letters are sections of the index in alphabetical order
+    if (!binaryIndexPath.empty()) {
+        if (!writeIndex(binaryIndexPath, indexSections, docLengths, 1, indexFlags)) {
+            cout << "Error writing binary index: " << binaryIndexPath << endl;
+        }
+    }
+
+    if (incremental) {
+        // the new documents become a segment of their own, then the manifest points to it
+        if (NrOfFiles > 0) {
+            int segment = manifest.nextSegment++;
+            string path = segmentPath(incrementalDir, segment);
+            if (!writeIndex(path + ".tmp", indexSections, docLengths, firstDocID, indexFlags) ||
+                rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+                cout << "Error writing segment: " << path << endl;
+                return 1;
+            }
+            manifest.segments.push_back(segment);
+            for (size_t i : toIndex) manifest.docs[i].segment = segment;
+        }
+        if (!manifest.save(incrementalDir)) {
+            cout << "Error writing manifest in: " << incrementalDir << endl;
+            return 1;
+        }
+
+        // the segments are mapped before the compaction starts, so it can remove them while the
+        // text output is merged from them
+        SegmentedIndex index;
+        bool opened = index.open(incrementalDir, manifest);
+
+        CompactionArgs compaction = {incrementalDir, manifest, false};
+        pthread_t compactionThread;
+        pthread_create(&compactionThread, NULL, compactionFunc, &compaction);
+
+        if (!opened) {
+            cout << "Could not open the segments in: " << incrementalDir << endl;
+        } else {
+            PhaseTimer timer(mainStats, PHASE_WRITE);
+            dumpText(index, outputDir);
+            if (index.corrupt()) {
+                cout << "Damaged segments in: " << incrementalDir << endl;
+            }
+        }
+
+        PhaseTimer timer(mainStats, PHASE_JOIN);
+        pthread_join(compactionThread, NULL);
+        if (!compaction.ok) {
+            cout << "Compaction failed in: " << incrementalDir << endl;
+        }
+    }
 
     pthread_barrier_destroy(&barrier);
-    pthread_barrier_destroy(&reducerBarrier);
-    pthread_mutex_destroy(&queueMutex);
     pthread_mutex_destroy(&printMutex);
-    pthread_mutex_destroy(&mapMutex);
+
+    if (mainStats) {
+        mainStats->end();
+#ifdef USE_MPI
+        // one report per rank: the path itself for rank 0, then <path>.1, <path>.2, ...
+        if (mpiRank > 0) statsPath += "." + to_string(mpiRank);
+#endif
+        ofstream statsFile(statsPath);
+        writeStats(statsFile, threadStats, NrMapperThreads, NrReducerThreads, NrOfFiles, overlap, memoryBudget > 0);
+        if (!statsFile) {
+            cout << "Error writing stats: " << statsPath << endl;
+        }
+    }
 
     return 0;
 }
+
+int main(int argc, char** argv) {
+#ifdef USE_MPI
+    // only the main thread of every rank calls MPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int status = runIndexer(argc, argv);
+    MPI_Finalize();
+    return status;
+#else
+    return runIndexer(argc, argv);
+#endif
+}
@@ -0,0 +1,169 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NORMALIZE_X86
+#endif
+
+/*
+ * Normalization kernel used by the mappers on whole blocks of a file:
+ *  - ASCII letters are kept and lowercased
+ *  - ' ' and '\n' (the word separators) are kept as ' '
+ *  - every other byte is dropped
+ * Splitting the output on ' ' gives exactly the words the old per token
+ * modifyString produced (tolower + remove_if(!isalpha) in the C locale).
+ *
+ * The destination must have room for NORMALIZE_OUTPUT_SIZE(n) bytes: the vector
+ * versions store whole registers past the last written byte, and the UTF-8
+ * kernel (normalize_utf8.h) can grow the text when case folding.
+ */
+#define NORMALIZE_PADDING 32
+#define NORMALIZE_OUTPUT_SIZE(n) ((n) + (n) / 2 + NORMALIZE_PADDING)
+
+typedef size_t (*NormalizeFunc)(const char* src, size_t n, char* dst);
+
+static inline size_t normalizeScalar(const char* src, size_t n, char* dst) {
+    char* out = dst;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = src[i];
+        unsigned char lower = c | 0x20;
+        bool letter = (unsigned char)(lower - 'a') < 26;
+        bool separator = c == ' ' || c == '\n';
+
+        // branchless: always write, only advance for the bytes we keep
+        *out = letter ? lower : ' ';
+        out += letter | separator;
+    }
+    return out - dst;
+}
+
+#ifdef NORMALIZE_X86
+
+// compaction table: for every 8 bit mask, the shuffle that moves the selected bytes to the front
+struct CompactTable {
+    uint64_t shuffle[256];
+    uint8_t count[256];
+
+    constexpr CompactTable() : shuffle(), count() {
+        for (int mask = 0; mask < 256; mask++) {
+            uint64_t s = 0;
+            int k = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (mask & (1 << bit)) {
+                    s |= (uint64_t)bit << (8 * k);
+                    k++;
+                }
+            }
+            // unused lanes are zeroed by pshufb (high bit set)
+            for (int j = k; j < 8; j++) s |= (uint64_t)0x80 << (8 * j);
+            shuffle[mask] = s;
+            count[mask] = k;
+        }
+    }
+};
+
+static constexpr CompactTable compactTable;
+
+// store the bytes of v selected by the 16 bit mask contiguously at out
+__attribute__((target("sse4.2")))
+static inline char* compact16(__m128i v, unsigned mask, char* out) {
+    if (mask == 0xFFFF) {
+        _mm_storeu_si128((__m128i*)out, v);
+        return out + 16;
+    }
+
+    unsigned lo = mask & 0xFF;
+    unsigned hi = mask >> 8;
+
+    __m128i shufLo = _mm_cvtsi64_si128(compactTable.shuffle[lo]);
+    _mm_storel_epi64((__m128i*)out, _mm_shuffle_epi8(v, shufLo));
+    out += compactTable.count[lo];
+
+    __m128i shufHi = _mm_cvtsi64_si128(compactTable.shuffle[hi]);
+    _mm_storel_epi64((__m128i*)out, _mm_shuffle_epi8(_mm_srli_si128(v, 8), shufHi));
+    return out + compactTable.count[hi];
+}
+
+__attribute__((target("sse4.2")))
+static size_t normalizeSSE42(const char* src, size_t n, char* dst) {
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - 'a')); // moves 'a'..'z' to the lowest signed bytes
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    char* out = dst;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lower = _mm_or_si128(v, caseBit);
+        __m128i letter = _mm_cmplt_epi8(_mm_add_epi8(lower, shift), limit);
+        __m128i separator = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline));
+
+        __m128i result = _mm_blendv_epi8(space, lower, letter);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(letter, separator));
+        out = compact16(result, mask, out);
+    }
+
+    return (out - dst) + normalizeScalar(src + i, n - i, out);
+}
+
+__attribute__((target("avx2")))
+static size_t normalizeAVX2(const char* src, size_t n, char* dst) {
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i shift = _mm256_set1_epi8((char)(0x80 - 'a'));
+    const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    char* out = dst;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i lower = _mm256_or_si256(v, caseBit);
+        // signed compare, limit > x <=> x < limit
+        __m256i letter = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(lower, shift));
+        __m256i separator = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, newline));
+
+        __m256i result = _mm256_blendv_epi8(space, lower, letter);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(letter, separator));
+
+        if (mask == 0xFFFFFFFFu) {
+            _mm256_storeu_si256((__m256i*)out, result);
+            out += 32;
+        } else {
+            out = compact16(_mm256_castsi256_si128(result), mask & 0xFFFF, out);
+            out = compact16(_mm256_extracti128_si256(result, 1), mask >> 16, out);
+        }
+    }
+
+    return (out - dst) + normalizeScalar(src + i, n - i, out);
+}
+
+#endif
+
+// pick the widest kernel the cpu supports, once
+static inline NormalizeFunc selectNormalize() {
+#ifdef NORMALIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return normalizeAVX2;
+    if (__builtin_cpu_supports("sse4.2")) return normalizeSSE42;
+#endif
+    return normalizeScalar;
+}
+
+static inline NormalizeFunc asciiNormalize() {
+    static const NormalizeFunc normalize = selectNormalize();
+    return normalize;
+}
+
+static inline size_t normalizeBuffer(const char* src, size_t n, char* dst) {
+    return asciiNormalize()(src, n, dst);
+}
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef NORMALIZE_UTF8_H
+#define NORMALIZE_UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "normalize.h"
+#include "unicode_tables.h"
+
+/*
+ * Normalization kernel of the UTF-8 mode, same contract as the ASCII ones:
+ *  - the text is decoded and validated: a byte that does not start a valid sequence
+ *    (overlong form, surrogate, code point past U+10FFFF, cut sequence) is dropped
+ *  - letters and combining marks of any script are kept, with simple case folding
+ *  - ' ', '\n' and the Unicode space separators are kept as ' '
+ *  - everything else is dropped
+ * The classes and foldings come from the generated tables (unicode_tables.h), so no
+ * locale is involved. ASCII bytes follow the ASCII rules exactly.
+ *
+ * Like the ASCII kernels there is a scalar, an SSE4.2 and an AVX2 version, picked at
+ * runtime (utf8Normalize). The vector versions classify the text in blocks: a block of
+ * ASCII is normalized as in the ASCII mode, a block of ASCII and 2 byte characters
+ * (Latin, Greek, Cyrillic, ...) is written from the short table without decoding, and
+ * only the other blocks are decoded one character at a time.
+ *
+ * Folding can make a character longer (U+023A is 2 bytes, its folding 3), hence
+ * NORMALIZE_OUTPUT_SIZE for the destination.
+ */
+
+// length of a sequence from its first byte (0 if it can not start one) and the valid
+// range of its second byte, which rejects overlong forms, surrogates and values past U+10FFFF
+struct Utf8LeadTable {
+    uint8_t length[256];
+    uint8_t secondMin[256];
+    uint8_t secondMax[256];
+
+    constexpr Utf8LeadTable() : length(), secondMin(), secondMax() {
+        for (int c = 0; c < 256; c++) {
+            length[c] = c < 0x80 ? 1 : c < 0xC2 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+            secondMin[c] = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+            secondMax[c] = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+        }
+    }
+};
+
+static constexpr Utf8LeadTable utf8Lead;
+
+// decode the character at s (not ASCII); its length, or 0 if it is not valid
+static inline size_t decodeUtf8(const unsigned char* s, size_t n, uint32_t& cp) {
+    size_t len = utf8Lead.length[s[0]];
+    if (len == 0 || len > n) return 0;
+    if (s[1] < utf8Lead.secondMin[s[0]] || s[1] > utf8Lead.secondMax[s[0]]) return 0;
+
+    cp = (s[0] & (0x7F >> len)) << 6 | (s[1] & 0x3F);
+    for (size_t k = 2; k < len; k++) {
+        if ((s[k] & 0xC0) != 0x80) return 0;
+        cp = cp << 6 | (s[k] & 0x3F);
+    }
+    return len;
+}
+
+static inline char* encodeUtf8(uint32_t cp, char* out) {
+    if (cp < 0x80) {
+        *out++ = cp;
+    } else if (cp < 0x800) {
+        *out++ = 0xC0 | cp >> 6;
+        *out++ = 0x80 | (cp & 0x3F);
+    } else if (cp < 0x10000) {
+        *out++ = 0xE0 | cp >> 12;
+        *out++ = 0x80 | (cp >> 6 & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    } else {
+        *out++ = 0xF0 | cp >> 18;
+        *out++ = 0x80 | (cp >> 12 & 0x3F);
+        *out++ = 0x80 | (cp >> 6 & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    }
+    return out;
+}
+
+// (index of the folding delta << 2) | class of a code point
+static inline uint32_t unicodeEntry(uint32_t cp) {
+    return unicodeBlocks[unicodeBlockIndex[cp >> UNICODE_BLOCK_SHIFT]][cp & ((1 << UNICODE_BLOCK_SHIFT) - 1)];
+}
+
+// bytes at the start of src that are all ASCII, in whole blocks of 16
+static inline size_t asciiPrefix(const char* src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t a, b;
+        memcpy(&a, src + i, 8);
+        memcpy(&b, src + i + 8, 8);
+        if ((a | b) & 0x8080808080808080ull) break;
+    }
+    return i;
+}
+
+// normalized form of a character: its folding in UTF-8 (1 to 3 bytes), ' ' or nothing
+struct Utf8Output {
+    char bytes[3];
+    uint8_t length;
+};
+
+// every character of 1 or 2 bytes (ASCII, and the Latin, Greek, Cyrillic, Hebrew and Arabic
+// letters), indexed by code point; ASCII follows the ASCII rules
+struct Utf8ShortTable {
+    Utf8Output chars[0x800];
+    // the 2 byte characters whose folding is 2 bytes too, as a 16 bit value (0 for the others),
+    // and one more entry for the 4 byte reads of the AVX2 gathers
+    uint16_t pairs[0x800 + 1];
+
+    Utf8ShortTable() : chars(), pairs() {
+        for (uint32_t cp = 0; cp < 0x800; cp++) {
+            Utf8Output& output = chars[cp];
+            if (cp < 0x80) {
+                char c = cp;
+                output.length = normalizeScalar(&c, 1, output.bytes);
+                continue;
+            }
+            uint32_t entry = unicodeEntry(cp);
+            if ((entry & 3) == UNICODE_CLASS_WORD) {
+                output.length = encodeUtf8(cp + unicodeFoldDeltas[entry >> 2], output.bytes) - output.bytes;
+            } else if ((entry & 3) == UNICODE_CLASS_SEPARATOR) {
+                output.bytes[0] = ' ';
+                output.length = 1;
+            }
+            if (output.length == 2) pairs[cp] = (uint8_t)output.bytes[0] | (uint8_t)output.bytes[1] << 8;
+        }
+    }
+};
+
+// built on first use, the Unicode tables are not constexpr
+static inline const Utf8ShortTable& utf8ShortTable() {
+    static const Utf8ShortTable table;
+    return table;
+}
+
+// the character at s, ASCII or a valid 2 byte sequence, without a branch; writes 4 bytes
+static inline char* putShort(const Utf8ShortTable& table, const unsigned char* s, char* out) {
+    uint32_t lead = -(uint32_t)(s[0] >> 7);
+    uint32_t cp = (((s[0] & 0x1F) << 6 | (s[1] & 0x3F)) & lead) | (s[0] & ~lead);
+    memcpy(out, &table.chars[cp], sizeof(Utf8Output));
+    return out + table.chars[cp].length;
+}
+
+// the characters from pos that start before stop (the last one may end past it), the ASCII runs
+// between them in one go; pos is moved to the next character
+static inline char* normalizeUtf8Chars(const unsigned char* s, size_t& pos, size_t stop, size_t n,
+                                       const Utf8ShortTable& table, char* out) {
+    // not through the references, a store to the output could change them
+    size_t i = pos;
+    while (i < stop) {
+        if (s[i] < 0x80) {
+            size_t end = i + 1;
+            while (end < stop && s[end] < 0x80) end++;
+            out += normalizeScalar((const char*)s + i, end - i, out);
+            i = end;
+            continue;
+        }
+
+        uint32_t cp;
+        size_t len = decodeUtf8(s + i, n - i, cp);
+        if (len == 0) {
+            i++;
+            continue;
+        }
+        i += len;
+
+        if (cp < 0x800) {
+            memcpy(out, &table.chars[cp], sizeof(Utf8Output));
+            out += table.chars[cp].length;
+            continue;
+        }
+
+        uint32_t entry = unicodeEntry(cp);
+        if (entry == UNICODE_CLASS_WORD) {
+            // its own folding, like the letters of the scripts without case: copied as it is
+            memcpy(out, s + i - len, len);
+            out += len;
+        } else if ((entry & 3) == UNICODE_CLASS_WORD) {
+            out = encodeUtf8(cp + unicodeFoldDeltas[entry >> 2], out);
+        } else if ((entry & 3) == UNICODE_CLASS_SEPARATOR) {
+            *out++ = ' ';
+        }
+    }
+    pos = i;
+    return out;
+}
+
+static size_t normalizeUtf8Scalar(const char* src, size_t n, char* dst) {
+    const NormalizeFunc normalizeAscii = asciiNormalize();
+    const Utf8ShortTable& table = utf8ShortTable();
+    const unsigned char* s = (const unsigned char*)src;
+    char* out = dst;
+
+    size_t i = 0;
+    while (i < n) {
+        size_t run = asciiPrefix(src + i, n - i);
+        if (run > 0) {
+            out += normalizeAscii(src + i, run, out);
+            i += run;
+        }
+
+        // one character at a time until the next block of 16 bytes
+        out = normalizeUtf8Chars(s, i, i + 16 < n ? i + 16 : n, n, table, out);
+    }
+    return out - dst;
+}
+
+#ifdef NORMALIZE_X86
+
+// the vector kernels decode the blocks they can not take one character at a time, and
+// more of them at once while the next ones can not be taken either (text of a script
+// of 3 byte characters), up to this many bytes
+#define NORMALIZE_UTF8_DECODE_MAX 256
+
+/*
+ * Classification of a block of the vector kernels, a bit per byte: when every continuation
+ * byte (0x80-0xBF) follows a 2 byte lead (0xC2-0xDF) and there is no other non-ASCII byte,
+ * the block is written one character at a time from the short table, without decoding. A
+ * lead in the last byte starts a character of the next block, so the block is one byte
+ * shorter. Returns the number of bytes of the block, with a bit on the first byte of each
+ * character in starts, or 0 if the block has to be decoded.
+ */
+static inline unsigned shortBlockWidth(uint64_t nonAscii, uint64_t cont, uint64_t leads, unsigned size,
+                                       uint64_t& starts) {
+    uint64_t last = leads >> (size - 1);
+    if ((nonAscii & ~cont & ~leads) || cont != (leads & ~(last << (size - 1))) << 1) return 0;
+    unsigned width = size - last;
+    starts = ~cont & ((1ull << width) - 1);
+    return width;
+}
+
+// the characters of a block checked by shortBlockWidth; reads the byte after the block
+static inline char* normalizeShortBlock(const unsigned char* s, uint64_t starts, const Utf8ShortTable& table,
+                                        char* out) {
+    while (starts) {
+        out = putShort(table, s + __builtin_ctzll(starts), out);
+        starts &= starts - 1;
+    }
+    return out;
+}
+
+// a block is only taken when the byte after it is in the text too (see normalizeShortBlock)
+__attribute__((target("sse4.2")))
+static size_t normalizeUtf8SSE42(const char* src, size_t n, char* dst) {
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - 'a'));
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    // signed, the continuation bytes are the lowest and the 2 byte leads come right after
+    const __m128i contEnd = _mm_set1_epi8((char)0xC0);
+    const __m128i leadFirst = _mm_set1_epi8((char)0xC1);
+    const __m128i leadEnd = _mm_set1_epi8((char)0xE0);
+
+    const Utf8ShortTable& table = utf8ShortTable();
+    const unsigned char* s = (const unsigned char*)src;
+    char* out = dst;
+    size_t i = 0;
+    size_t decodeSize = 16;
+    while (i + 16 < n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        unsigned nonAscii = _mm_movemask_epi8(v);
+        if (nonAscii == 0) {
+            __m128i lower = _mm_or_si128(v, caseBit);
+            __m128i letter = _mm_cmplt_epi8(_mm_add_epi8(lower, shift), limit);
+            __m128i separator = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline));
+            __m128i result = _mm_blendv_epi8(space, lower, letter);
+            out = compact16(result, _mm_movemask_epi8(_mm_or_si128(letter, separator)), out);
+            i += 16;
+            decodeSize = 16;
+            continue;
+        }
+
+        uint64_t cont = _mm_movemask_epi8(_mm_cmplt_epi8(v, contEnd));
+        uint64_t leads = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, leadFirst), _mm_cmplt_epi8(v, leadEnd)));
+        uint64_t starts;
+        unsigned width = shortBlockWidth(nonAscii, cont, leads, 16, starts);
+        if (width) {
+            out = normalizeShortBlock(s + i, starts, table, out);
+            i += width;
+            decodeSize = 16;
+        } else {
+            out = normalizeUtf8Chars(s, i, i + decodeSize < n ? i + decodeSize : n, n, table, out);
+            decodeSize = decodeSize < NORMALIZE_UTF8_DECODE_MAX ? decodeSize * 2 : decodeSize;
+        }
+    }
+
+    out = normalizeUtf8Chars(s, i, n, n, table, out);
+    return out - dst;
+}
+
+// the ASCII rules on a block of 32 bytes, as in normalizeAVX2: the block normalized, with a bit
+// on the bytes to keep
+__attribute__((target("avx2")))
+static inline __m256i normalizeAsciiAVX2(__m256i v, uint32_t& keep) {
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i shift = _mm256_set1_epi8((char)(0x80 - 'a'));
+    const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    __m256i lower = _mm256_or_si256(v, caseBit);
+    __m256i letter = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(lower, shift));
+    __m256i separator = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, newline));
+    keep = _mm256_movemask_epi8(_mm256_or_si256(letter, separator));
+    return _mm256_blendv_epi8(space, lower, letter);
+}
+
+__attribute__((target("avx2")))
+static inline char* compact32(__m256i v, uint32_t keep, char* out) {
+    if (keep == 0xFFFFFFFFu) {
+        _mm256_storeu_si256((__m256i*)out, v);
+        return out + 32;
+    }
+    out = compact16(_mm256_castsi256_si128(v), keep & 0xFFFF, out);
+    return compact16(_mm256_extracti128_si256(v, 1), keep >> 16, out);
+}
+
+/*
+ * normalizeShortBlock for a whole block when every 2 byte character of it folds into 2 bytes:
+ * the folding of the character that would start at each byte is gathered from the pairs table,
+ * its first byte goes on the leads and its second on the continuation bytes, and the block is
+ * compacted like an ASCII one. Null, with nothing written, if a character needs the short table.
+ */
+__attribute__((target("avx2")))
+static inline char* normalizePairBlockAVX2(const char* src, __m256i v, __m256i leadBytes, __m256i contBytes,
+                                           uint32_t leads, uint32_t cont, const Utf8ShortTable& table, char* out) {
+    const __m256i low5 = _mm256_set1_epi16(0x1F);
+    const __m256i low6 = _mm256_set1_epi16(0x3F);
+    const __m256i low8 = _mm256_set1_epi16(0xFF);
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    const int* pairs = (const int*)table.pairs;
+
+    __m256i next = _mm256_loadu_si256((const __m256i*)(src + 1));
+    __m256i cpLow = _mm256_or_si256(
+        _mm256_slli_epi16(_mm256_and_si256(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)), low5), 6),
+        _mm256_and_si256(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(next)), low6));
+    __m256i cpHigh = _mm256_or_si256(
+        _mm256_slli_epi16(_mm256_and_si256(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)), low5), 6),
+        _mm256_and_si256(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(next, 1)), low6));
+
+    __m256i g0 = _mm256_i32gather_epi32(pairs, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(cpLow)), 2);
+    __m256i g1 = _mm256_i32gather_epi32(pairs, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(cpLow, 1)), 2);
+    __m256i g2 = _mm256_i32gather_epi32(pairs, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(cpHigh)), 2);
+    __m256i g3 = _mm256_i32gather_epi32(pairs, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(cpHigh, 1)), 2);
+
+    // the packs work inside each 128 bit lane, the permutes put the 64 bit parts back in order
+    __m256i folded0 = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(_mm256_and_si256(g0, low16), _mm256_and_si256(g1, low16)), 0xD8);
+    __m256i folded1 = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(_mm256_and_si256(g2, low16), _mm256_and_si256(g3, low16)), 0xD8);
+    __m256i first = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(_mm256_and_si256(folded0, low8), _mm256_and_si256(folded1, low8)), 0xD8);
+    __m256i second = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(_mm256_srli_epi16(folded0, 8), _mm256_srli_epi16(folded1, 8)), 0xD8);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, _mm256_setzero_si256())) & leads) return nullptr;
+
+    // the second byte of a character is one byte after its lead
+    second = _mm256_alignr_epi8(second, _mm256_permute2x128_si256(second, second, 0x08), 15);
+
+    uint32_t keep;
+    __m256i result = normalizeAsciiAVX2(v, keep);
+    result = _mm256_blendv_epi8(_mm256_blendv_epi8(result, first, leadBytes), second, contBytes);
+    return compact32(result, keep | leads | cont, out);
+}
+
+__attribute__((target("avx2")))
+static size_t normalizeUtf8AVX2(const char* src, size_t n, char* dst) {
+    const __m256i contEnd = _mm256_set1_epi8((char)0xC0);
+    const __m256i leadFirst = _mm256_set1_epi8((char)0xC1);
+    const __m256i leadEnd = _mm256_set1_epi8((char)0xE0);
+
+    const Utf8ShortTable& table = utf8ShortTable();
+    const unsigned char* s = (const unsigned char*)src;
+    char* out = dst;
+    size_t i = 0;
+    size_t decodeSize = 32;
+    while (i + 32 < n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        uint32_t nonAscii = _mm256_movemask_epi8(v);
+        if (nonAscii == 0) {
+            uint32_t keep;
+            __m256i result = normalizeAsciiAVX2(v, keep);
+            out = compact32(result, keep, out);
+            i += 32;
+            decodeSize = 32;
+            continue;
+        }
+
+        __m256i contBytes = _mm256_cmpgt_epi8(contEnd, v);
+        __m256i leadBytes = _mm256_and_si256(_mm256_cmpgt_epi8(v, leadFirst), _mm256_cmpgt_epi8(leadEnd, v));
+        uint64_t cont = (uint32_t)_mm256_movemask_epi8(contBytes);
+        uint64_t leads = (uint32_t)_mm256_movemask_epi8(leadBytes);
+        uint64_t starts;
+        unsigned width = shortBlockWidth(nonAscii, cont, leads, 32, starts);
+        if (width) {
+            // the lead in the last byte, if any, is left for the next block
+            char* end = normalizePairBlockAVX2(src + i, v, leadBytes, contBytes, leads & starts, cont, table, out);
+            out = end ? end : normalizeShortBlock(s + i, starts, table, out);
+            i += width;
+            decodeSize = 32;
+        } else {
+            out = normalizeUtf8Chars(s, i, i + decodeSize < n ? i + decodeSize : n, n, table, out);
+            decodeSize = decodeSize < NORMALIZE_UTF8_DECODE_MAX ? decodeSize * 2 : decodeSize;
+        }
+    }
+
+    out = normalizeUtf8Chars(s, i, n, n, table, out);
+    return out - dst;
+}
+
+#endif
+
+// pick the widest kernel the cpu supports, once
+static inline NormalizeFunc selectNormalizeUtf8() {
+#ifdef NORMALIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return normalizeUtf8AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return normalizeUtf8SSE42;
+#endif
+    return normalizeUtf8Scalar;
+}
+
+static inline NormalizeFunc utf8Normalize() {
+    static const NormalizeFunc normalize = selectNormalizeUtf8();
+    return normalize;
+}
+
+#endif
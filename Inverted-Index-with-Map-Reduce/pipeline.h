@@ -0,0 +1,62 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <memory>
+#include <semaphore.h>
+#include <sched.h>
+#include <errno.h>
+
+using namespace std;
+
+/*
+ * Files whose partial list is complete, in the order the mappers finished them. It is
+ * what lets the reducers work while the mappers are still running: a mapper appends a
+ * file with a single fetch_add, and every reducer reads the whole log with its own
+ * cursor. The log never wraps, since every file is published exactly once. A reducer
+ * that caught up sleeps on its own semaphore, which every publish posts.
+ */
+class CompletionLog {
+public:
+    CompletionLog(size_t capacity, int readers)
+        : entries(new Entry[capacity]), semaphores(new sem_t[readers]), readers(readers) {
+        for (int r = 0; r < readers; r++) sem_init(&semaphores[r], 0, 0);
+    }
+
+    CompletionLog(const CompletionLog&) = delete;
+    CompletionLog& operator=(const CompletionLog&) = delete;
+
+    ~CompletionLog() {
+        for (int r = 0; r < readers; r++) sem_destroy(&semaphores[r]);
+    }
+
+    void publish(int file) {
+        size_t slot = tail.fetch_add(1, memory_order_relaxed);
+        entries[slot].file = file;
+        entries[slot].ready.store(true, memory_order_release);
+        for (int r = 0; r < readers; r++) sem_post(&semaphores[r]);
+    }
+
+    // the file at the given position of the log, waiting until it is published; every reader
+    // must ask for positions 0, 1, 2, ... in order
+    int wait(int reader, size_t position) {
+        while (sem_wait(&semaphores[reader]) != 0 && errno == EINTR) {}
+
+        // the post may come from a mapper that took a later slot and finished writing it first
+        while (!entries[position].ready.load(memory_order_acquire)) sched_yield();
+        return entries[position].file;
+    }
+
+private:
+    struct Entry {
+        int file = -1;
+        atomic<bool> ready{false};
+    };
+
+    unique_ptr<Entry[]> entries;
+    atomic<size_t> tail{0};
+    unique_ptr<sem_t[]> semaphores;
+    int readers;
+};
+
+#endif
@@ -0,0 +1,207 @@
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "index_reader.h"
+#include "query_engine.h"
+#include "segments.h"
+#include "text_output.h"
+
+using namespace std;
+
+/*
+ * Read-only tool over a binary index written with --binary-index, or over the directory
+ * of an incremental index (--incremental), whose segments are merged on the fly:
+ *   lookup: print the files of each word (normalized like the mappers do)
+ *   dump:   write the a.txt ... z.txt files of the indexer again from the index
+ *   search: run a boolean query (see query_engine.h), optionally ranked
+ *   bench:  replay a log of queries (one per line) and report queries per second
+ */
+
+template <typename Index>
+int lookupWords(const Index& index, int argc, char** argv) {
+    vector<int> fileIDs;
+    for (int i = 3; i < argc; i++) {
+        string word = normalizeTerm(argv[i], index.flags() & INDEX_FLAG_UTF8);
+
+        auto begin = chrono::steady_clock::now();
+        bool found = index.lookup(word, fileIDs);
+        auto end = chrono::steady_clock::now();
+        double micros = chrono::duration<double, micro>(end - begin).count();
+
+        if (found) {
+            writeEntry(cout, word, fileIDs);
+        } else {
+            cout << word << ": not found\n";
+        }
+        cout << "  (" << micros << " us)" << endl;
+    }
+    return 0;
+}
+
+// parse the optional "--rank <none|tfidf|bm25>" and "--top <k>" arguments starting at argv[first];
+// the remaining arguments are returned
+bool parseSearchOptions(int argc, char** argv, int first, RankMode& mode, size_t& top, vector<string>& rest) {
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc) {
+            string name = argv[++i];
+            if (name == "none") {
+                mode = RANK_NONE;
+            } else if (name == "tfidf") {
+                mode = RANK_TFIDF;
+            } else if (name == "bm25") {
+                mode = RANK_BM25;
+            } else {
+                cout << "Unknown ranking: " << name << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else {
+            rest.push_back(argv[i]);
+        }
+    }
+    return true;
+}
+
+template <typename Index>
+int searchQuery(const Index& index, int argc, char** argv) {
+    RankMode mode = RANK_NONE;
+    size_t top = 0;
+    vector<string> words;
+    if (!parseSearchOptions(argc, argv, 3, mode, top, words)) return 1;
+
+    string query;
+    for (const auto& word : words) query += word + " ";
+
+    QueryParser parser(index.flags() & INDEX_FLAG_UTF8);
+    string error;
+    unique_ptr<QueryNode> root = parser.parse(query, error);
+    if (!root) {
+        cout << "Invalid query: " << error << endl;
+        return 1;
+    }
+
+    QueryEngine engine(index);
+    auto begin = chrono::steady_clock::now();
+    vector<ScoredFile> results = engine.search(*root, mode, top);
+    auto end = chrono::steady_clock::now();
+
+    cout << results.size() << " files (" << chrono::duration<double, micro>(end - begin).count() << " us)" << endl;
+    for (const auto& result : results) {
+        cout << result.fileID;
+        if (mode != RANK_NONE) cout << " " << result.score;
+        cout << "\n";
+    }
+    return 0;
+}
+
+template <typename Index>
+int benchQueries(const Index& index, int argc, char** argv) {
+    RankMode mode = RANK_NONE;
+    size_t top = 10;
+    vector<string> rest;
+    if (!parseSearchOptions(argc, argv, 3, mode, top, rest) || rest.empty()) {
+        cout << "Usage: " << argv[0] << " <index_file|index_dir> bench <query_log> [<repetitions>] [--rank <mode>] [--top <k>]" << endl;
+        return 1;
+    }
+    int repetitions = rest.size() > 1 ? max(1, atoi(rest[1].c_str())) : 1;
+
+    ifstream log(rest[0]);
+    if (!log) {
+        cout << "Could not open query log: " << rest[0] << endl;
+        return 1;
+    }
+    vector<string> queries;
+    string line;
+    while (getline(log, line)) {
+        if (!line.empty()) queries.push_back(line);
+    }
+
+    // the replay includes parsing, like a real query would
+    QueryParser parser(index.flags() & INDEX_FLAG_UTF8);
+    QueryEngine engine(index);
+    size_t executed = 0, invalid = 0, matches = 0;
+
+    auto begin = chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++) {
+        for (const auto& query : queries) {
+            string error;
+            unique_ptr<QueryNode> root = parser.parse(query, error);
+            if (!root) {
+                invalid++;
+                continue;
+            }
+            matches += engine.search(*root, mode, top).size();
+            executed++;
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(end - begin).count();
+
+    cout << "queries: " << executed << " (" << invalid << " invalid)" << endl;
+    cout << "results returned: " << matches << endl;
+    cout << "time: " << seconds << " s" << endl;
+    cout << "throughput: " << (seconds > 0 ? executed / seconds : 0) << " queries/s" << endl;
+    return 0;
+}
+
+template <typename Index>
+int runCommand(const Index& index, int argc, char** argv) {
+    if (strcmp(argv[2], "lookup") == 0) {
+        return lookupWords(index, argc, argv);
+    } else if (strcmp(argv[2], "dump") == 0) {
+        return dumpText(index, argc > 3 ? argv[3] : ".");
+    } else if (strcmp(argv[2], "search") == 0) {
+        return searchQuery(index, argc, argv);
+    } else if (strcmp(argv[2], "bench") == 0) {
+        return benchQueries(index, argc, argv);
+    }
+
+    cout << "Unknown command: " << argv[2] << endl;
+    return 1;
+}
+
+// a damaged index answers what it can read, and the command then fails
+template <typename Index>
+int checkedCommand(const Index& index, int argc, char** argv) {
+    int status = runCommand(index, argc, argv);
+    if (index.corrupt()) {
+        cout << "The index is damaged: " << argv[1] << endl;
+        return 1;
+    }
+    return status;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <index_file|index_dir> lookup <word> [<word> ...]" << endl;
+        cout << "       " << argv[0] << " <index_file|index_dir> dump [<output_dir>]" << endl;
+        cout << "       " << argv[0] << " <index_file|index_dir> search [--rank <none|tfidf|bm25>] [--top <k>] <query>" << endl;
+        cout << "       " << argv[0] << " <index_file|index_dir> bench <query_log> [<repetitions>] [--rank <mode>] [--top <k>]" << endl;
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(argv[1], &st) == 0 && S_ISDIR(st.st_mode)) {
+        SegmentedIndex index;
+        if (!index.open(argv[1])) {
+            cout << "Could not open index: " << argv[1] << endl;
+            return 1;
+        }
+        return checkedCommand(index, argc, argv);
+    }
+
+    IndexReader index;
+    if (!index.open(argv[1])) {
+        cout << "Could not open index: " << argv[1] << endl;
+        return 1;
+    }
+    return checkedCommand(index, argc, argv);
+}
@@ -0,0 +1,409 @@
+#ifndef QUERY_ENGINE_H
+#define QUERY_ENGINE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "normalize.h"
+#include "normalize_utf8.h"
+#include "index_reader.h"
+
+using namespace std;
+
+/*
+ * Boolean queries over a binary index: words, AND, OR, NOT and parentheses.
+ * Two words next to each other are joined with AND; NOT binds tighter than AND,
+ * which binds tighter than OR:
+ *     cat dog          cat AND dog
+ *     cat OR NOT dog   files with cat, or without dog
+ *     (cat OR dog) NOT fish
+ * The words are normalized like the mappers do. The matching files can be ranked
+ * with TF-IDF or BM25 over the words that are not negated.
+ */
+
+#define GALLOP_RATIO 32   // lists this many times longer than the other are galloped into
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+/* ---------- operations on sorted lists of file IDs ---------- */
+
+// first position >= from where list[pos] >= value, by doubling steps and then a binary search
+static inline size_t gallop(const vector<int>& list, size_t from, int value) {
+    size_t step = 1, hi = from;
+    while (hi < list.size() && list[hi] < value) {
+        from = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    hi = min(hi, list.size());
+    return lower_bound(list.begin() + from, list.begin() + hi, value) - list.begin();
+}
+
+// small is much shorter than large: look each of its IDs up in large
+inline void intersectGalloping(const vector<int>& small, const vector<int>& large, vector<int>& out) {
+    size_t pos = 0;
+    for (int id : small) {
+        pos = gallop(large, pos, id);
+        if (pos == large.size()) break;
+        if (large[pos] == id) out.push_back(id);
+    }
+}
+
+// lists of similar sizes: compare blocks of 4 IDs of a against all 4 rotations of a block of b
+inline void intersectSIMD(const vector<int>& a, const vector<int>& b, vector<int>& out) {
+    size_t i = 0, j = 0;
+#ifdef __SSE2__
+    while (i + 4 <= a.size() && j + 4 <= b.size()) {
+        __m128i va = _mm_loadu_si128((const __m128i*)&a[i]);
+        __m128i vb = _mm_loadu_si128((const __m128i*)&b[j]);
+
+        __m128i eq = _mm_cmpeq_epi32(va, vb);
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        for (int k = 0; k < 4; k++) {
+            if (mask & (1 << k)) out.push_back(a[i + k]);
+        }
+
+        // advance the block(s) that cannot match anything further
+        int maxA = a[i + 3], maxB = b[j + 3];
+        if (maxA <= maxB) i += 4;
+        if (maxB <= maxA) j += 4;
+    }
+#endif
+    while (i < a.size() && j < b.size()) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out.push_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+}
+
+inline vector<int> intersectLists(const vector<int>& a, const vector<int>& b) {
+    vector<int> out;
+    const vector<int>& small = a.size() <= b.size() ? a : b;
+    const vector<int>& large = a.size() <= b.size() ? b : a;
+    out.reserve(small.size());
+
+    if (small.size() * GALLOP_RATIO < large.size()) {
+        intersectGalloping(small, large, out);
+    } else {
+        intersectSIMD(small, large, out);
+    }
+    return out;
+}
+
+inline vector<int> uniteLists(const vector<int>& a, const vector<int>& b) {
+    vector<int> out;
+    out.reserve(a.size() + b.size());
+    set_union(a.begin(), a.end(), b.begin(), b.end(), back_inserter(out));
+    return out;
+}
+
+inline vector<int> subtractLists(const vector<int>& a, const vector<int>& b) {
+    vector<int> out;
+    size_t pos = 0;
+    for (int id : a) {
+        pos = gallop(b, pos, id);
+        if (pos == b.size() || b[pos] != id) out.push_back(id);
+    }
+    return out;
+}
+
+/* ---------- parsing ---------- */
+
+// lowercase the word and drop the non alphabetical characters, like the mappers
+// (with the UTF-8 kernel for an index built with --utf8)
+inline string normalizeTerm(const string& word, bool utf8 = false) {
+    vector<char> buffer(NORMALIZE_OUTPUT_SIZE(word.size()));
+    size_t len = (utf8 ? utf8Normalize() : asciiNormalize())(word.data(), word.size(), buffer.data());
+    string term(buffer.data(), len);
+    term.erase(remove(term.begin(), term.end(), ' '), term.end());
+    return term;
+}
+
+struct QueryNode {
+    enum Type { TERM, AND, OR, NOT } type;
+    string term;
+    vector<unique_ptr<QueryNode>> children;
+
+    QueryNode(Type type) : type(type) {}
+};
+
+class QueryParser {
+public:
+    explicit QueryParser(bool utf8 = false) : utf8(utf8) {}
+
+    // NULL (and an error message) if the query is not valid
+    unique_ptr<QueryNode> parse(const string& query, string& error) {
+        tokens.clear();
+        pos = 0;
+        tokenize(query);
+
+        unique_ptr<QueryNode> root = parseOr(error);
+        if (root && pos < tokens.size()) {
+            error = "unexpected '" + tokens[pos] + "'";
+            return nullptr;
+        }
+        return root;
+    }
+
+private:
+    vector<string> tokens;
+    size_t pos = 0;
+    bool utf8;
+
+    void tokenize(const string& query) {
+        string current;
+        for (char c : query) {
+            if (c == '(' || c == ')' || isspace((unsigned char)c)) {
+                if (!current.empty()) tokens.push_back(current);
+                current.clear();
+                if (!isspace((unsigned char)c)) tokens.push_back(string(1, c));
+            } else {
+                current += c;
+            }
+        }
+        if (!current.empty()) tokens.push_back(current);
+    }
+
+    bool isOperator(const string& token) {
+        return token == "AND" || token == "OR" || token == "NOT" || token == "(" || token == ")";
+    }
+
+    unique_ptr<QueryNode> parseOr(string& error) {
+        unique_ptr<QueryNode> left = parseAnd(error);
+        if (!left) return nullptr;
+        if (pos >= tokens.size() || tokens[pos] != "OR") return left;
+
+        auto node = make_unique<QueryNode>(QueryNode::OR);
+        node->children.push_back(move(left));
+        while (pos < tokens.size() && tokens[pos] == "OR") {
+            pos++;
+            unique_ptr<QueryNode> right = parseAnd(error);
+            if (!right) return nullptr;
+            node->children.push_back(move(right));
+        }
+        return node;
+    }
+
+    unique_ptr<QueryNode> parseAnd(string& error) {
+        unique_ptr<QueryNode> left = parseUnary(error);
+        if (!left) return nullptr;
+
+        auto node = make_unique<QueryNode>(QueryNode::AND);
+        node->children.push_back(move(left));
+        while (pos < tokens.size() && tokens[pos] != "OR" && tokens[pos] != ")") {
+            if (tokens[pos] == "AND") pos++;
+            unique_ptr<QueryNode> right = parseUnary(error);
+            if (!right) return nullptr;
+            node->children.push_back(move(right));
+        }
+
+        if (node->children.size() == 1) return move(node->children[0]);
+        return node;
+    }
+
+    unique_ptr<QueryNode> parseUnary(string& error) {
+        if (pos >= tokens.size()) {
+            error = "unexpected end of query";
+            return nullptr;
+        }
+
+        const string& token = tokens[pos++];
+        if (token == "NOT") {
+            unique_ptr<QueryNode> operand = parseUnary(error);
+            if (!operand) return nullptr;
+            auto node = make_unique<QueryNode>(QueryNode::NOT);
+            node->children.push_back(move(operand));
+            return node;
+        }
+        if (token == "(") {
+            unique_ptr<QueryNode> inner = parseOr(error);
+            if (!inner) return nullptr;
+            if (pos >= tokens.size() || tokens[pos] != ")") {
+                error = "missing ')'";
+                return nullptr;
+            }
+            pos++;
+            return inner;
+        }
+        if (isOperator(token)) {
+            error = "unexpected '" + token + "'";
+            return nullptr;
+        }
+
+        auto node = make_unique<QueryNode>(QueryNode::TERM);
+        node->term = normalizeTerm(token, utf8);
+        if (node->term.empty()) {
+            error = "'" + token + "' has no letters";
+            return nullptr;
+        }
+        return node;
+    }
+
+};
+
+/* ---------- evaluation and ranking ---------- */
+
+enum RankMode { RANK_NONE, RANK_TFIDF, RANK_BM25 };
+
+struct ScoredFile {
+    int fileID;
+    double score;
+};
+
+/*
+ * Works over anything with the lookup / numFiles / docLength / avgDocLength interface of
+ * IndexReader and file IDs 1 .. numFiles(): a single index file or a segmented index.
+ */
+template <typename Index = IndexReader>
+class QueryEngine {
+public:
+    QueryEngine(const Index& index) : index(index) {}
+
+    // sorted IDs of the files that match the query
+    vector<int> evaluate(const QueryNode& node) {
+        switch (node.type) {
+        case QueryNode::TERM: {
+            vector<int> fileIDs;
+            index.lookup(node.term, fileIDs);
+            return fileIDs;
+        }
+        case QueryNode::OR: {
+            vector<int> result;
+            for (const auto& child : node.children) result = uniteLists(result, evaluate(*child));
+            return result;
+        }
+        case QueryNode::NOT:
+            return subtractLists(allFiles(), evaluate(*node.children[0]));
+        case QueryNode::AND:
+            return evaluateAnd(node);
+        }
+        return {};
+    }
+
+    // matching files, best first (or by ID without ranking), at most top of them (0 = all)
+    vector<ScoredFile> search(const QueryNode& root, RankMode mode, size_t top) {
+        vector<int> matches = evaluate(root);
+        vector<ScoredFile> results(matches.size());
+        for (size_t i = 0; i < matches.size(); i++) results[i] = {matches[i], 0.0};
+
+        if (mode != RANK_NONE) {
+            vector<string> terms;
+            positiveTerms(root, false, terms);
+            sort(terms.begin(), terms.end());
+            terms.erase(unique(terms.begin(), terms.end()), terms.end());
+
+            for (const auto& term : terms) addScores(term, mode, results);
+        }
+
+        auto better = [](const ScoredFile& a, const ScoredFile& b) {
+            if (a.score != b.score) return a.score > b.score;
+            return a.fileID < b.fileID;
+        };
+        if (top > 0 && top < results.size()) {
+            partial_sort(results.begin(), results.begin() + top, results.end(), better);
+            results.resize(top);
+        } else {
+            sort(results.begin(), results.end(), better);
+        }
+        return results;
+    }
+
+private:
+    const Index& index;
+    vector<int> universe;
+
+    const vector<int>& allFiles() {
+        if (universe.empty()) {
+            for (uint32_t id = 1; id <= index.numFiles(); id++) universe.push_back(id);
+        }
+        return universe;
+    }
+
+    // intersect the positive operands, shortest first, then remove the negated ones
+    vector<int> evaluateAnd(const QueryNode& node) {
+        vector<vector<int>> positive, negative;
+        for (const auto& child : node.children) {
+            if (child->type == QueryNode::NOT) {
+                negative.push_back(evaluate(*child->children[0]));
+            } else {
+                positive.push_back(evaluate(*child));
+            }
+        }
+
+        vector<int> result;
+        if (positive.empty()) {
+            result = allFiles();
+        } else {
+            sort(positive.begin(), positive.end(),
+                 [](const vector<int>& a, const vector<int>& b) { return a.size() < b.size(); });
+            result = move(positive[0]);
+            for (size_t i = 1; i < positive.size() && !result.empty(); i++) {
+                result = intersectLists(result, positive[i]);
+            }
+        }
+
+        for (const auto& excluded : negative) {
+            if (result.empty()) break;
+            result = subtractLists(result, excluded);
+        }
+        return result;
+    }
+
+    static void positiveTerms(const QueryNode& node, bool negated, vector<string>& terms) {
+        if (node.type == QueryNode::TERM) {
+            if (!negated) terms.push_back(node.term);
+            return;
+        }
+        for (const auto& child : node.children) {
+            positiveTerms(*child, negated != (node.type == QueryNode::NOT), terms);
+        }
+    }
+
+    // add the contribution of one term to the score of every matching file (both lists sorted by ID)
+    void addScores(const string& term, RankMode mode, vector<ScoredFile>& results) {
+        vector<int> fileIDs;
+        vector<uint32_t> frequencies;
+        if (!index.lookup(term, fileIDs, &frequencies)) return;
+
+        double files = index.numFiles();
+        double df = fileIDs.size();
+        double idf = mode == RANK_BM25 ? log(1.0 + (files - df + 0.5) / (df + 0.5)) : log(files / df);
+        double avgLength = index.avgDocLength();
+
+        size_t pos = 0;
+        for (auto& result : results) {
+            while (pos < fileIDs.size() && fileIDs[pos] < result.fileID) pos++;
+            if (pos == fileIDs.size()) break;
+            if (fileIDs[pos] != result.fileID) continue;
+
+            double tf = frequencies[pos];
+            if (mode == RANK_BM25) {
+                double norm = BM25_K1 * (1 - BM25_B + BM25_B * index.docLength(result.fileID) / avgLength);
+                result.score += idf * tf * (BM25_K1 + 1) / (tf + norm);
+            } else {
+                result.score += tf * idf;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "interner.h"
+
+using namespace std;
+
+#ifndef MIN_CHUNK_SIZE
+#define MIN_CHUNK_SIZE (1 << 22) // files are never split in chunks smaller than this
+#endif
+#define CHUNKS_PER_MAPPER 8      // aim for this many chunks per mapper when the corpus is large
+
+struct InputFile {
+    string name;
+    string fullPath;
+    int fileID;
+    size_t size;
+    int numChunks;
+};
+
+// a byte range of an input file; a task owns every word that starts inside its range
+struct MapTask {
+    int file;         // index in FileScheduler::files
+    size_t begin;
+    size_t end;
+};
+
+/*
+ * Fixed set of tasks handed to one mapper. The owner takes tasks from the front,
+ * idle mappers steal from the back. Both ends live in the same 64 bit word, so a
+ * single CAS claims a task without any lock and the two ends can never hand out
+ * the same task.
+ */
+struct TaskDeque {
+    vector<int> tasks;              // indices in FileScheduler::tasks, largest first
+    atomic<uint64_t> bounds{0};     // (front << 32) | back
+    size_t bytes = 0;               // total size of the tasks, only used while scheduling
+
+    void publish() {
+        bounds.store((uint64_t)tasks.size(), memory_order_release);
+    }
+
+    bool popFront(int& task) {
+        uint64_t current = bounds.load(memory_order_acquire);
+        while (true) {
+            uint32_t front = current >> 32, back = (uint32_t)current;
+            if (front >= back) return false;
+
+            uint64_t next = ((uint64_t)(front + 1) << 32) | back;
+            if (bounds.compare_exchange_weak(current, next, memory_order_acq_rel)) {
+                task = tasks[front];
+                return true;
+            }
+        }
+    }
+
+    bool stealBack(int& task) {
+        uint64_t current = bounds.load(memory_order_acquire);
+        while (true) {
+            uint32_t front = current >> 32, back = (uint32_t)current;
+            if (front >= back) return false;
+
+            uint64_t next = ((uint64_t)front << 32) | (back - 1);
+            if (bounds.compare_exchange_weak(current, next, memory_order_acq_rel)) {
+                task = tasks[back - 1];
+                return true;
+            }
+        }
+    }
+};
+
+struct FileScheduler {
+    vector<InputFile> files;
+    vector<MapTask> tasks;
+    vector<TaskDeque> deques;                           // one per mapper
+
+    unique_ptr<atomic<int>[]> remainingChunks;          // per file, chunks not processed yet
+    vector<PartialList> chunkLists;                     // per task, words of a chunk of a split file
+    vector<uint64_t> taskWords;                         // per task, number of words found (for document lengths)
+
+    // own deque first, then steal from the others; no task is ever added after the start
+    bool nextTask(int mapper, int& task, bool& stolen) {
+        stolen = false;
+        if (deques[mapper].popFront(task)) return true;
+
+        stolen = true;
+        int nrDeques = deques.size();
+        for (int i = 1; i < nrDeques; i++) {
+            if (deques[(mapper + i) % nrDeques].stealBack(task)) return true;
+        }
+        return false;
+    }
+
+    // true for the mapper that finished the last chunk of the file
+    bool finishChunk(int file) {
+        return remainingChunks[file].fetch_sub(1, memory_order_acq_rel) == 1;
+    }
+};
+
+/*
+ * Stat every file, split the big ones in chunks and deal the tasks, largest first,
+ * to the mapper with the least bytes so far.
+ */
+inline void buildSchedule(FileScheduler& scheduler, int nrMappers) {
+    size_t totalBytes = 0;
+    for (auto& file : scheduler.files) {
+        struct stat st;
+        // a file that cannot be stat'ed still gets a task, the mapper reports the error
+        file.size = stat(file.fullPath.c_str(), &st) == 0 ? st.st_size : 0;
+        totalBytes += file.size;
+    }
+
+    size_t chunkSize = max((size_t)MIN_CHUNK_SIZE, totalBytes / ((size_t)nrMappers * CHUNKS_PER_MAPPER));
+
+    scheduler.remainingChunks.reset(new atomic<int>[scheduler.files.size()]);
+    for (size_t i = 0; i < scheduler.files.size(); i++) {
+        InputFile& file = scheduler.files[i];
+        file.numChunks = max((size_t)1, (file.size + chunkSize - 1) / chunkSize);
+        scheduler.remainingChunks[i].store(file.numChunks);
+
+        for (int c = 0; c < file.numChunks; c++) {
+            size_t begin = c * chunkSize;
+            size_t end = c == file.numChunks - 1 ? file.size : begin + chunkSize;
+            scheduler.tasks.push_back({(int)i, begin, end});
+        }
+    }
+    scheduler.chunkLists.resize(scheduler.tasks.size());
+    scheduler.taskWords.resize(scheduler.tasks.size(), 0);
+
+    vector<int> order(scheduler.tasks.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return scheduler.tasks[a].end - scheduler.tasks[a].begin > scheduler.tasks[b].end - scheduler.tasks[b].begin;
+    });
+
+    scheduler.deques = vector<TaskDeque>(nrMappers);
+    for (int task : order) {
+        TaskDeque* lightest = &scheduler.deques[0];
+        for (auto& deque : scheduler.deques) {
+            if (deque.bytes < lightest->bytes ||
+                (deque.bytes == lightest->bytes && deque.tasks.size() < lightest->tasks.size())) {
+                lightest = &deque;
+            }
+        }
+        lightest->tasks.push_back(task);
+        lightest->bytes += scheduler.tasks[task].end - scheduler.tasks[task].begin;
+    }
+
+    for (auto& deque : scheduler.deques) deque.publish();
+}
+
+#endif
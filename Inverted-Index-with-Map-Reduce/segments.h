@@ -0,0 +1,467 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "interner.h"
+#include "index_format.h"
+#include "index_reader.h"
+
+using namespace std;
+
+/*
+ * Incremental index: a directory with a MANIFEST and several segments, each one a
+ * binary index file (index_format.h) over the documents added by one run.
+ *
+ * Every document gets a stable ID the first time it is indexed. A run only indexes
+ * the files that are new or changed since the manifest was written; the old version
+ * of a changed or removed file stays in its segment, hidden by a tombstone, until a
+ * compaction rewrites that segment. Queries and the text output merge the segments
+ * and number the files by their position in the last input list, like a full build.
+ *
+ * MANIFEST (text, one record per line):
+ *   next_doc <id>
+ *   next_segment <id>
+ *   segment <id>                                          live segment, file seg-<id>.idx
+ *   tombstone <doc id> <segment id>                       document deleted or replaced
+ *   doc <doc id> <segment id> <size> <mtime> <hash> <name>  in input list order
+ */
+
+#define MANIFEST_NAME "MANIFEST"
+#define MAX_SEGMENTS 8      // compaction merges segments above this many
+#define MERGE_FACTOR 4      // smallest segments merged together by one compaction
+
+struct DocEntry {
+    int docID;
+    int segment;
+    uint64_t size;
+    int64_t mtime;          // nanoseconds
+    uint64_t hash;          // of the whole content, checked when only the mtime changed
+    string name;
+};
+
+struct Tombstone {
+    int docID;
+    int segment;
+};
+
+struct Manifest {
+    int nextDocID = 1;
+    int nextSegment = 1;
+    uint32_t flags = 0;                 // INDEX_FLAG_* of every segment
+    vector<int> segments;
+    vector<Tombstone> tombstones;
+    vector<DocEntry> docs;
+
+    // a missing manifest is an empty index; false only for an unreadable one
+    bool load(const string& dir) {
+        FILE* file = fopen((dir + "/" + MANIFEST_NAME).c_str(), "r");
+        if (!file) return access((dir + "/" + MANIFEST_NAME).c_str(), F_OK) != 0;
+
+        char type[32];
+        bool ok = true;
+        while (ok && fscanf(file, "%31s", type) == 1) {
+            if (strcmp(type, "next_doc") == 0) {
+                ok = fscanf(file, "%d", &nextDocID) == 1;
+            } else if (strcmp(type, "next_segment") == 0) {
+                ok = fscanf(file, "%d", &nextSegment) == 1;
+            } else if (strcmp(type, "flags") == 0) {
+                ok = fscanf(file, "%u", &flags) == 1;
+            } else if (strcmp(type, "segment") == 0) {
+                int id;
+                ok = fscanf(file, "%d", &id) == 1;
+                segments.push_back(id);
+            } else if (strcmp(type, "tombstone") == 0) {
+                Tombstone tombstone;
+                ok = fscanf(file, "%d %d", &tombstone.docID, &tombstone.segment) == 2;
+                tombstones.push_back(tombstone);
+            } else if (strcmp(type, "doc") == 0) {
+                DocEntry doc;
+                char name[256];
+                ok = fscanf(file, "%d %d %lu %ld %lu %255s", &doc.docID, &doc.segment, &doc.size, &doc.mtime,
+                            &doc.hash, name) == 6;
+                doc.name = name;
+                docs.push_back(doc);
+            } else {
+                ok = false;
+            }
+        }
+        fclose(file);
+        return ok;
+    }
+
+    // written next to the old one and renamed over it, so a crash leaves one of the two
+    bool save(const string& dir) const {
+        string path = dir + "/" + MANIFEST_NAME;
+        string temporary = path + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "w");
+        if (!file) return false;
+
+        fprintf(file, "next_doc %d\nnext_segment %d\nflags %u\n", nextDocID, nextSegment, flags);
+        for (int segment : segments) fprintf(file, "segment %d\n", segment);
+        for (const auto& tombstone : tombstones) fprintf(file, "tombstone %d %d\n", tombstone.docID, tombstone.segment);
+        for (const auto& doc : docs) {
+            fprintf(file, "doc %d %d %lu %ld %lu %s\n", doc.docID, doc.segment, doc.size, doc.mtime, doc.hash,
+                    doc.name.c_str());
+        }
+
+        bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+        return ok && rename(temporary.c_str(), path.c_str()) == 0;
+    }
+};
+
+inline string segmentPath(const string& dir, int segment) {
+    return dir + "/seg-" + to_string(segment) + ".idx";
+}
+
+// size and modification time of a file; false if it can not be read
+inline bool fileStamp(const string& path, uint64_t& size, int64_t& mtime) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) return false;
+    size = st.st_size;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+inline uint64_t hashFile(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    uint64_t hash = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            hash = hashWord(string_view((const char*)addr, st.st_size));
+            munmap(addr, st.st_size);
+        }
+    }
+    close(fd);
+    return hash;
+}
+
+/*
+ * Compare the input list (names and the paths they are read from) with the manifest.
+ * Unchanged files keep their document; new and changed files get new IDs, in input
+ * order, and their positions are returned in toIndex; the old version of a changed or
+ * removed file becomes a tombstone. Afterwards the manifest's documents follow the
+ * input list; the new ones have segment 0 until their segment is written.
+ */
+inline void updateDocuments(Manifest& manifest, const vector<string>& names, const vector<string>& paths,
+                            vector<size_t>& toIndex) {
+    unordered_map<string, vector<size_t>> known;
+    for (size_t i = 0; i < manifest.docs.size(); i++) known[manifest.docs[i].name].push_back(i);
+    vector<bool> kept(manifest.docs.size(), false);
+
+    vector<DocEntry> docs;
+    for (size_t i = 0; i < names.size(); i++) {
+        DocEntry doc = {0, 0, 0, 0, 0, names[i]};
+        bool readable = fileStamp(paths[i], doc.size, doc.mtime);
+
+        // a name listed twice is a separate document every time, like in a full build
+        auto it = known.find(names[i]);
+        size_t previous = manifest.docs.size();
+        if (readable && it != known.end()) {
+            for (size_t candidate : it->second) {
+                if (!kept[candidate]) {
+                    previous = candidate;
+                    break;
+                }
+            }
+        }
+
+        if (previous < manifest.docs.size()) {
+            DocEntry& old = manifest.docs[previous];
+            bool same = old.size == doc.size && (old.mtime == doc.mtime || hashFile(paths[i]) == old.hash);
+            if (same) {
+                kept[previous] = true;
+                old.mtime = doc.mtime;
+                docs.push_back(old);
+                continue;
+            }
+        }
+
+        doc.docID = manifest.nextDocID++;
+        doc.hash = readable ? hashFile(paths[i]) : 0;
+        docs.push_back(doc);
+        toIndex.push_back(i);
+    }
+
+    for (size_t i = 0; i < manifest.docs.size(); i++) {
+        if (!kept[i]) manifest.tombstones.push_back({manifest.docs[i].docID, manifest.docs[i].segment});
+    }
+    manifest.docs.swap(docs);
+}
+
+/*
+ * Merge the terms of several indexes in alphabetical order. The file IDs stored in the
+ * indexes go through idMap (0 drops the file); f(term, postings) is called for every
+ * term that still has files, with the postings sorted by the new IDs.
+ */
+template <typename F>
+void mergeTerms(const vector<const IndexReader*>& readers, const vector<int>& idMap, F f) {
+    vector<IndexReader::TermCursor> cursors;
+    cursors.reserve(readers.size());
+    for (const IndexReader* reader : readers) cursors.emplace_back(*reader);
+
+    auto after = [&](int a, int b) { return cursors[a].term() > cursors[b].term(); };
+    priority_queue<int, vector<int>, decltype(after)> heap(after);
+    for (size_t c = 0; c < cursors.size(); c++) {
+        if (cursors[c].valid()) heap.push(c);
+    }
+
+    string term;
+    vector<int> fileIDs;
+    vector<uint32_t> frequencies;
+    vector<pair<int, uint32_t>> merged;
+    Postings postings;
+    while (!heap.empty()) {
+        term = cursors[heap.top()].term();
+        merged.clear();
+
+        while (!heap.empty() && cursors[heap.top()].term() == term) {
+            int c = heap.top();
+            heap.pop();
+
+            cursors[c].postings(fileIDs, &frequencies);
+            for (size_t i = 0; i < fileIDs.size(); i++) {
+                int id = (size_t)fileIDs[i] < idMap.size() ? idMap[fileIDs[i]] : 0;
+                if (id) merged.emplace_back(id, frequencies[i]);
+            }
+
+            cursors[c].next();
+            if (cursors[c].valid()) heap.push(c);
+        }
+        if (merged.empty()) continue;
+
+        sort(merged.begin(), merged.end());
+        postings.fileIDs.resize(merged.size());
+        postings.frequencies.resize(merged.size());
+        for (size_t i = 0; i < merged.size(); i++) {
+            postings.fileIDs[i] = merged[i].first;
+            postings.frequencies[i] = merged[i].second;
+        }
+        f(string_view(term), postings);
+    }
+}
+
+/*
+ * All the live segments of an incremental index seen as one index, with the files
+ * numbered 1 .. numFiles() by their position in the last input list. Same interface
+ * as IndexReader, so the query engine and dumpText work on both.
+ */
+class SegmentedIndex {
+public:
+    bool open(const string& dir) {
+        Manifest manifest;
+        return manifest.load(dir) && open(dir, manifest);
+    }
+
+    bool open(const string& dir, const Manifest& manifest) {
+        readers.clear();
+        unordered_map<int, const IndexReader*> bySegment;
+        for (int segment : manifest.segments) {
+            readers.emplace_back(new IndexReader());
+            if (!readers.back()->open(segmentPath(dir, segment))) return false;
+            bySegment[segment] = readers.back().get();
+        }
+
+        // tombstoned documents are not in the list, so they map to 0 and disappear from the results
+        positionOf.assign(manifest.nextDocID, 0);
+        lengths.assign(manifest.docs.size(), 0);
+        uint64_t totalWords = 0;
+        for (size_t i = 0; i < manifest.docs.size(); i++) {
+            const DocEntry& doc = manifest.docs[i];
+            positionOf[doc.docID] = i + 1;
+            auto it = bySegment.find(doc.segment);
+            if (it != bySegment.end()) lengths[i] = it->second->docLength(doc.docID);
+            totalWords += lengths[i];
+        }
+        avgLength = lengths.empty() ? 0 : (double)totalWords / lengths.size();
+        indexFlags = manifest.flags;
+        return true;
+    }
+
+    uint32_t numFiles() const {
+        return lengths.size();
+    }
+
+    uint32_t flags() const {
+        return indexFlags;
+    }
+
+    // one of the segments met damaged data
+    bool corrupt() const {
+        for (const auto& reader : readers) {
+            if (reader->corrupt()) return true;
+        }
+        return false;
+    }
+
+    uint32_t docLength(int fileID) const {
+        return fileID >= 1 && (size_t)fileID <= lengths.size() ? lengths[fileID - 1] : 0;
+    }
+
+    double avgDocLength() const {
+        return avgLength;
+    }
+
+    bool lookup(string_view word, vector<int>& fileIDs, vector<uint32_t>* frequencies = nullptr) const {
+        vector<pair<int, uint32_t>> merged;
+        vector<int> stored;
+        vector<uint32_t> storedFrequencies;
+        for (const auto& reader : readers) {
+            if (!reader->lookup(word, stored, &storedFrequencies)) continue;
+            for (size_t i = 0; i < stored.size(); i++) {
+                int position = (size_t)stored[i] < positionOf.size() ? positionOf[stored[i]] : 0;
+                if (position) merged.emplace_back(position, storedFrequencies[i]);
+            }
+        }
+
+        // a changed file keeps its position but gets a newer ID, so the order has to be restored
+        sort(merged.begin(), merged.end());
+        fileIDs.resize(merged.size());
+        if (frequencies) frequencies->resize(merged.size());
+        for (size_t i = 0; i < merged.size(); i++) {
+            fileIDs[i] = merged[i].first;
+            if (frequencies) (*frequencies)[i] = merged[i].second;
+        }
+        return !merged.empty();
+    }
+
+    template <typename F>
+    void forEachTerm(F f) const {
+        vector<const IndexReader*> segments;
+        for (const auto& reader : readers) segments.push_back(reader.get());
+        mergeTerms(segments, positionOf, [&](string_view term, const Postings& postings) {
+            f(term, postings.fileIDs);
+        });
+    }
+
+private:
+    vector<unique_ptr<IndexReader>> readers;
+    vector<int> positionOf;         // document ID -> position in the input list, 0 if deleted
+    vector<uint32_t> lengths;       // by position
+    double avgLength = 0;
+    uint32_t indexFlags = 0;
+};
+
+/*
+ * Merge some segments in a new one without the tombstoned documents: the MERGE_FACTOR
+ * smallest ones once there are more than MAX_SEGMENTS, and every segment where the
+ * tombstones are at least half of the documents. Works on its own copy of the
+ * manifest and saves it when done; the old segment files are removed afterwards
+ * (readers that still map them are not affected).
+ */
+inline bool compactSegments(const string& dir, Manifest manifest) {
+    unordered_map<int, size_t> liveDocs, deadDocs;
+    for (const auto& doc : manifest.docs) liveDocs[doc.segment]++;
+    for (const auto& tombstone : manifest.tombstones) deadDocs[tombstone.segment]++;
+
+    vector<pair<uint64_t, int>> bySize;
+    for (int segment : manifest.segments) {
+        struct stat st;
+        bySize.emplace_back(stat(segmentPath(dir, segment).c_str(), &st) == 0 ? st.st_size : 0, segment);
+    }
+    sort(bySize.begin(), bySize.end());
+
+    vector<int> merged;
+    for (size_t i = 0; i < bySize.size(); i++) {
+        int segment = bySize[i].second;
+        bool small = bySize.size() > MAX_SEGMENTS && i < MERGE_FACTOR;
+        bool sparse = deadDocs[segment] > 0 && deadDocs[segment] >= liveDocs[segment];
+        if (small || sparse) merged.push_back(segment);
+    }
+    if (merged.empty()) return true;
+
+    vector<unique_ptr<IndexReader>> readers;
+    vector<const IndexReader*> inputs;
+    unordered_map<int, const IndexReader*> bySegment;
+    for (int segment : merged) {
+        readers.emplace_back(new IndexReader());
+        if (!readers.back()->open(segmentPath(dir, segment))) return false;
+        inputs.push_back(readers.back().get());
+        bySegment[segment] = readers.back().get();
+    }
+
+    // the live documents of the merged segments keep their IDs, the others are dropped
+    vector<int> idMap(manifest.nextDocID, 0);
+    int firstID = manifest.nextDocID, lastID = 0;
+    for (const auto& doc : manifest.docs) {
+        if (!bySegment.count(doc.segment)) continue;
+        idMap[doc.docID] = doc.docID;
+        firstID = min(firstID, doc.docID);
+        lastID = max(lastID, doc.docID);
+    }
+
+    int newSegment = 0;
+    if (lastID > 0) {
+        vector<uint32_t> docLengths(lastID - firstID + 1, 0);
+        for (const auto& doc : manifest.docs) {
+            auto it = bySegment.find(doc.segment);
+            if (it != bySegment.end()) docLengths[doc.docID - firstID] = it->second->docLength(doc.docID);
+        }
+
+        // one section per first letter, like the reducers build them
+        vector<IndexSection> sections(1);
+        vector<pair<string, Postings>> words;
+        char currentLetter = 0;
+        auto flushLetter = [&]() {
+            vector<pair<string_view, const Postings*>> alphabetical;
+            for (const auto& [word, postings] : words) alphabetical.emplace_back(word, &postings);
+            encodeSection(alphabetical, sections.back());
+            words.clear();
+        };
+        mergeTerms(inputs, idMap, [&](string_view term, const Postings& postings) {
+            if (term[0] != currentLetter && !words.empty()) {
+                flushLetter();
+                sections.emplace_back();
+            }
+            currentLetter = term[0];
+            words.emplace_back(string(term), postings);
+        });
+        flushLetter();
+
+        // a damaged segment is left as it is rather than replaced by what could be read of it
+        for (const IndexReader* input : inputs) {
+            if (input->corrupt()) return false;
+        }
+
+        newSegment = manifest.nextSegment++;
+        string path = segmentPath(dir, newSegment);
+        if (!writeIndex(path + ".tmp", sections, docLengths, firstID, manifest.flags) || rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+            return false;
+        }
+    }
+
+    auto isMerged = [&](int segment) { return bySegment.count(segment) > 0; };
+    for (auto& doc : manifest.docs) {
+        if (isMerged(doc.segment)) doc.segment = newSegment;
+    }
+    manifest.tombstones.erase(remove_if(manifest.tombstones.begin(), manifest.tombstones.end(),
+                                        [&](const Tombstone& tombstone) { return isMerged(tombstone.segment); }),
+                              manifest.tombstones.end());
+    manifest.segments.erase(remove_if(manifest.segments.begin(), manifest.segments.end(), isMerged),
+                            manifest.segments.end());
+    if (newSegment) manifest.segments.push_back(newSegment);
+
+    if (!manifest.save(dir)) return false;
+    for (int segment : merged) unlink(segmentPath(dir, segment).c_str());
+    return true;
+}
+
+#endif
@@ -0,0 +1,511 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "interner.h"
+#include "index_format.h"
+#include "text_output.h"
+
+using namespace std;
+
+/*
+ * Streaming mode (--memory-budget): instead of keeping every partial list until the
+ * reducers start, a mapper writes its records as a sorted run once they (and the words
+ * they point to) use more than its share of the budget, and starts over with empty
+ * buckets and an empty interner. Each reducer then merges the runs of its letters.
+ *
+ * Every mapper appends its runs to one temporary file and every reducer that has to
+ * sort more output than it can hold does the same; the files are unlinked as soon as
+ * they are created, so they disappear with the descriptor (or the process).
+ *
+ * A run of a mapper has one section per letter with the records sorted by (word, file ID),
+ * front coded: varint shared prefix, varint suffix length, suffix, varint file ID, varint
+ * frequency. The front coding restarts at every section.
+ *
+ * The memory of a reducer grows with the number of runs it reads at once, so a mapper
+ * merges its runs like a log structured merge tree: SPILL_FAN_IN runs of one level become
+ * one run of the next level, and once it is done the oldest runs are merged until it
+ * has no more than the reducers can take.
+ */
+
+#define SPILL_WRITE_BUFFER (1 << 16)
+#define SPILL_READ_BUFFER_MIN (1 << 12)
+#define SPILL_READ_BUFFER_MAX (1 << 20)
+#define SPILL_CHECK_WORDS 4096          // words a mapper processes between two checks of its memory
+#define SPILL_FAN_IN 16                 // runs of one level merged together
+#ifndef MIN_THREAD_BUDGET
+#define MIN_THREAD_BUDGET (4 << 20)     // a thread never gets less of the budget than this
+#endif
+
+// create an anonymous temporary file in $TMPDIR (or /tmp); -1 on error
+inline int createSpillFile() {
+    const char* dir = getenv("TMPDIR");
+    string path = string(dir && *dir ? dir : "/tmp") + "/ii-spill-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd >= 0) unlink(path.c_str());
+    return fd;
+}
+
+// appends to a spill file through a small buffer
+class SpillWriter {
+public:
+    void open(int file) {
+        fd = file;
+        written = lseek(fd, 0, SEEK_END);
+    }
+
+    uint64_t offset() const {
+        return written + buffer.size();
+    }
+
+    void writeVarint(uint64_t value) {
+        putVarint(buffer, value);
+        if (buffer.size() >= SPILL_WRITE_BUFFER) flush();
+    }
+
+    void writeBytes(const char* data, size_t size) {
+        buffer.insert(buffer.end(), data, data + size);
+        if (buffer.size() >= SPILL_WRITE_BUFFER) flush();
+    }
+
+    bool flush() {
+        size_t done = 0;
+        while (ok && done < buffer.size()) {
+            ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+            if (n <= 0) ok = false;
+            else done += n;
+        }
+        written += buffer.size();
+        buffer.clear();
+        return ok;
+    }
+
+private:
+    int fd = -1;
+    uint64_t written = 0;
+    vector<uint8_t> buffer;
+    bool ok = true;
+};
+
+// reads a byte range of a spill file; several readers can share the descriptor
+class SpillReader {
+public:
+    void open(int file, uint64_t begin, uint64_t end, size_t bufferSize) {
+        fd = file;
+        position = begin;
+        limit = end;
+        buffer.resize(bufferSize);
+        pos = filled = 0;
+    }
+
+    bool atEnd() const {
+        return pos == filled && position == limit;
+    }
+
+    uint64_t readVarint() {
+        uint64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = readByte();
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        return value;
+    }
+
+    void appendBytes(string& out, size_t size) {
+        while (size > 0) {
+            if (pos == filled) refill();
+            size_t n = min(size, filled - pos);
+            out.append((const char*)buffer.data() + pos, n);
+            pos += n;
+            size -= n;
+        }
+    }
+
+private:
+    int fd = -1;
+    uint64_t position = 0, limit = 0;
+    vector<uint8_t> buffer;
+    size_t pos = 0, filled = 0;
+
+    uint8_t readByte() {
+        if (pos == filled) refill();
+        return buffer[pos++];
+    }
+
+    void refill() {
+        size_t size = min((uint64_t)buffer.size(), limit - position);
+        ssize_t n = size > 0 ? pread(fd, buffer.data(), size, position) : 0;
+        if (n <= 0) {
+            // a truncated spill file reads as zeros instead of looping forever
+            buffer[0] = 0;
+            n = 1;
+            position = limit;
+        } else {
+            position += n;
+        }
+        filled = n;
+        pos = 0;
+    }
+};
+
+// runs written by one mapper: offsets of the sections of every run in its spill file
+struct MapperSpill {
+    int fd = -1;
+    vector<vector<uint64_t>> runs;      // NR_LETTERS + 1 offsets per run
+    vector<int> levels;                 // 0 for a run written from memory, +1 for every merge
+};
+
+static inline void writeRecord(SpillWriter& writer, string_view previous, string_view word, int fileID,
+                               uint32_t frequency) {
+    size_t shared = 0;
+    size_t limit = min(previous.size(), word.size());
+    while (shared < limit && previous[shared] == word[shared]) shared++;
+
+    writer.writeVarint(shared);
+    writer.writeVarint(word.size() - shared);
+    writer.writeBytes(word.data() + shared, word.size() - shared);
+    writer.writeVarint(fileID);
+    writer.writeVarint(frequency);
+}
+
+// sort the buckets by (word, file ID) and append them to the mapper's spill file as a new run
+inline bool spillBuckets(MapperSpill& spill, PartialList& buckets) {
+    if (spill.fd < 0) spill.fd = createSpillFile();
+    if (spill.fd < 0) return false;
+
+    SpillWriter writer;
+    writer.open(spill.fd);
+    vector<uint64_t> sections;
+    for (auto& bucket : buckets) {
+        sections.push_back(writer.offset());
+        sort(bucket.begin(), bucket.end(), [](const WordRef& a, const WordRef& b) {
+            int order = a.view().compare(b.view());
+            return order != 0 ? order < 0 : a.fileID < b.fileID;
+        });
+
+        string_view previous;
+        for (const WordRef& ref : bucket) {
+            writeRecord(writer, previous, ref.view(), ref.fileID, ref.frequency);
+            previous = ref.view();
+        }
+    }
+    sections.push_back(writer.offset());
+    spill.runs.push_back(move(sections));
+    spill.levels.push_back(0);
+    return writer.flush();
+}
+
+// walks the records of one letter of one run
+class RunCursor {
+public:
+    void open(int fd, uint64_t begin, uint64_t end, size_t bufferSize) {
+        reader.open(fd, begin, end, bufferSize);
+        word.clear();
+        next();
+    }
+
+    bool valid = false;
+    string word;
+    int fileID = 0;
+    uint32_t frequency = 0;
+
+    void next() {
+        valid = !reader.atEnd();
+        if (!valid) return;
+
+        size_t shared = reader.readVarint();
+        size_t suffix = reader.readVarint();
+        word.resize(min(shared, word.size()));
+        reader.appendBytes(word, suffix);
+        fileID = reader.readVarint();
+        frequency = reader.readVarint();
+    }
+
+private:
+    SpillReader reader;
+};
+
+/*
+ * Merge the given sections (one per run) and call f(word, postings) for every word in
+ * alphabetical order, with its file IDs sorted; the records of a word and a file found in
+ * different runs (chunks of a file, or a run cut in the middle of a task) are added up.
+ */
+template <typename F>
+void mergeRuns(const vector<MapperSpill>& spills, int section, size_t bufferSize, F f) {
+    vector<RunCursor> cursors;
+    for (const auto& spill : spills) {
+        for (const auto& run : spill.runs) {
+            if (run[section] == run[section + 1]) continue;
+            cursors.emplace_back();
+            cursors.back().open(spill.fd, run[section], run[section + 1], bufferSize);
+        }
+    }
+
+    auto after = [&](int a, int b) {
+        int order = cursors[a].word.compare(cursors[b].word);
+        return order != 0 ? order > 0 : cursors[a].fileID > cursors[b].fileID;
+    };
+    priority_queue<int, vector<int>, decltype(after)> heap(after);
+    for (size_t c = 0; c < cursors.size(); c++) {
+        if (cursors[c].valid) heap.push(c);
+    }
+
+    string word;
+    Postings postings;
+    while (!heap.empty()) {
+        int c = heap.top();
+        heap.pop();
+        RunCursor& cursor = cursors[c];
+
+        if (cursor.word != word) {
+            if (!postings.fileIDs.empty()) f(string_view(word), postings);
+            word = cursor.word;
+            postings.fileIDs.clear();
+            postings.frequencies.clear();
+        }
+        if (!postings.fileIDs.empty() && postings.fileIDs.back() == cursor.fileID) {
+            postings.frequencies.back() += cursor.frequency;
+        } else {
+            postings.fileIDs.push_back(cursor.fileID);
+            postings.frequencies.push_back(cursor.frequency);
+        }
+
+        cursor.next();
+        if (cursor.valid) heap.push(c);
+    }
+    if (!postings.fileIDs.empty()) f(string_view(word), postings);
+}
+
+// merge the chosen runs of a mapper in one run of the given level, reading them with at most
+// the given memory, and give their space back
+inline bool mergeSpilledRuns(MapperSpill& spill, const vector<size_t>& chosen, int level, size_t memory) {
+    size_t bufferSize = clamp(memory / chosen.size(), (size_t)SPILL_READ_BUFFER_MIN, (size_t)SPILL_READ_BUFFER_MAX);
+    vector<MapperSpill> merged(1);
+    merged[0].fd = spill.fd;
+    for (size_t r : chosen) merged[0].runs.push_back(spill.runs[r]);
+
+    SpillWriter writer;
+    writer.open(spill.fd);
+    vector<uint64_t> sections;
+    for (size_t section = 0; section + 1 < merged[0].runs[0].size(); section++) {
+        sections.push_back(writer.offset());
+        string previous;
+        mergeRuns(merged, section, bufferSize, [&](string_view word, const Postings& postings) {
+            for (size_t i = 0; i < postings.fileIDs.size(); i++) {
+                writeRecord(writer, i == 0 ? string_view(previous) : word, word, postings.fileIDs[i],
+                            postings.frequencies[i]);
+            }
+            previous.assign(word);
+        });
+    }
+    sections.push_back(writer.offset());
+    if (!writer.flush()) return false;
+
+    vector<vector<uint64_t>> runs;
+    vector<int> levels;
+    for (size_t r = 0; r < spill.runs.size(); r++) {
+        if (find(chosen.begin(), chosen.end(), r) != chosen.end()) {
+            // the file keeps its size, the blocks of the old run are freed
+            fallocate(spill.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, spill.runs[r].front(),
+                      spill.runs[r].back() - spill.runs[r].front());
+        } else {
+            runs.push_back(move(spill.runs[r]));
+            levels.push_back(spill.levels[r]);
+        }
+    }
+    runs.push_back(move(sections));
+    levels.push_back(level);
+    spill.runs.swap(runs);
+    spill.levels.swap(levels);
+    return true;
+}
+
+// merge every level that has SPILL_FAN_IN runs into the next one
+inline bool mergeFullLevels(MapperSpill& spill, size_t memory) {
+    for (int level = 0;; level++) {
+        vector<size_t> chosen;
+        for (size_t r = 0; r < spill.runs.size(); r++) {
+            if (spill.levels[r] == level) chosen.push_back(r);
+        }
+        if (chosen.size() < SPILL_FAN_IN) return true;
+        if (!mergeSpilledRuns(spill, chosen, level + 1, memory)) return false;
+    }
+}
+
+// merge the smallest runs (the lowest levels) until at most maxRuns are left
+inline bool limitRuns(MapperSpill& spill, size_t maxRuns, size_t memory) {
+    if (spill.runs.size() <= max(maxRuns, (size_t)1)) return true;
+
+    vector<size_t> order(spill.runs.size());
+    for (size_t r = 0; r < order.size(); r++) order[r] = r;
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) { return spill.levels[a] < spill.levels[b]; });
+    order.resize(spill.runs.size() - max(maxRuns, (size_t)1) + 1);
+
+    int level = 0;
+    for (size_t r : order) level = max(level, spill.levels[r] + 1);
+    return mergeSpilledRuns(spill, order, level, memory);
+}
+
+/*
+ * Puts the entries of a letter in the order of the output file (number of files
+ * descending, then alphabetically) within a memory limit: the entries are kept
+ * serialized in one buffer, and every time it is full they are sorted and written
+ * as a run; the runs are merged while writing the output.
+ */
+class EntrySorter {
+public:
+    EntrySorter(size_t memoryLimit, size_t readBufferSize) : memoryLimit(memoryLimit), readBufferSize(readBufferSize) {}
+
+    ~EntrySorter() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool add(string_view word, const vector<int>& fileIDs) {
+        // both buffers get their whole share once, so they never grow past the limit by reallocating
+        if (keys.capacity() == 0) {
+            data.reserve(memoryLimit / 4 * 3);
+            keys.reserve(max((size_t)1, memoryLimit / 4 / sizeof(Key)));
+        }
+        size_t maxSize = word.size() + fileIDs.size() * 5;
+        if (!keys.empty() && (keys.size() == keys.capacity() || data.size() + maxSize > data.capacity())) {
+            if (!spill()) return false;
+        }
+
+        keys.push_back({(uint32_t)fileIDs.size(), (uint32_t)word.size(), data.size()});
+        data.insert(data.end(), word.begin(), word.end());
+        int last = 0;
+        for (int fileID : fileIDs) {
+            putVarint(data, fileID - last);
+            last = fileID;
+        }
+        return true;
+    }
+
+    bool write(LetterWriter& out) {
+        if (runs.empty()) {
+            sortKeys();
+            vector<int> fileIDs;
+            for (const Key& key : keys) {
+                const uint8_t* pos = data.data() + key.offset + key.length;
+                decodeIDs(pos, key.count, fileIDs);
+                out.add(string_view((const char*)data.data() + key.offset, key.length), fileIDs);
+            }
+            return true;
+        }
+        if (!keys.empty() && !spill()) return false;
+
+        vector<Cursor> cursors(runs.size());
+        auto after = [&](int a, int b) { return before(cursors[b], cursors[a]); };
+        priority_queue<int, vector<int>, decltype(after)> heap(after);
+        for (size_t r = 0; r < runs.size(); r++) {
+            cursors[r].reader.open(fd, runs[r].first, runs[r].second, readBufferSize);
+            if (cursors[r].next()) heap.push(r);
+        }
+
+        while (!heap.empty()) {
+            int r = heap.top();
+            heap.pop();
+            out.add(cursors[r].word, cursors[r].fileIDs);
+            if (cursors[r].next()) heap.push(r);
+        }
+        return true;
+    }
+
+private:
+    struct Key {
+        uint32_t count;
+        uint32_t length;
+        size_t offset;      // of the word in data, followed by the file IDs (delta varints)
+    };
+
+    struct Cursor {
+        SpillReader reader;
+        string word;
+        vector<int> fileIDs;
+
+        bool next() {
+            if (reader.atEnd()) return false;
+            size_t count = reader.readVarint();
+            size_t length = reader.readVarint();
+            word.clear();
+            reader.appendBytes(word, length);
+            fileIDs.resize(count);
+            int last = 0;
+            for (size_t i = 0; i < count; i++) {
+                last += reader.readVarint();
+                fileIDs[i] = last;
+            }
+            return true;
+        }
+    };
+
+    size_t memoryLimit;
+    size_t readBufferSize;
+    vector<uint8_t> data;
+    vector<Key> keys;
+    int fd = -1;
+    vector<pair<uint64_t, uint64_t>> runs;
+
+    static bool before(const Cursor& a, const Cursor& b) {
+        if (a.fileIDs.size() != b.fileIDs.size()) return a.fileIDs.size() > b.fileIDs.size();
+        return a.word < b.word;
+    }
+
+    static void decodeIDs(const uint8_t* pos, uint32_t count, vector<int>& fileIDs) {
+        fileIDs.resize(count);
+        int last = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            last += getVarint(pos);
+            fileIDs[i] = last;
+        }
+    }
+
+    void sortKeys() {
+        const char* base = (const char*)data.data();
+        sort(keys.begin(), keys.end(), [base](const Key& a, const Key& b) {
+            if (a.count != b.count) return a.count > b.count;
+            return string_view(base + a.offset, a.length) < string_view(base + b.offset, b.length);
+        });
+    }
+
+    bool spill() {
+        if (fd < 0) fd = createSpillFile();
+        if (fd < 0) return false;
+
+        sortKeys();
+        SpillWriter writer;
+        writer.open(fd);
+        uint64_t begin = writer.offset();
+        for (const Key& key : keys) {
+            writer.writeVarint(key.count);
+            writer.writeVarint(key.length);
+            writer.writeBytes((const char*)data.data() + key.offset, key.length);
+
+            // the file IDs are already delta encoded
+            const uint8_t* pos = data.data() + key.offset + key.length;
+            const uint8_t* start = pos;
+            for (uint32_t i = 0; i < key.count; i++) getVarint(pos);
+            writer.writeBytes((const char*)start, pos - start);
+        }
+        runs.emplace_back(begin, writer.offset());
+
+        data.clear();
+        keys.clear();
+        return writer.flush();
+    }
+};
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+using namespace std;
+
+// what a thread is doing; the time of a thread is always charged to exactly one phase
+enum Phase {
+    PHASE_OTHER,          // anything not listed below (thread start, bookkeeping)
+    PHASE_SCHEDULE,       // main: reading the input list, stat of the files, building the tasks
+    PHASE_SAMPLE,         // main: estimating the size of the letters
+    PHASE_MAP_FILE,       // mapper: open, mmap and munmap of the input files
+    PHASE_NORMALIZE,      // mapper: page faults of the mapping (the file I/O) and the normalization kernel
+    PHASE_TOKENIZE,       // mapper: splitting words, interning (dedup per file) and the shuffle in buckets
+    PHASE_MERGE_CHUNKS,   // mapper: putting the chunks of a split file together
+    PHASE_SPILL,          // mapper: sorting and writing runs, merging them (streaming mode)
+    PHASE_PUBLISH,        // mapper: handing a finished file to the reducers (waking them up)
+    PHASE_LOG_WAIT,       // reducer: waiting for the mappers to publish a file
+    PHASE_BARRIER_WAIT,   // waiting at the barrier (streaming mode)
+    PHASE_LOCK_WAIT,      // waiting for a mutex
+    PHASE_AGGREGATE,      // reducer: gathering the words of its letters from the partial lists
+    PHASE_MERGE_RUNS,     // reducer: merging the runs of the mappers (streaming mode)
+    PHASE_SORT,           // reducer: sorting the words of a letter
+    PHASE_WRITE,          // text output
+    PHASE_ENCODE,         // reducer: encoding its sections of the binary index
+    PHASE_EXCHANGE,       // main: sending the buckets and the binary index between the ranks (MPI build)
+    PHASE_INDEX,          // main: writing the binary index, the segment and the manifest
+    PHASE_JOIN,           // main: waiting for the other threads
+    NR_PHASES
+};
+
+static const char* const phaseNames[NR_PHASES] = {
+    "other", "schedule", "sample", "map_file", "normalize", "tokenize", "merge_chunks", "spill", "publish",
+    "log_wait", "barrier_wait", "lock_wait", "aggregate", "merge_runs", "sort", "write", "encode", "exchange", "index", "join"
+};
+
+enum Counter {
+    COUNT_BYTES_READ,     // bytes of the input files processed
+    COUNT_WORDS,          // valid words found (mappers) or distinct words written (reducers)
+    COUNT_RECORDS,        // (word, file) records produced (mappers) or aggregated (reducers)
+    COUNT_TASKS,          // tasks (files or chunks) processed
+    COUNT_STOLEN_TASKS,   // tasks taken from the deque of another mapper
+    COUNT_FILES,          // files received from the completion log
+    COUNT_RUNS,           // runs written to the spill file
+    COUNT_BYTES_WRITTEN,  // bytes of text output and binary index
+    NR_COUNTERS
+};
+
+static const char* const counterNames[NR_COUNTERS] = {
+    "bytes_read", "words", "records", "tasks", "stolen_tasks", "files", "runs", "bytes_written"
+};
+
+static inline uint64_t clockNanos(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Time and counters of one thread, only ever touched by that thread. The time is
+ * charged to the current phase every time the phase changes, so nested phases are
+ * exclusive (a spill in the middle of tokenizing is not counted twice) and the phases
+ * add up to the lifetime of the thread. Aligned so that threads never share a line.
+ */
+struct alignas(64) ThreadStats {
+    string role;
+    int index = 0;
+
+    uint64_t wall[NR_PHASES] = {0};       // nanoseconds
+    uint64_t cpu[NR_PHASES] = {0};
+    uint64_t counters[NR_COUNTERS] = {0};
+
+    Phase current = PHASE_OTHER;
+    uint64_t startWall = 0, startCpu = 0;
+    uint64_t lastWall = 0, lastCpu = 0;
+    uint64_t totalWall = 0, totalCpu = 0;
+
+    void begin() {
+        startWall = lastWall = clockNanos(CLOCK_MONOTONIC);
+        startCpu = lastCpu = clockNanos(CLOCK_THREAD_CPUTIME_ID);
+        current = PHASE_OTHER;
+    }
+
+    // charge the time since the last change to the current phase and make the given one current
+    Phase enter(Phase phase) {
+        uint64_t nowWall = clockNanos(CLOCK_MONOTONIC);
+        uint64_t nowCpu = clockNanos(CLOCK_THREAD_CPUTIME_ID);
+        wall[current] += nowWall - lastWall;
+        cpu[current] += nowCpu - lastCpu;
+        lastWall = nowWall;
+        lastCpu = nowCpu;
+
+        Phase previous = current;
+        current = phase;
+        return previous;
+    }
+
+    void end() {
+        enter(PHASE_OTHER);
+        totalWall = lastWall - startWall;
+        totalCpu = lastCpu - startCpu;
+    }
+};
+
+// charges its scope to a phase, then goes back to the enclosing one; does nothing without stats
+class PhaseTimer {
+public:
+    PhaseTimer(ThreadStats* stats, Phase phase) : stats(stats) {
+        if (stats) previous = stats->enter(phase);
+    }
+
+    ~PhaseTimer() {
+        if (stats) stats->enter(previous);
+    }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    ThreadStats* stats;
+    Phase previous = PHASE_OTHER;
+};
+
+static inline void countStat(ThreadStats* stats, Counter counter, uint64_t value = 1) {
+    if (stats) stats->counters[counter] += value;
+}
+
+// pthread_mutex_lock that charges the time spent waiting to PHASE_LOCK_WAIT (only if the mutex is taken)
+static inline void lockMutex(pthread_mutex_t* mutex, ThreadStats* stats) {
+    if (!stats || pthread_mutex_trylock(mutex) != 0) {
+        PhaseTimer timer(stats, PHASE_LOCK_WAIT);
+        pthread_mutex_lock(mutex);
+    }
+}
+
+static inline void writeSeconds(ostream& out, uint64_t nanos) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.6f", nanos / 1e9);
+    out << text;
+}
+
+static inline void writeThreadStats(ostream& out, const ThreadStats& stats) {
+    out << "{\"role\": \"" << stats.role << "\", \"index\": " << stats.index << ", \"wall\": ";
+    writeSeconds(out, stats.totalWall);
+    out << ", \"cpu\": ";
+    writeSeconds(out, stats.totalCpu);
+
+    // phases and counters a thread never used are left out
+    out << ", \"phases\": {";
+    bool first = true;
+    for (int p = 0; p < NR_PHASES; p++) {
+        if (!stats.wall[p] && !stats.cpu[p]) continue;
+        out << (first ? "" : ", ") << "\"" << phaseNames[p] << "\": {\"wall\": ";
+        writeSeconds(out, stats.wall[p]);
+        out << ", \"cpu\": ";
+        writeSeconds(out, stats.cpu[p]);
+        out << "}";
+        first = false;
+    }
+
+    out << "}, \"counters\": {";
+    first = true;
+    for (int c = 0; c < NR_COUNTERS; c++) {
+        if (!stats.counters[c]) continue;
+        out << (first ? "" : ", ") << "\"" << counterNames[c] << "\": " << stats.counters[c];
+        first = false;
+    }
+    out << "}}";
+}
+
+/*
+ * The whole report. The summary fields come first, one per line, so that scripts can
+ * pick them with grep; the threads follow, one per line, main thread first.
+ */
+static inline void writeStats(ostream& out, const vector<ThreadStats>& threads, int nrMappers, int nrReducers,
+                              size_t nrFiles, bool overlap, bool streaming) {
+    uint64_t mapWall = 0, reduceWall = 0, cpu = 0, bytesRead = 0, words = 0;
+    uint64_t lockWait = 0, barrierWait = 0, logWait = 0;
+    for (const auto& stats : threads) {
+        if (stats.role == "mapper") mapWall = max(mapWall, stats.totalWall);
+        if (stats.role == "reducer") reduceWall = max(reduceWall, stats.totalWall);
+        if (stats.role == "mapper") words += stats.counters[COUNT_WORDS];
+        cpu += stats.totalCpu;
+        bytesRead += stats.counters[COUNT_BYTES_READ];
+        lockWait += stats.wall[PHASE_LOCK_WAIT];
+        barrierWait += stats.wall[PHASE_BARRIER_WAIT];
+        logWait += stats.wall[PHASE_LOG_WAIT];
+    }
+
+    out << "{\n";
+    out << "  \"mappers\": " << nrMappers << ",\n";
+    out << "  \"reducers\": " << nrReducers << ",\n";
+    out << "  \"files\": " << nrFiles << ",\n";
+    out << "  \"overlap\": " << (overlap ? "true" : "false") << ",\n";
+    out << "  \"streaming\": " << (streaming ? "true" : "false") << ",\n";
+    out << "  \"bytes_read\": " << bytesRead << ",\n";
+    out << "  \"words\": " << words << ",\n";
+    out << "  \"wall_seconds\": ";
+    writeSeconds(out, threads[0].totalWall);
+    out << ",\n  \"cpu_seconds\": ";
+    writeSeconds(out, cpu);
+    out << ",\n  \"map_wall_seconds\": ";
+    writeSeconds(out, mapWall);
+    out << ",\n  \"reduce_wall_seconds\": ";
+    writeSeconds(out, reduceWall);
+    out << ",\n  \"log_wait_seconds\": ";
+    writeSeconds(out, logWait);
+    out << ",\n  \"barrier_wait_seconds\": ";
+    writeSeconds(out, barrierWait);
+    out << ",\n  \"lock_wait_seconds\": ";
+    writeSeconds(out, lockWait);
+    out << ",\n  \"threads\": [\n";
+    for (size_t t = 0; t < threads.size(); t++) {
+        out << "    ";
+        writeThreadStats(out, threads[t]);
+        out << (t + 1 < threads.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef TEXT_OUTPUT_H
+#define TEXT_OUTPUT_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <charconv>
+#include <cstring>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+using namespace std;
+
+#ifndef TEXT_WRITE_BUFFER
+#define TEXT_WRITE_BUFFER (1 << 25) // a letter file bigger than this is written in several parts
+#endif
+
+#define NR_LETTERS 26                                  // buckets of the words starting with an ASCII letter
+#define FIRST_UTF8_LEAD 0xC2                           // lowest first byte of a multibyte UTF-8 character
+#define NR_UTF8_BUCKETS (NR_LETTERS + 0xF4 - FIRST_UTF8_LEAD + 1)
+
+/*
+ * Bucket of a (normalized) word. In UTF-8 mode the words starting with a non-ASCII
+ * character get one bucket per first byte: each covers a range of code points (often a
+ * script), and the buckets stay in the byte order of the words, so the sections of the
+ * binary index are still sorted when they are concatenated.
+ */
+static inline int bucketOf(string_view word) {
+    unsigned char first = word[0];
+    return first < 0x80 ? first - 'a' : NR_LETTERS + first - FIRST_UTF8_LEAD;
+}
+
+// output file of a bucket: the letter, or u + the first code point of its range (u00c0.txt for 0xc3)
+inline string bucketFileName(int bucket) {
+    if (bucket < NR_LETTERS) return string(1, 'a' + bucket) + ".txt";
+
+    // e0 and f0 start after the longest code point of the shorter sequences
+    int lead = FIRST_UTF8_LEAD + bucket - NR_LETTERS;
+    int firstCodePoint = lead < 0xE0 ? (lead & 0x1F) << 6
+                         : lead < 0xF0 ? max((lead & 0x0F) << 12, 0x800)
+                                       : max((lead & 0x07) << 18, 0x10000);
+    char name[16];
+    snprintf(name, sizeof(name), "u%04x.txt", firstCodePoint);
+    return name;
+}
+
+inline void writeEntry(ostream& out, string_view word, const vector<int>& IDs) {
+    out << word << ":[";
+    for (size_t j = 0; j < IDs.size(); j++) {
+        out << IDs[j];
+        if (j != IDs.size() - 1) {
+            out << " ";
+        }
+    }
+    out << "]\n";
+}
+
+/*
+ * Output file of a letter. The entries are formatted straight into one buffer
+ * (to_chars for the IDs) and the whole file goes out with a single write when it is
+ * closed, instead of a stream flushed on every line. Only a file bigger than the
+ * flush size is written in several parts, which bounds the memory of the buffer.
+ */
+class LetterWriter {
+public:
+    explicit LetterWriter(size_t flushSize = TEXT_WRITE_BUFFER) : flushSize(flushSize) {}
+
+    LetterWriter(const LetterWriter&) = delete;
+    LetterWriter& operator=(const LetterWriter&) = delete;
+
+    ~LetterWriter() {
+        close();
+    }
+
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = fd >= 0;
+        return ok;
+    }
+
+    // upper bound of the size of an entry: a file ID takes at most 10 digits and a separator
+    static size_t maxEntrySize(size_t wordLength, size_t nrIDs) {
+        return wordLength + 3 + nrIDs * 11;
+    }
+
+    // room for this many bytes of entries, up to the flush size; the buffer is not initialized,
+    // so an estimate that is too big only costs address space
+    void reserve(size_t bytes) {
+        grow(min(bytes, flushSize));
+    }
+
+    void add(string_view word, const vector<int>& IDs) {
+        add(word, IDs.data(), IDs.size());
+    }
+
+    void add(string_view word, const int* IDs, size_t nrIDs) {
+        size_t needed = maxEntrySize(word.size(), nrIDs);
+        if (used + needed > capacity) {
+            if (used > 0 && used + needed > flushSize) flush();
+            grow(max(capacity * 2, used + needed));
+        }
+
+        char* out = buffer.get() + used;
+        char* end = buffer.get() + capacity;
+        memcpy(out, word.data(), word.size());
+        out += word.size();
+        *out++ = ':';
+        *out++ = '[';
+        for (size_t j = 0; j < nrIDs; j++) {
+            if (j > 0) *out++ = ' ';
+            out = to_chars(out, end, IDs[j]).ptr;
+        }
+        *out++ = ']';
+        *out++ = '\n';
+        used = out - buffer.get();
+    }
+
+    // writes what is left and closes the file; false if anything could not be written
+    bool close() {
+        if (fd < 0) return ok;
+        flush();
+        if (::close(fd) != 0) ok = false;
+        fd = -1;
+        buffer.reset();
+        capacity = 0;
+        return ok;
+    }
+
+    uint64_t bytesWritten() const {
+        return written + used;
+    }
+
+private:
+    int fd = -1;
+    bool ok = false;
+    size_t flushSize;
+    unique_ptr<char[]> buffer;
+    size_t capacity = 0;
+    size_t used = 0;
+    uint64_t written = 0;
+
+    void grow(size_t size) {
+        if (size <= capacity) return;
+        unique_ptr<char[]> bigger(new char[size]);
+        if (used > 0) memcpy(bigger.get(), buffer.get(), used);
+        buffer = move(bigger);
+        capacity = size;
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (ok && done < used) {
+            ssize_t n = write(fd, buffer.get() + done, used - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) ok = false;
+            else done += n;
+        }
+        written += used;
+        used = 0;
+    }
+};
+
+// write the a.txt ... z.txt files of the indexer from any index with a forEachTerm(f(term, fileIDs))
+// that visits the terms in alphabetical order
+template <typename Index>
+int dumpText(const Index& index, const string& outputDir) {
+    mkdir(outputDir.c_str(), 0755);
+
+    // the terms come in alphabetical order, so each bucket is a contiguous run
+    vector<pair<string, vector<int>>> wordsWithCurrentLetter;
+    int currentLetter = -1;
+    bool ok = true;
+
+    auto flushLetter = [&]() {
+        if (currentLetter < 0) return;
+
+        // same order as the indexer: number of files descending, then alphabetically
+        stable_sort(wordsWithCurrentLetter.begin(), wordsWithCurrentLetter.end(),
+                    [](const auto& a, const auto& b) { return a.second.size() > b.second.size(); });
+
+        string filename = outputDir + "/" + bucketFileName(currentLetter);
+        LetterWriter outFile;
+        if (!outFile.open(filename)) {
+            cout << "Error creating file: " << filename << endl;
+            ok = false;
+            return;
+        }
+
+        size_t bytes = 0;
+        for (const auto& [word, IDs] : wordsWithCurrentLetter) bytes += LetterWriter::maxEntrySize(word.size(), IDs.size());
+        outFile.reserve(bytes);
+        for (const auto& [word, IDs] : wordsWithCurrentLetter) outFile.add(word, IDs);
+        if (!outFile.close()) {
+            cout << "Error writing file: " << filename << endl;
+            ok = false;
+        }
+        wordsWithCurrentLetter.clear();
+    };
+
+    index.forEachTerm([&](string_view term, const vector<int>& fileIDs) {
+        if (bucketOf(term) != currentLetter) {
+            flushLetter();
+            currentLetter = bucketOf(term);
+        }
+        wordsWithCurrentLetter.emplace_back(string(term), fileIDs);
+    });
+    flushLetter();
+
+    // the indexer also creates the files of the letters without words
+    for (int letter = 0; letter < NR_LETTERS; letter++) {
+        ofstream(outputDir + "/" + bucketFileName(letter), ios::app);
+    }
+
+    return ok ? 0 : 1;
+}
+
+#endif